@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* AppConfig.h - compile time options of the i2cmegausb firmware	     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef _APP_CONFIG_H_
+#define _APP_CONFIG_H_
+
+/* TWI engine data ring, power of two <= 128. Two control endpoint
+ * packets, so reads can fill one while USB sends the other. */
+#if defined(I2C_USB_LOWSPEED)
+#define TWI_BUFSIZE             16
+#else
+#define TWI_BUFSIZE             128
+#endif
+
+/* Trace ring buffer events, power of two <= 128 or 0 to leave tracing
+ * out. Set with TRACE_EVENTS on the make command line. */
+#ifndef I2C_TRACE_EVENTS
+#define I2C_TRACE_EVENTS        32
+#endif
+
+/* CPU cycle counters per code path, for benchmarking. Set with PROFILE=1
+ * on the make command line. */
+#ifndef I2C_PROFILE
+#define I2C_PROFILE             0
+#endif
+
+/* Transaction counters and latency histograms read with CMD_GET_STATS.
+ * Set STATS=0 on the make command line to leave them out. */
+#ifndef I2C_STATS
+#define I2C_STATS               1
+#endif
+
+/* Time in µs a bus phase may take beyond its nominal length before the
+ * bus is recovered, until the host sets another with CMD_SET_TIMEOUT */
+#define I2C_TIMEOUT_US          2000
+
+/* Bus scans: timeout of a probe in µs, see I2C_TIMEOUT_US */
+#define I2C_SCAN_TIMEOUT_US     100
+
+/* Fan-out writes: payload bytes, at most TWI_BUFSIZE so that a whole
+ * message fits into the engine's buffer */
+#if defined(I2C_USB_LOWSPEED)
+#define I2C_FANOUT_MAXLEN       16
+#else
+#define I2C_FANOUT_MAXLEN       32
+#endif
+
+/* Second bus, bit-banged by swi.c from Timer3: SCL on PB6 and SDA on
+ * PB5 (D10 and D9 on the Leonardo), with the internal pull-ups on. The
+ * clock is limited to I2C_SWI_MAXFREQ, as every half SCL period costs
+ * an interrupt. */
+#define I2C_SWI_DDR             DDRB
+#define I2C_SWI_PORT            PORTB
+#define I2C_SWI_PIN             PINB
+#define I2C_SWI_SCL             PB6
+#define I2C_SWI_SDA             PB5
+#define I2C_SWI_MAXFREQ         50000
+
+/* Scripts run by CMD_RUN_SCRIPT: bytes of a script, of the read data it
+ * returns, and loops nested in it */
+#define I2C_SCRIPT_SIZE         128
+#define I2C_SCRIPT_REPLY        128
+#define I2C_SCRIPT_DEPTH        4
+
+/* Slave mode: registers of the map and entries of the change log, a
+ * power of two up to 128 */
+#define I2C_SLAVE_SIZE          64
+#define I2C_SLAVE_LOG           64
+
+/* Control requests waiting for the main loop, power of two <= 128 */
+#define I2C_QUEUE_SIZE          4
+
+/* Bulk endpoint batches (full speed builds only) */
+#define I2C_BATCH_BUFSIZE       256     /* bytes of one batch request */
+#define I2C_BATCH_MAXMSGS       32      /* messages per batch request */
+
+/* Register polling (full speed builds only) */
+#define I2C_POLL_ENTRIES        8       /* registers in the poll list */
+#define I2C_POLL_MAXLEN         8       /* bytes per register */
+
+/* SMBus alert (full speed builds only): SMBALERT# on PB4 (D8 on the
+ * Leonardo, PCINT4) with the internal pull-up on, and the most bytes of
+ * the status register read from an alerting slave */
+#define I2C_ALERT_DDR           DDRB
+#define I2C_ALERT_PORT          PORTB
+#define I2C_ALERT_PIN           PINB
+#define I2C_ALERT_BIT           PB4
+#define I2C_ALERT_PCINT         PCINT4
+#define I2C_ALERT_MAXLEN        8
+
+/* EEPROM programming (full speed builds only): biggest page and the
+ * longest write cycle in ms */
+#define I2C_PROG_MAXPAGE        128
+#define I2C_PROG_WRITE_MS       50
+
+/* Streaming capture (full speed builds only): longest time a sample
+ * or monitor token waits in a partly filled packet */
+#define I2C_STREAM_FLUSH_US     1000
+
+/* Bus monitor (full speed builds only): events waiting for the main
+ * loop, a power of two up to 128. 32 hold about 3 ms of a busy 100 kHz
+ * bus. */
+#define I2C_MONITOR_EVENTS      32
+
+#endif
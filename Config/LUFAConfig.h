@@ -58,7 +58,11 @@
 
 		/* General USB Driver Related Tokens: */
 //		#define ORDERED_EP_CONFIG
+		#if defined(I2C_USB_LOWSPEED)
 		#define USE_STATIC_OPTIONS               (USB_DEVICE_OPT_LOWSPEED | USB_OPT_REG_ENABLED | USB_OPT_AUTO_PLL)
+		#else
+		#define USE_STATIC_OPTIONS               (USB_DEVICE_OPT_FULLSPEED | USB_OPT_REG_ENABLED | USB_OPT_AUTO_PLL)
+		#endif
 		#define USB_DEVICE_ONLY
 //		#define USB_HOST_ONLY
 //		#define USB_STREAM_TIMEOUT_MS            {Insert Value Here}
@@ -70,10 +74,16 @@
 		#define USE_FLASH_DESCRIPTORS
 //		#define USE_EEPROM_DESCRIPTORS
 //		#define NO_INTERNAL_SERIAL
+		#if defined(I2C_USB_LOWSPEED)
 		#define FIXED_CONTROL_ENDPOINT_SIZE      8
+		#else
+		#define FIXED_CONTROL_ENDPOINT_SIZE      64
+		#endif
 //		#define DEVICE_STATE_AS_GPIOR            {Insert Value Here}
 		#define FIXED_NUM_CONFIGURATIONS         1
+		#if defined(I2C_USB_LOWSPEED)
 		#define CONTROL_ONLY_DEVICE
+		#endif
 		#define INTERRUPT_CONTROL_ENDPOINT
 //		#define NO_DEVICE_REMOTE_WAKEUP
 //		#define NO_DEVICE_SELF_POWER
@@ -85,7 +85,80 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor = {
         .Protocol               = 0,
 
         .InterfaceStrIndex      = NO_DESCRIPTOR
+    },
+
+#if !defined(I2C_USB_LOWSPEED)
+    .Interface_Batch =
+    {
+        .Header                 = {
+            .Size = sizeof (USB_Descriptor_Interface_t),
+            .Type = DTYPE_Interface
+        },
+
+        .InterfaceNumber        = INTERFACE_ID_MAIN,
+        .AlternateSetting       = INTERFACE_ALT_BATCH,
+
+        .TotalEndpoints         = 4,
+
+        .Class                  = 0xff,
+        .SubClass               = 0,
+        .Protocol               = 0,
+
+        .InterfaceStrIndex      = NO_DESCRIPTOR
+    },
+
+    .I2C_OUTEndpoint =
+    {
+        .Header                 = {
+            .Size = sizeof (USB_Descriptor_Endpoint_t),
+            .Type = DTYPE_Endpoint
+        },
+
+        .EndpointAddress        = I2C_OUT_EPADDR,
+        .Attributes             = (EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+        .EndpointSize           = I2C_TXRX_EPSIZE,
+        .PollingIntervalMS      = 0x00
+    },
+
+    .I2C_INEndpoint =
+    {
+        .Header                 = {
+            .Size = sizeof (USB_Descriptor_Endpoint_t),
+            .Type = DTYPE_Endpoint
+        },
+
+        .EndpointAddress        = I2C_IN_EPADDR,
+        .Attributes             = (EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+        .EndpointSize           = I2C_TXRX_EPSIZE,
+        .PollingIntervalMS      = 0x00
+    },
+
+    .I2C_EventEndpoint =
+    {
+        .Header                 = {
+            .Size = sizeof (USB_Descriptor_Endpoint_t),
+            .Type = DTYPE_Endpoint
+        },
+
+        .EndpointAddress        = I2C_EVENT_EPADDR,
+        .Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+        .EndpointSize           = I2C_EVENT_EPSIZE,
+        .PollingIntervalMS      = 0x01
+    },
+
+    .I2C_StreamEndpoint =
+    {
+        .Header                 = {
+            .Size = sizeof (USB_Descriptor_Endpoint_t),
+            .Type = DTYPE_Endpoint
+        },
+
+        .EndpointAddress        = I2C_STREAM_EPADDR,
+        .Attributes             = (EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+        .EndpointSize           = I2C_STREAM_EPSIZE,
+        .PollingIntervalMS      = 0x00
     }
+#endif
 };
 
 const USB_Descriptor_String_t PROGMEM LanguageString = USB_STRING_DESCRIPTOR_ARRAY(LANGUAGE_ID_ENG);
@@ -34,8 +34,13 @@
 #include <avr/pgmspace.h>
 #include "LUFA/Drivers/USB/USB.h"
 
-#define I2C_EPADDR                     (ENDPOINT_DIR_IN | 1)
-#define I2C_TXRX_EPSIZE                16
+#define I2C_OUT_EPADDR                 (ENDPOINT_DIR_OUT | 1)
+#define I2C_IN_EPADDR                  (ENDPOINT_DIR_IN  | 2)
+#define I2C_TXRX_EPSIZE                64
+#define I2C_EVENT_EPADDR               (ENDPOINT_DIR_IN  | 3)
+#define I2C_EVENT_EPSIZE               64
+#define I2C_STREAM_EPADDR              (ENDPOINT_DIR_IN  | 4)
+#define I2C_STREAM_EPSIZE              64
 
 /* Type Defines: */
 /** Type define for the device configuration descriptor structure. This must be defined in the
@@ -45,6 +50,13 @@
 typedef struct {
 	USB_Descriptor_Configuration_Header_t    Config;
 	USB_Descriptor_Interface_t               Interface;
+#if !defined(I2C_USB_LOWSPEED)
+	USB_Descriptor_Interface_t               Interface_Batch;
+	USB_Descriptor_Endpoint_t                I2C_OUTEndpoint;
+	USB_Descriptor_Endpoint_t                I2C_INEndpoint;
+	USB_Descriptor_Endpoint_t                I2C_EventEndpoint;
+	USB_Descriptor_Endpoint_t                I2C_StreamEndpoint;
+#endif
 } USB_Descriptor_Configuration_t;
 
 /** Enum for the device interface descriptor IDs within the device. Each interface descriptor
@@ -55,6 +67,14 @@ enum InterfaceDescriptors_t {
 	INTERFACE_ID_MAIN = 0
 };
 
+/** Enum for the alternate settings of the main interface. The default setting is the
+ *  control-only i2c-tiny-usb interface, the batch setting adds the bulk endpoints.
+ */
+enum InterfaceAlternateSettings_t {
+	INTERFACE_ALT_TINYUSB = 0, /**< i2c-tiny-usb compatible, control endpoint only */
+	INTERFACE_ALT_BATCH   = 1, /**< Bulk endpoints for batched transactions, event and stream endpoints */
+};
+
 /** Enum for the device string descriptor IDs within the device. Each string descriptor should
  *  have a unique ID index associated with it, which can be used to refer to the string from
  *  other descriptors.
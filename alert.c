@@ -0,0 +1,217 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* alert.c - SMBus alert handling					     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Watches the SMBALERT# line of bus 0 and answers alerts without the
+ * host: a falling edge, seen by the pin change interrupt, has the main
+ * loop read the Alert Response Address and, if the host asked for it, a
+ * status register of the slave that answered. The result goes out as a
+ * record on the event endpoint, next to the poll samples, so the host
+ * learns of an alert one frame later instead of polling every slave.
+ * The transactions run between the others on the bus, like the polls. */
+
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "Config/AppConfig.h"
+#include "Descriptors.h"
+
+#include "i2ctinyusb.h"
+#include "i2cmegausb.h"
+#include "alert.h"
+#include "clock.h"
+#include "poll.h"
+#include "stats.h"
+#include "trace.h"
+#include "twi.h"
+
+#if !defined(I2C_USB_LOWSPEED)
+
+#define ALERT_ARA           0x0c    /* SMBus Alert Response Address */
+
+enum {
+    ALERT_OFF,          /* not watching the line */
+    ALERT_IDLE,         /* waiting for an alert */
+    ALERT_ARA_READ,     /* reading the address of the alerting slave */
+    ALERT_REGISTER,     /* writing the status register number */
+    ALERT_READ          /* reading the status register */
+};
+
+static volatile uint8_t  alert_edge;    /* line went low, not answered */
+static volatile uint32_t alert_edge_ticks;
+static uint8_t  alert_state;
+static uint8_t  alert_reg;      /* status register */
+static uint8_t  alert_len;      /* its bytes, 0 for none */
+static uint8_t  alert_pos;      /* bytes read of it */
+static uint32_t alert_ticks;    /* edge of the alert being answered */
+/* Address of the slave, then the status register */
+static uint8_t  alert_data[1 + I2C_ALERT_MAXLEN];
+
+#define alert_low()     (!(I2C_ALERT_PIN & _BV(I2C_ALERT_BIT)))
+
+ISR (PCINT0_vect) {
+    if (alert_low () && !alert_edge) {
+        alert_edge_ticks = clock_ticks ();
+        alert_edge = 1;
+    }
+}
+
+/* An alert transaction owns the bus from the ARA read to the STOP after
+ * the status register */
+uint8_t alert_busy (void) {
+    return alert_state > ALERT_IDLE;
+}
+
+static void alert_stop (void) {
+    if (alert_busy ()) {
+        if (twi_busy ())
+            twi_abort ();
+        else
+            twi_stop ();
+    }
+    alert_state = alert_state == ALERT_OFF ? ALERT_OFF : ALERT_IDLE;
+}
+
+static void alert_disable (void) {
+    PCMSK0 &= ~_BV(I2C_ALERT_PCINT);
+    alert_state = ALERT_OFF;
+    alert_edge  = 0;
+}
+
+/* Starts or stops watching the line. The request is run from the main
+ * loop, so no alert transaction is open. */
+void alert_set (const i2c_cmd_t *req) {
+    if (i2c_altsetting != INTERFACE_ALT_BATCH || req->value > 1 ||
+        (req->index >> 8) > I2C_ALERT_MAXLEN) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    if (req->value) {
+        alert_reg = req->index;
+        alert_len = req->index >> 8;
+        /* SMBALERT# is open drain, the pull-up holds it high */
+        I2C_ALERT_DDR  &= ~_BV(I2C_ALERT_BIT);
+        I2C_ALERT_PORT |= _BV(I2C_ALERT_BIT);
+        ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+            PCMSK0 |= _BV(I2C_ALERT_PCINT);
+            PCICR  |= _BV(PCIE0);
+            /* A line already low counts as an alert from now */
+            alert_edge_ticks = clock_ticks ();
+            alert_edge = alert_low ();
+        }
+        alert_state = ALERT_IDLE;
+    } else {
+        alert_disable ();
+    }
+    Endpoint_ClearIN ();
+}
+
+/* Ends the alert transaction and reports it */
+static void alert_done (const uint8_t status) {
+    alert_stop ();
+    if (status != STATUS_ADDRESS_ACK)
+        memset (&alert_data[1], 0xff, alert_len);
+    poll_record (I2C_ALERT_RECORD, status, alert_ticks, alert_data,
+                 1 + alert_len);
+    poll_flush ();
+    TRACE (TRACE_ALERT, alert_data[0], status, alert_len);
+    /* Another slave may hold the line low too. A line that nobody
+     * answers for waits for the next edge. */
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        if (!alert_edge && alert_data[0] != 0xff && alert_low ()) {
+            alert_edge_ticks = alert_ticks;
+            alert_edge = 1;
+        }
+    }
+}
+
+/* Called from the main loop, advances the alert engine as far as the
+ * bus allows */
+void alert_task (void) {
+    if (i2c_altsetting != INTERFACE_ALT_BATCH) {
+        /* The event endpoint is gone, the host sets it up again */
+        if (alert_state != ALERT_OFF) {
+            alert_stop ();
+            alert_disable ();
+        }
+        return;
+    }
+    switch (alert_state) {
+    case ALERT_IDLE:
+        if (!alert_edge || !i2c_bus_free ())
+            break;
+        ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+            alert_ticks = alert_edge_ticks;
+            alert_edge  = 0;
+        }
+        twi_start ((ALERT_ARA << 1) | 1, 1);
+        alert_state = ALERT_ARA_READ;
+        break;
+    case ALERT_ARA_READ:
+        if (twi_get (&alert_data[0])) {
+            /* The slave sends its address in the upper 7 bits */
+            alert_data[0] >>= 1;
+            if (!alert_len) {
+                alert_done (STATUS_ADDRESS_ACK);
+                break;
+            }
+            twi_stop ();
+            twi_start (alert_data[0] << 1, 1);
+            twi_put (alert_reg);
+            alert_pos   = 0;
+            alert_state = ALERT_REGISTER;
+        } else if (twi_failed ()) {
+            alert_data[0] = 0xff;
+            alert_done (twi_state == TWI_ADDR_NAK ? STATUS_ADDRESS_NAK
+                                                  : STATUS_READ_FAILED);
+        }
+        break;
+    case ALERT_REGISTER:
+        if (twi_busy ())
+            break;
+        if (twi_failed ()) {
+            alert_done (twi_state == TWI_ADDR_NAK ? STATUS_ADDRESS_NAK
+                                                  : STATUS_WRITE_FAILED);
+            break;
+        }
+        /* Repeated START */
+        twi_start ((alert_data[0] << 1) | 1, alert_len);
+        alert_state = ALERT_READ;
+        break;
+    case ALERT_READ:
+        while (alert_pos < alert_len && twi_get (&alert_data[1 + alert_pos]))
+            alert_pos++;
+        if (alert_pos == alert_len) {
+            alert_done (STATUS_ADDRESS_ACK);
+        } else if (twi_failed ()) {
+            alert_done (twi_state == TWI_ADDR_NAK ? STATUS_ADDRESS_NAK
+                                                  : STATUS_READ_FAILED);
+        }
+        break;
+    }
+}
+
+#endif
@@ -0,0 +1,298 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* batch.c - batched I2C transactions over the bulk endpoints		     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#include "Config/AppConfig.h"
+#include "Descriptors.h"
+
+#include "i2ctinyusb.h"
+#include "i2cmegausb.h"
+#include "batch.h"
+#include "prog.h"
+#include "stats.h"
+#include "trace.h"
+#include "twi.h"
+
+#if !defined(I2C_USB_LOWSPEED)
+
+enum {
+    BATCH_RECEIVE,      /* collecting the request from the OUT endpoint */
+    BATCH_CLAIM,        /* waiting for the control endpoint path to finish */
+    BATCH_START,        /* starting the next message */
+    BATCH_ADDRESS,      /* waiting for the address phase */
+    BATCH_DATA,         /* moving the data of the current message */
+    BATCH_STATUS        /* sending the status bytes */
+};
+
+static uint8_t  batch_buf[I2C_BATCH_BUFSIZE];
+static uint8_t  batch_status[I2C_BATCH_MAXMSGS];
+static uint8_t  batch_state;
+static uint16_t batch_len;      /* length of the message list */
+static uint16_t batch_pos;      /* receive or parse position in batch_buf */
+static uint8_t  batch_hdr;      /* header bytes received */
+static uint8_t  batch_msgs;     /* messages in the request */
+static uint8_t  batch_msg;      /* message being executed */
+static uint8_t  batch_left;     /* data bytes left in the current message */
+static uint8_t  batch_flags;    /* flags of the current message */
+static uint8_t  batch_failed;   /* a message failed, skip the rest */
+static uint8_t  batch_open;     /* a transaction is open on the bus */
+static uint8_t  batch_inbytes;  /* bytes in the current IN bank */
+
+static void batch_stop (void) {
+    if (batch_open) {
+        if (twi_busy ())
+            twi_abort ();
+        else
+            twi_stop ();
+        batch_open = 0;
+    }
+}
+
+static void batch_fail (const uint8_t status) {
+    batch_status[batch_msg] = status;
+    batch_failed = 1;
+    batch_stop ();
+}
+
+static void batch_reset (void) {
+    batch_stop ();
+    batch_state = BATCH_RECEIVE;
+    batch_hdr   = 0;
+    batch_pos   = 0;
+}
+
+/* The bulk endpoints belong to a batch from its first byte until its
+ * last status byte is queued */
+uint8_t batch_armed (void) {
+    return batch_state != BATCH_RECEIVE || batch_hdr != 0;
+}
+
+/* A batch owns the bus from the moment it is claimed until the last
+ * status byte is queued. The control endpoint path must not touch the
+ * bus in that time. */
+uint8_t batch_busy (void) {
+    return batch_state > BATCH_CLAIM;
+}
+
+/* Checks the message list and counts the messages. An empty list would
+ * have no reply at all, and a read of no bytes can't end with a NAK. */
+static uint8_t batch_parse (void) {
+    uint16_t pos = 0;
+
+    batch_msgs = 0;
+    while (pos < batch_len) {
+        if (batch_msgs == I2C_BATCH_MAXMSGS || pos + 3 > batch_len)
+            return 0;
+        if (batch_buf[pos+1] & I2C_BATCH_RD) {
+            if (!batch_buf[pos+2])
+                return 0;
+        } else
+            pos += batch_buf[pos+2];
+        pos += 3;
+        batch_msgs++;
+    }
+    return batch_msgs && pos == batch_len;
+}
+
+static void batch_receive (void) {
+    Endpoint_SelectEndpoint (I2C_OUT_EPADDR);
+    if (!Endpoint_IsOUTReceived ())
+        return;
+    while (Endpoint_BytesInEndpoint ()) {
+        if (batch_hdr == 0) {
+            batch_len = Endpoint_Read_8 ();
+            batch_hdr++;
+        } else if (batch_hdr == 1) {
+            batch_len |= Endpoint_Read_8 () << 8;
+            batch_hdr++;
+        } else if (batch_pos < batch_len) {
+            batch_buf[batch_pos++] = Endpoint_Read_8 ();
+        } else {
+            /* trailing garbage */
+            Endpoint_Read_8 ();
+        }
+    }
+    Endpoint_ClearOUT ();
+
+    if (batch_hdr < 2)
+        return;
+    if (batch_len > sizeof (batch_buf)) {
+        /* Will never fit, let the host know by halting the pipe */
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        batch_reset ();
+        return;
+    }
+    if (batch_pos < batch_len)
+        return;
+    if (!batch_parse ()) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        batch_reset ();
+        return;
+    }
+    batch_state = BATCH_CLAIM;
+}
+
+/* Waits until no i2c-tiny-usb transaction or poll is open on the bus and
+ * takes it over. All run from the main loop, so there is no race with
+ * queued control requests. */
+static void batch_claim (void) {
+    if (!i2c_bus_free ())
+        return;
+    batch_msg     = 0;
+    batch_pos     = 0;
+    batch_failed  = (i2c_bus_status (I2C_BUS_TWI) == STATUS_UNCONFIGURED);
+    batch_inbytes = 0;
+    batch_state   = BATCH_START;
+    TRACE (TRACE_BATCH, batch_msgs, batch_len, batch_len >> 8);
+}
+
+static void batch_start (void) {
+    uint8_t addr;
+
+    if (batch_msg == batch_msgs) {
+        batch_pos   = 0;
+        batch_state = BATCH_STATUS;
+        return;
+    }
+    addr        = batch_buf[batch_pos++];
+    batch_flags = batch_buf[batch_pos++];
+    batch_left  = batch_buf[batch_pos++];
+
+    if (batch_failed) {
+        batch_status[batch_msg] = STATUS_IDLE;
+        batch_state = BATCH_DATA;
+        return;
+    }
+    addr = (addr << 1) | (batch_flags & I2C_BATCH_RD);
+    twi_start (addr, batch_left);
+    batch_open  = 1;
+    batch_state = BATCH_ADDRESS;
+}
+
+static void batch_address (void) {
+    if (twi_state == TWI_ADDRESS)
+        return;
+    if (twi_failed ()) {
+        batch_fail (STATUS_ADDRESS_NAK);
+    } else {
+        batch_status[batch_msg] = STATUS_ADDRESS_ACK;
+    }
+    batch_state = BATCH_DATA;
+}
+
+/* Queues one byte for the IN endpoint, sending full banks */
+static void batch_put (uint8_t data) {
+    Endpoint_Write_8 (data);
+    if (++batch_inbytes == I2C_TXRX_EPSIZE) {
+        Endpoint_ClearIN ();
+        batch_inbytes = 0;
+    }
+}
+
+static void batch_data (void) {
+    uint8_t data;
+
+    if (batch_flags & I2C_BATCH_RD) {
+        Endpoint_SelectEndpoint (I2C_IN_EPADDR);
+        while (batch_left && Endpoint_IsINReady ()) {
+            if (!batch_failed && twi_failed ())
+                batch_fail (STATUS_READ_FAILED);
+            if (batch_failed)
+                data = 0xff;
+            else if (!twi_get (&data))
+                return;
+            batch_put (data);
+            batch_left--;
+        }
+        if (batch_left)
+            return;
+    } else {
+        while (batch_left) {
+            if (!batch_failed && twi_failed ())
+                batch_fail (STATUS_WRITE_FAILED);
+            if (!batch_failed && !twi_put (batch_buf[batch_pos]))
+                return;
+            batch_pos++;
+            batch_left--;
+        }
+        /* Wait for the last bytes to leave the engine */
+        if (!batch_failed && twi_busy ())
+            return;
+        if (!batch_failed && twi_failed ())
+            batch_fail (STATUS_WRITE_FAILED);
+    }
+
+    batch_msg++;
+    if ((batch_flags & I2C_BATCH_STOP) || batch_msg == batch_msgs)
+        batch_stop ();
+    batch_state = BATCH_START;
+}
+
+static void batch_send_status (void) {
+    Endpoint_SelectEndpoint (I2C_IN_EPADDR);
+    while (batch_pos < batch_msgs && Endpoint_IsINReady ())
+        batch_put (batch_status[batch_pos++]);
+    if (batch_pos < batch_msgs)
+        return;
+    /* A reply that ends with a full packet gets a zero length packet, so
+     * a host that asks for more does not wait */
+    if (!batch_inbytes && !Endpoint_IsINReady ())
+        return;
+    Endpoint_ClearIN ();
+    batch_reset ();
+}
+
+/* Called from the main loop, advances the current batch as far as the
+ * endpoints allow */
+void batch_task (void) {
+    if (i2c_altsetting != INTERFACE_ALT_BATCH) {
+        if (batch_state != BATCH_RECEIVE)
+            batch_reset ();
+        return;
+    }
+    switch (batch_state) {
+    case BATCH_RECEIVE:
+        /* The image of a programming comes in on the same endpoint */
+        if (!prog_armed ())
+            batch_receive ();
+        break;
+    case BATCH_CLAIM:
+        batch_claim ();
+        break;
+    case BATCH_START:
+        batch_start ();
+        break;
+    case BATCH_ADDRESS:
+        batch_address ();
+        break;
+    case BATCH_DATA:
+        batch_data ();
+        break;
+    case BATCH_STATUS:
+        batch_send_status ();
+        break;
+    }
+}
+
+#endif
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* batch.h - batched I2C transactions over the bulk endpoints		     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __batch_h_included__
+#define __batch_h_included__
+
+#include <stdint.h>
+
+uint8_t batch_armed (void);
+uint8_t batch_busy (void);
+void    batch_task (void);
+
+#endif
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* clock.c - free running system clock					     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "clock.h"
+
+static volatile uint16_t clock_high;
+
+ISR (TIMER1_OVF_vect) {
+    clock_high++;
+}
+
+void clock_init (void) {
+    TCCR1A = 0;
+    TCCR1B = _BV(CS10);         /* normal mode, no prescaler */
+    TCNT1  = 0;
+    TIMSK1 = _BV(TOIE1);
+}
+
+uint32_t clock_ticks (void) {
+    uint16_t high, low;
+
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        high = clock_high;
+        low  = TCNT1;
+        /* An overflow that happened since the interrupts went off */
+        if ((TIFR1 & _BV(TOV1)) && low < 0x8000)
+            high++;
+    }
+    return ((uint32_t)high << 16) | low;
+}
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* clock.h - free running system clock					     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __clock_h_included__
+#define __clock_h_included__
+
+#include <stdint.h>
+#include <avr/io.h>
+
+/* Timer1 counts CPU cycles, the overflow interrupt extends it to 32 bit.
+ * That is one tick per cycle at 16 MHz, wrapping after about 268 s. */
+#define CLOCK_TICKS_PER_US      (F_CPU / 1000000UL)
+
+/* Low 16 bits of the tick count, for sections shorter than 4 ms */
+#define clock_ticks16()         ((uint16_t)TCNT1)
+
+void     clock_init (void);
+uint32_t clock_ticks (void);
+
+#endif
@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* config.c - power-on settings in the EEPROM				     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Keeps the bus clocks, the timeout and the pull-up setting in the
+ * EEPROM and applies them at power-on, before USB comes up. A device
+ * set up this way takes I/O from the first control transfer after a
+ * reset or a replug, without CMD_SET_DELAY first. CMD_SET_CONFIG checks
+ * and saves the settings, which take effect at the next power-on; the
+ * host sets the running device up with the usual requests. The record
+ * is saved with its length and a CRC-8, a torn or stale one is ignored. */
+
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+
+#include "Config/AppConfig.h"
+#include "Descriptors.h"
+
+#include "i2ctinyusb.h"
+#include "i2cmegausb.h"
+#include "config.h"
+#include "pec.h"
+#include "stats.h"
+#include "swi.h"
+#include "trace.h"
+#include "twi.h"
+
+#define CONFIG_SIZE         11      /* bytes in SET_CONFIG */
+
+static uint8_t EEMEM config_ee_len = 0xff;
+static uint8_t EEMEM config_ee[CONFIG_SIZE];
+static uint8_t EEMEM config_ee_crc;
+
+static uint32_t config_get32 (const uint8_t *p) {
+    return p[0] | ((uint16_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+static uint8_t config_crc (const uint8_t *buf) {
+    uint8_t crc = 0, i;
+
+    for (i = 0; i < CONFIG_SIZE; i++)
+        crc = pec_update (crc, buf[i]);
+    return crc;
+}
+
+/* Reads the saved record, returns 0 if there is none */
+static uint8_t config_load (uint8_t *buf) {
+    if (eeprom_read_byte (&config_ee_len) != CONFIG_SIZE)
+        return 0;
+    eeprom_read_block (buf, config_ee, CONFIG_SIZE);
+    return eeprom_read_byte (&config_ee_crc) == config_crc (buf);
+}
+
+/* Applies the saved settings, called from main () before USB_Init ().
+ * A clock the firmware can't set leaves its bus unconfigured. */
+void config_init (void) {
+    uint8_t buf[CONFIG_SIZE];
+    uint16_t timeout;
+
+    if (!config_load (buf))
+        return;
+    if (buf[10] & I2C_CONFIG_NOPULLUPS)
+        twi_set_pullups (0);
+    timeout = buf[8] | ((uint16_t)buf[9] << 8);
+    if (timeout) {
+        twi_set_timeout (timeout);
+        swi_set_timeout (timeout);
+    }
+    if (config_get32 (&buf[0]))
+        i2c_bus_clock (I2C_BUS_TWI, config_get32 (&buf[0]));
+    if (config_get32 (&buf[4]))
+        i2c_bus_clock (I2C_BUS_SWI, config_get32 (&buf[4]));
+    TRACE (TRACE_CONFIG, 2, buf[10], 0);
+}
+
+/* Checks and saves the settings from the data stage of CMD_SET_CONFIG,
+ * an empty one deletes them. The request is run from the main loop, as
+ * the EEPROM takes a few ms per byte. */
+void config_set (const i2c_cmd_t *req) {
+    uint8_t buf[CONFIG_SIZE];
+
+    if (req->length && req->length != sizeof (buf)) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    Endpoint_SetEndpointDirection (ENDPOINT_DIR_OUT);
+    if (req->length && Endpoint_Read_Control_Stream_LE (buf, req->length))
+        return;
+    if (req->length &&
+        ((buf[10] & ~I2C_CONFIG_NOPULLUPS) ||
+         (config_get32 (&buf[0]) &&
+          !i2c_clock_valid (I2C_BUS_TWI, config_get32 (&buf[0]))) ||
+         (config_get32 (&buf[4]) &&
+          !i2c_clock_valid (I2C_BUS_SWI, config_get32 (&buf[4]))))) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+
+    eeprom_update_byte (&config_ee_len, 0xff);
+    if (req->length) {
+        eeprom_update_block (buf, config_ee, sizeof (buf));
+        eeprom_update_byte (&config_ee_crc, config_crc (buf));
+        eeprom_update_byte (&config_ee_len, sizeof (buf));
+    }
+    TRACE (TRACE_CONFIG, req->length != 0, req->length ? buf[10] : 0, 0);
+    Endpoint_ClearIN ();
+}
+
+/* Sends the data stage of CMD_GET_CONFIG: the saved settings, nothing if
+ * there are none */
+void config_send (const uint16_t length) {
+    uint8_t buf[CONFIG_SIZE];
+    uint16_t len = config_load (buf) ? sizeof (buf) : 0;
+
+    Endpoint_Write_Control_Stream_LE (buf, len < length ? len : length);
+    Endpoint_ClearOUT ();
+}
@@ -0,0 +1,318 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* i2cmega-load.c - load generator for the i2c-mega-usb host library	     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Keeps up to the queue depth of transfers in flight with a stream of
+ * operations of one kind and reports the rate and the latency from the
+ * submission of an operation to the completion of its last transfer:
+ *
+ *   io     CMD_I2C_IO plus CMD_GET_STATUS, like the kernel driver
+ *   reg    CMD_READ_REG with the register 0
+ *   batch  a batch of messages on the bulk endpoints
+ *
+ * Built with usb.c it drives the device, built in sim/ the simulated
+ * firmware, in simulated time. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "i2cmega.h"
+
+#define LOAD_MAXLEN     256
+#define LOAD_MAXXFERS   2           /* transfers per operation */
+#define LOAD_BATCH_SIZE 256         /* the firmware's I2C_BATCH_BUFSIZE */
+#define LOAD_BATCH_MSGS 32          /* and I2C_BATCH_MAXMSGS */
+
+enum {
+    LOAD_IO,
+    LOAD_REG,
+    LOAD_BATCH
+};
+
+typedef struct {
+    i2cmega_xfer_t xfers[LOAD_MAXXFERS];
+    uint8_t        out[LOAD_MAXLEN + 2];
+    uint8_t        in[LOAD_MAXLEN + 2];
+    uint8_t        status;
+    int            left;            /* transfers not completed */
+    uint64_t       start;
+} load_op_t;
+
+static i2cmega_dev_t *load_dev;
+static int       load_mode = LOAD_IO;
+static int       load_count = 10000;
+static int       load_depth = 1;
+static int       load_len = 1;
+static int       load_read;
+static int       load_msgs = 8;     /* messages per batch */
+static uint8_t   load_addr = 0x50;
+static int       load_xfers;        /* transfers per operation */
+static int       load_started;
+static int       load_done;
+static int       load_failed;
+static uint64_t *load_latency;
+static uint64_t  load_first;
+static uint64_t  load_last;
+
+static void load_callback (i2cmega_xfer_t *xfer);
+
+/* Bytes of a batch request and of its reply */
+static int load_batch_out (void) {
+    return 2 + load_msgs * (3 + (load_read ? 0 : load_len));
+}
+
+static int load_batch_in (void) {
+    return load_msgs * ((load_read ? load_len : 0) + 1);
+}
+
+/* Sets up an operation and submits its transfers */
+static int load_start (load_op_t *op) {
+    uint8_t *p = op->out + 2;
+    int i, ret;
+
+    memset (op->xfers, 0, sizeof (op->xfers));
+    switch (load_mode) {
+    case LOAD_IO:
+        i2cmega_fill_io (&op->xfers[0], CMD_I2C_IO_BEGIN | CMD_I2C_IO_END,
+                         load_read ? I2C_M_RD : 0, load_addr,
+                         load_read ? op->in : op->out, load_len);
+        i2cmega_fill_status (&op->xfers[1], &op->status);
+        break;
+    case LOAD_REG:
+        i2cmega_fill_control (&op->xfers[0], I2CMEGA_CONTROL_IN, CMD_READ_REG,
+                              load_addr | (1 << 8), 0, op->in, load_len + 1);
+        break;
+    case LOAD_BATCH:
+        op->out[0] = load_batch_out () - 2;
+        op->out[1] = (load_batch_out () - 2) >> 8;
+        for (i = 0; i < load_msgs; i++) {
+            *p++ = load_addr;
+            *p++ = (load_read ? I2C_BATCH_RD : 0) |
+                   (i == load_msgs - 1 ? I2C_BATCH_STOP : 0);
+            *p++ = load_len;
+            if (!load_read) {
+                memset (p, i, load_len);
+                p += load_len;
+            }
+        }
+        i2cmega_fill_bulk (&op->xfers[0], I2CMEGA_BULK_OUT, op->out,
+                           load_batch_out ());
+        /* One more than the reply, which a short or zero length packet
+         * ends */
+        i2cmega_fill_bulk (&op->xfers[1], I2CMEGA_BULK_IN, op->in,
+                           load_batch_in () + 1);
+        break;
+    }
+    op->left  = load_xfers;
+    op->start = i2cmega_now (load_dev);
+    if (!load_started++)
+        load_first = op->start;
+    for (i = 0; i < load_xfers; i++) {
+        op->xfers[i].callback = load_callback;
+        op->xfers[i].user     = op;
+        ret = i2cmega_submit (load_dev, &op->xfers[i]);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+/* Did the operation go through on the bus */
+static int load_ok (const load_op_t *op) {
+    int i;
+
+    for (i = 0; i < load_xfers; i++)
+        if (op->xfers[i].result < 0)
+            return 0;
+    switch (load_mode) {
+    case LOAD_IO:
+        return op->status == STATUS_ADDRESS_ACK;
+    case LOAD_REG:
+        return op->in[load_len] == STATUS_ADDRESS_ACK;
+    }
+    if (op->xfers[1].result != load_batch_in ())
+        return 0;
+    for (i = 0; i < load_msgs; i++)
+        if (op->in[load_batch_in () - load_msgs + i] != STATUS_ADDRESS_ACK)
+            return 0;
+    return 1;
+}
+
+static void load_callback (i2cmega_xfer_t *xfer) {
+    load_op_t *op = xfer->user;
+
+    if (--op->left)
+        return;
+    load_last = xfer->completed;
+    load_latency[load_done++] = load_last - op->start;
+    if (!load_ok (op))
+        load_failed++;
+    if (load_started < load_count && load_start (op) < 0)
+        load_failed++;
+}
+
+static int load_compare (const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double load_percentile (const int p) {
+    return load_latency[(int64_t)(load_done - 1) * p / 100] / 1000.0;
+}
+
+static void load_report (void) {
+    static const char *const modes[] = { "io", "reg", "batch" };
+    double secs = (load_last - load_first) / 1e9;
+    int msgs = load_mode == LOAD_BATCH ? load_msgs : 1;
+
+    qsort (load_latency, load_done, sizeof (load_latency[0]), load_compare);
+    printf ("%-6s %5s %5s %9s %9s %9s %8s %8s %8s %8s %6s\n", "mode", "len",
+            "depth", "op/s", "msg/s", "byte/s", "p50 us", "p90 us", "p99 us",
+            "max us", "failed");
+    printf ("%-6s %5d %5d %9.0f %9.0f %9.0f %8.1f %8.1f %8.1f %8.1f %6d\n",
+            modes[load_mode], load_len, load_depth, load_done / secs,
+            load_done * msgs / secs, (double)load_done * msgs * load_len / secs,
+            load_percentile (50), load_percentile (90), load_percentile (99),
+            load_percentile (100), load_failed);
+}
+
+static void usage (const char *name) {
+    fprintf (stderr,
+             "usage: %s [-m io | reg | batch] [-r] [-n count] [-q depth] [-l length]\n"
+             "          [-k messages] [-a address] [-c freq]\n"
+             "  -m mode     operation: io (default), reg or batch\n"
+             "  -r          read instead of write (reg always reads)\n"
+             "  -n count    operations (%d)\n"
+             "  -q depth    transfers in flight (%d)\n"
+             "  -l length   bytes per message (%d)\n"
+             "  -k messages messages per batch (%d)\n"
+             "  -a address  7 bit slave address (0x%02x)\n"
+             "  -c freq     bus clock in Hz\n",
+             name, load_count, load_depth, load_len, load_msgs, load_addr);
+    exit (1);
+}
+
+int main (int argc, char **argv) {
+    load_op_t *ops;
+    uint32_t freq = 0, actual;
+    int opt, i, n, ret;
+
+    while ((opt = getopt (argc, argv, "m:rn:q:l:k:a:c:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (!strcmp (optarg, "io"))
+                load_mode = LOAD_IO;
+            else if (!strcmp (optarg, "reg"))
+                load_mode = LOAD_REG;
+            else if (!strcmp (optarg, "batch"))
+                load_mode = LOAD_BATCH;
+            else
+                usage (argv[0]);
+            break;
+        case 'r':
+            load_read = 1;
+            break;
+        case 'n':
+            load_count = atoi (optarg);
+            break;
+        case 'q':
+            load_depth = atoi (optarg);
+            break;
+        case 'l':
+            load_len = atoi (optarg);
+            break;
+        case 'k':
+            load_msgs = atoi (optarg);
+            break;
+        case 'a':
+            load_addr = strtoul (optarg, NULL, 0);
+            break;
+        case 'c':
+            freq = strtoul (optarg, NULL, 0);
+            break;
+        default:
+            usage (argv[0]);
+        }
+    }
+    if (load_mode == LOAD_REG)
+        load_read = 1;
+    load_xfers = load_mode == LOAD_REG ? 1 : 2;
+    if (load_count < 1 || load_depth < 1 || load_len < 1 ||
+        load_len > (load_mode == LOAD_BATCH ? 255 : LOAD_MAXLEN - 1) ||
+        load_addr > 0x7f || load_msgs < 1 || load_msgs > LOAD_BATCH_MSGS ||
+        (load_mode == LOAD_BATCH && (load_batch_out () > LOAD_BATCH_SIZE + 2 ||
+                                     load_batch_in () > LOAD_MAXLEN + 1)))
+        usage (argv[0]);
+
+    ret = i2cmega_open (&load_dev, load_depth);
+    if (ret < 0) {
+        fprintf (stderr, "%s: cannot open the device (%d)\n", argv[0], ret);
+        return 1;
+    }
+    if (freq) {
+        ret = i2cmega_set_freq (load_dev, freq, &actual);
+        if (ret < 0) {
+            fprintf (stderr, "%s: SET_FREQ %u failed (%d)\n", argv[0], freq, ret);
+            return 1;
+        }
+        printf ("bus clock %u Hz\n", actual);
+    } else if (i2cmega_control (load_dev, I2CMEGA_CONTROL_OUT, CMD_SET_DELAY,
+                                10, 0, NULL, 0) < 0) {
+        fprintf (stderr, "%s: SET_DELAY failed\n", argv[0]);
+        return 1;
+    }
+    if (load_mode == LOAD_BATCH &&
+        i2cmega_set_altsetting (load_dev, I2CMEGA_ALT_BULK) < 0) {
+        fprintf (stderr, "%s: cannot switch to the bulk endpoints\n", argv[0]);
+        return 1;
+    }
+
+    /* Enough operations to keep depth transfers in flight */
+    n = (load_depth + load_xfers - 1) / load_xfers;
+    if (n > load_count)
+        n = load_count;
+    ops = calloc (n, sizeof (*ops));
+    load_latency = calloc (load_count, sizeof (*load_latency));
+    if (!ops || !load_latency)
+        return 1;
+    for (i = 0; i < n; i++) {
+        if (load_start (&ops[i]) < 0) {
+            fprintf (stderr, "%s: submit failed\n", argv[0]);
+            return 1;
+        }
+    }
+    while (load_done < load_count) {
+        ret = i2cmega_handle_events (load_dev, 1000);
+        if (ret < 0) {
+            fprintf (stderr, "%s: transfer failed (%d)\n", argv[0], ret);
+            return 1;
+        }
+    }
+    load_report ();
+    if (load_mode == LOAD_BATCH)
+        i2cmega_set_altsetting (load_dev, I2CMEGA_ALT_TINYUSB);
+    i2cmega_close (load_dev);
+    return load_failed != 0;
+}
@@ -0,0 +1,217 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* i2cmega.c - asynchronous host library for the i2c-mega-usb		     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#include <stdlib.h>
+
+#include "i2cmega.h"
+
+int i2cmega_open (i2cmega_dev_t **dev, const int depth) {
+    i2cmega_dev_t *d;
+    int ret;
+
+    if (depth < 1)
+        return I2CMEGA_ERR_ARG;
+    d = calloc (1, sizeof (*d));
+    if (!d)
+        return I2CMEGA_ERR_IO;
+    d->depth = depth;
+    ret = i2cmega_transport_open (d);
+    if (ret < 0) {
+        free (d);
+        return ret;
+    }
+    *dev = d;
+    return 0;
+}
+
+void i2cmega_close (i2cmega_dev_t *dev) {
+    i2cmega_drain (dev);
+    i2cmega_transport_close (dev);
+    free (dev);
+}
+
+uint64_t i2cmega_now (i2cmega_dev_t *dev) {
+    return i2cmega_transport_now (dev);
+}
+
+void i2cmega_fill_control (i2cmega_xfer_t *xfer, const uint8_t type,
+                           const uint8_t request, const uint16_t value,
+                           const uint16_t index, void *buf,
+                           const uint16_t length) {
+    xfer->type    = type;
+    xfer->request = request;
+    xfer->value   = value;
+    xfer->index   = index;
+    xfer->buf     = buf;
+    xfer->length  = length;
+}
+
+void i2cmega_fill_bulk (i2cmega_xfer_t *xfer, const uint8_t endpoint,
+                        void *buf, const uint16_t length) {
+    xfer->type     = I2CMEGA_BULK;
+    xfer->endpoint = endpoint;
+    xfer->buf      = buf;
+    xfer->length   = length;
+}
+
+/* One message the way the kernel driver sends it: cmd holds
+ * CMD_I2C_IO_BEGIN and CMD_I2C_IO_END, flags the I2C_M_* flags, addr
+ * the 7 bit address and the bus in its high byte */
+void i2cmega_fill_io (i2cmega_xfer_t *xfer, const uint8_t cmd,
+                      const uint16_t flags, const uint16_t addr,
+                      void *buf, const uint16_t length) {
+    i2cmega_fill_control (xfer, (flags & I2C_M_RD) ? I2CMEGA_CONTROL_IN
+                                                   : I2CMEGA_CONTROL_OUT,
+                          CMD_I2C_IO | (cmd & (CMD_I2C_IO_BEGIN | CMD_I2C_IO_END)),
+                          flags, addr, buf, length);
+}
+
+/* GET_STATUS of bus 0 */
+void i2cmega_fill_status (i2cmega_xfer_t *xfer, uint8_t *status) {
+    i2cmega_fill_control (xfer, I2CMEGA_CONTROL_IN, CMD_GET_STATUS, 0, 0,
+                          status, 1);
+}
+
+static int i2cmega_start (i2cmega_dev_t *dev, i2cmega_xfer_t *xfer) {
+    int ret;
+
+    dev->inflight++;
+    xfer->started = i2cmega_now (dev);
+    ret = i2cmega_transport_submit (dev, xfer);
+    if (ret < 0)
+        dev->inflight--;
+    return ret;
+}
+
+/* Hands the transfer to the transport or queues it behind the others */
+int i2cmega_submit (i2cmega_dev_t *dev, i2cmega_xfer_t *xfer) {
+    xfer->dev       = dev;
+    xfer->result    = 0;
+    xfer->next      = NULL;
+    xfer->submitted = i2cmega_now (dev);
+    if (dev->inflight < dev->depth && !dev->head)
+        return i2cmega_start (dev, xfer);
+    if (dev->tail)
+        dev->tail->next = xfer;
+    else
+        dev->head = xfer;
+    dev->tail = xfer;
+    return 0;
+}
+
+/* Called by the transport when a transfer has ended. Fills the free slot
+ * from the waiting list before the callback runs, so the transport is
+ * never idle while the application looks at a result. */
+void i2cmega_complete (i2cmega_xfer_t *xfer, const int result) {
+    i2cmega_dev_t *dev = xfer->dev;
+    i2cmega_xfer_t *next;
+
+    xfer->result    = result;
+    xfer->completed = i2cmega_now (dev);
+    dev->inflight--;
+    while (dev->head && dev->inflight < dev->depth) {
+        next = dev->head;
+        dev->head = next->next;
+        if (!dev->head)
+            dev->tail = NULL;
+        if (i2cmega_start (dev, next) < 0) {
+            next->completed = i2cmega_now (dev);
+            next->result    = I2CMEGA_ERR_IO;
+            if (next->callback)
+                next->callback (next);
+        }
+    }
+    if (xfer->callback)
+        xfer->callback (xfer);
+}
+
+/* Transfers submitted and not completed */
+int i2cmega_pending (i2cmega_dev_t *dev) {
+    i2cmega_xfer_t *x;
+    int n = dev->inflight;
+
+    for (x = dev->head; x; x = x->next)
+        n++;
+    return n;
+}
+
+/* Waits up to timeout_ms for completions and runs their callbacks */
+int i2cmega_handle_events (i2cmega_dev_t *dev, const int timeout_ms) {
+    return i2cmega_transport_events (dev, timeout_ms);
+}
+
+/* Waits until everything submitted has completed */
+int i2cmega_drain (i2cmega_dev_t *dev) {
+    int ret;
+
+    while (dev->inflight || dev->head) {
+        ret = i2cmega_handle_events (dev, 1000);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+/* A control transfer that returns once it is done, bytes moved or
+ * I2CMEGA_ERR_* */
+int i2cmega_control (i2cmega_dev_t *dev, const uint8_t type,
+                     const uint8_t request, const uint16_t value,
+                     const uint16_t index, void *buf, const uint16_t length) {
+    i2cmega_xfer_t xfer = { 0 };
+    int ret;
+
+    i2cmega_fill_control (&xfer, type, request, value, index, buf, length);
+    ret = i2cmega_submit (dev, &xfer);
+    if (ret < 0)
+        return ret;
+    ret = i2cmega_drain (dev);
+    return ret < 0 ? ret : xfer.result;
+}
+
+/* SET_FREQ on bus 0, the actual clock goes to actual if not NULL */
+int i2cmega_set_freq (i2cmega_dev_t *dev, const uint32_t freq,
+                      uint32_t *actual) {
+    uint8_t buf[4];
+    uint32_t hz;
+    int ret;
+
+    ret = i2cmega_control (dev, I2CMEGA_CONTROL_IN, CMD_SET_FREQ, freq,
+                           (freq >> 16) & 0xff, buf, sizeof (buf));
+    if (ret < 0)
+        return ret;
+    if (ret != sizeof (buf))
+        return I2CMEGA_ERR_IO;
+    hz = buf[0] | (buf[1] << 8) | ((uint32_t)buf[2] << 16) |
+         ((uint32_t)buf[3] << 24);
+    if (actual)
+        *actual = hz;
+    return hz ? 0 : I2CMEGA_ERR_ARG;
+}
+
+/* Switches interface 0 between i2c-tiny-usb (0) and the bulk endpoints
+ * (1), after everything submitted has completed */
+int i2cmega_set_altsetting (i2cmega_dev_t *dev, const uint8_t alt) {
+    int ret = i2cmega_drain (dev);
+
+    return ret < 0 ? ret : i2cmega_transport_altsetting (dev, alt);
+}
@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* i2cmega.h - asynchronous host library for the i2c-mega-usb		     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Talks the CMD_* protocol of i2ctinyusb.h and i2cmegausb.h to the
+ * device directly, without the kernel driver, and keeps several
+ * transfers in flight. A transfer is filled in by the caller, submitted,
+ * and completed from i2cmega_handle_events (), which then calls its
+ * callback. Up to the queue depth given at open time are handed to the
+ * transport at once, the rest wait in submission order. Control
+ * transfers reach the device one after another in that order, so an
+ * I2C_IO and the GET_STATUS behind it can be submitted together.
+ *
+ * The transport is chosen at link time: usb.c goes through libusb,
+ * sim/link.c through the host simulation of the firmware. */
+
+#ifndef __i2cmega_h_included__
+#define __i2cmega_h_included__
+
+#include <stdint.h>
+
+#include "i2ctinyusb.h"
+#include "i2cmegausb.h"
+
+#define I2CMEGA_VENDOR_ID       0x0403
+#define I2CMEGA_PRODUCT_ID      0xc631
+
+/* Alternate settings of interface 0 */
+#define I2CMEGA_ALT_TINYUSB     0       /* control endpoint only */
+#define I2CMEGA_ALT_BULK        1       /* batch, event and stream endpoints */
+
+/* Endpoints of alternate setting 1 */
+#define I2CMEGA_BULK_OUT        0x01
+#define I2CMEGA_BULK_IN         0x82
+#define I2CMEGA_EVENT_IN        0x83
+#define I2CMEGA_STREAM_IN       0x84
+
+/* Results below 0 */
+#define I2CMEGA_ERR_IO          -1      /* transport error */
+#define I2CMEGA_ERR_STALL       -2      /* the device stalled the request */
+#define I2CMEGA_ERR_TIMEOUT     -3
+#define I2CMEGA_ERR_NODEV       -4      /* no device found or it went away */
+#define I2CMEGA_ERR_ARG         -5      /* bad arguments */
+
+enum {
+    I2CMEGA_CONTROL_IN,
+    I2CMEGA_CONTROL_OUT,
+    I2CMEGA_BULK,           /* direction from the endpoint address */
+};
+
+typedef struct i2cmega_dev i2cmega_dev_t;
+typedef struct i2cmega_xfer i2cmega_xfer_t;
+typedef void (*i2cmega_cb_t) (i2cmega_xfer_t *xfer);
+
+struct i2cmega_xfer {
+    uint8_t         type;
+    uint8_t         request;        /* control: bRequest */
+    uint16_t        value;          /* control: wValue */
+    uint16_t        index;          /* control: wIndex */
+    uint8_t         endpoint;       /* bulk: endpoint address */
+    uint8_t        *buf;
+    uint16_t        length;
+    i2cmega_cb_t    callback;       /* may be NULL */
+    void           *user;
+
+    /* Set by the library */
+    int             result;         /* bytes moved or I2CMEGA_ERR_* */
+    uint64_t        submitted;      /* i2cmega_now () at submission */
+    uint64_t        started;        /* handed to the transport */
+    uint64_t        completed;      /* and at completion */
+    i2cmega_dev_t  *dev;
+    i2cmega_xfer_t *next;           /* waiting list */
+    void           *priv;           /* transport's state */
+};
+
+/* Opening and closing. depth is the number of transfers in flight. */
+int      i2cmega_open (i2cmega_dev_t **dev, const int depth);
+void     i2cmega_close (i2cmega_dev_t *dev);
+uint64_t i2cmega_now (i2cmega_dev_t *dev);     /* ns, transport's clock */
+
+/* Asynchronous transfers */
+void     i2cmega_fill_control (i2cmega_xfer_t *xfer, const uint8_t type,
+                               const uint8_t request, const uint16_t value,
+                               const uint16_t index, void *buf,
+                               const uint16_t length);
+void     i2cmega_fill_bulk (i2cmega_xfer_t *xfer, const uint8_t endpoint,
+                            void *buf, const uint16_t length);
+void     i2cmega_fill_io (i2cmega_xfer_t *xfer, const uint8_t cmd,
+                          const uint16_t flags, const uint16_t addr,
+                          void *buf, const uint16_t length);
+void     i2cmega_fill_status (i2cmega_xfer_t *xfer, uint8_t *status);
+int      i2cmega_submit (i2cmega_dev_t *dev, i2cmega_xfer_t *xfer);
+int      i2cmega_pending (i2cmega_dev_t *dev);
+int      i2cmega_handle_events (i2cmega_dev_t *dev, const int timeout_ms);
+int      i2cmega_drain (i2cmega_dev_t *dev);
+
+/* Synchronous helpers, which wait for everything submitted before */
+int      i2cmega_control (i2cmega_dev_t *dev, const uint8_t type,
+                          const uint8_t request, const uint16_t value,
+                          const uint16_t index, void *buf,
+                          const uint16_t length);
+int      i2cmega_set_freq (i2cmega_dev_t *dev, const uint32_t freq,
+                           uint32_t *actual);
+int      i2cmega_set_altsetting (i2cmega_dev_t *dev, const uint8_t alt);
+
+/* Transport interface, for usb.c and sim/link.c */
+int      i2cmega_transport_open (i2cmega_dev_t *dev);
+void     i2cmega_transport_close (i2cmega_dev_t *dev);
+int      i2cmega_transport_submit (i2cmega_dev_t *dev, i2cmega_xfer_t *xfer);
+int      i2cmega_transport_events (i2cmega_dev_t *dev, const int timeout_ms);
+int      i2cmega_transport_altsetting (i2cmega_dev_t *dev, const uint8_t alt);
+uint64_t i2cmega_transport_now (i2cmega_dev_t *dev);
+void     i2cmega_complete (i2cmega_xfer_t *xfer, const int result);
+
+struct i2cmega_dev {
+    int             depth;          /* transfers handed to the transport */
+    int             inflight;
+    i2cmega_xfer_t *head;           /* waiting for a slot */
+    i2cmega_xfer_t *tail;
+    void           *priv;           /* transport's state */
+};
+
+#endif
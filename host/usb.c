@@ -0,0 +1,198 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* usb.c - libusb transport of the i2c-mega-usb host library		     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Every transfer gets its own libusb transfer, so as many as the queue
+ * depth are with the host controller at once. Control transfers carry
+ * the setup packet in front of the data, as libusb wants it. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libusb.h>
+
+#include "i2cmega.h"
+
+/* Vendor requests go to the device, which works while the kernel driver
+ * holds the interface */
+#define USB_REQ_IN              (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | \
+                                 LIBUSB_RECIPIENT_DEVICE)
+#define USB_REQ_OUT             (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | \
+                                 LIBUSB_RECIPIENT_DEVICE)
+/* Long enough for scripts and slow clocks */
+#define USB_TIMEOUT_MS          5000
+
+typedef struct {
+    libusb_context       *ctx;
+    libusb_device_handle *handle;
+    int                   claimed;
+} usb_t;
+
+static int usb_error (const int err) {
+    switch (err) {
+    case LIBUSB_ERROR_PIPE:
+        return I2CMEGA_ERR_STALL;
+    case LIBUSB_ERROR_TIMEOUT:
+        return I2CMEGA_ERR_TIMEOUT;
+    case LIBUSB_ERROR_NO_DEVICE:
+    case LIBUSB_ERROR_NOT_FOUND:
+        return I2CMEGA_ERR_NODEV;
+    case LIBUSB_ERROR_INVALID_PARAM:
+        return I2CMEGA_ERR_ARG;
+    }
+    return I2CMEGA_ERR_IO;
+}
+
+int i2cmega_transport_open (i2cmega_dev_t *dev) {
+    usb_t *usb = calloc (1, sizeof (*usb));
+
+    if (!usb)
+        return I2CMEGA_ERR_IO;
+    if (libusb_init (&usb->ctx) < 0) {
+        free (usb);
+        return I2CMEGA_ERR_IO;
+    }
+    usb->handle = libusb_open_device_with_vid_pid (usb->ctx, I2CMEGA_VENDOR_ID,
+                                                   I2CMEGA_PRODUCT_ID);
+    if (!usb->handle) {
+        libusb_exit (usb->ctx);
+        free (usb);
+        return I2CMEGA_ERR_NODEV;
+    }
+    dev->priv = usb;
+    return 0;
+}
+
+void i2cmega_transport_close (i2cmega_dev_t *dev) {
+    usb_t *usb = dev->priv;
+
+    if (usb->claimed) {
+        libusb_set_interface_alt_setting (usb->handle, 0, I2CMEGA_ALT_TINYUSB);
+        libusb_release_interface (usb->handle, 0);
+    }
+    libusb_close (usb->handle);
+    libusb_exit (usb->ctx);
+    free (usb);
+}
+
+uint64_t i2cmega_transport_now (i2cmega_dev_t *dev) {
+    struct timespec ts;
+
+    (void)dev;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void LIBUSB_CALL usb_done (struct libusb_transfer *t) {
+    i2cmega_xfer_t *xfer = t->user_data;
+    int result;
+
+    switch (t->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        result = t->actual_length;
+        if (xfer->type == I2CMEGA_CONTROL_IN)
+            memcpy (xfer->buf, libusb_control_transfer_get_data (t), result);
+        break;
+    case LIBUSB_TRANSFER_STALL:
+        result = I2CMEGA_ERR_STALL;
+        break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        result = I2CMEGA_ERR_TIMEOUT;
+        break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        result = I2CMEGA_ERR_NODEV;
+        break;
+    default:
+        result = I2CMEGA_ERR_IO;
+        break;
+    }
+    if (xfer->type != I2CMEGA_BULK)
+        free (t->buffer);
+    libusb_free_transfer (t);
+    xfer->priv = NULL;
+    i2cmega_complete (xfer, result);
+}
+
+int i2cmega_transport_submit (i2cmega_dev_t *dev, i2cmega_xfer_t *xfer) {
+    usb_t *usb = dev->priv;
+    struct libusb_transfer *t = libusb_alloc_transfer (0);
+    uint8_t *buf;
+    int ret;
+
+    if (!t)
+        return I2CMEGA_ERR_IO;
+    if (xfer->type == I2CMEGA_BULK) {
+        libusb_fill_bulk_transfer (t, usb->handle, xfer->endpoint, xfer->buf,
+                                   xfer->length, usb_done, xfer, USB_TIMEOUT_MS);
+    } else {
+        buf = malloc (LIBUSB_CONTROL_SETUP_SIZE + xfer->length);
+        if (!buf) {
+            libusb_free_transfer (t);
+            return I2CMEGA_ERR_IO;
+        }
+        libusb_fill_control_setup (buf, xfer->type == I2CMEGA_CONTROL_IN ?
+                                   USB_REQ_IN : USB_REQ_OUT, xfer->request,
+                                   xfer->value, xfer->index, xfer->length);
+        if (xfer->type == I2CMEGA_CONTROL_OUT && xfer->length)
+            memcpy (buf + LIBUSB_CONTROL_SETUP_SIZE, xfer->buf, xfer->length);
+        libusb_fill_control_transfer (t, usb->handle, buf, usb_done, xfer,
+                                      USB_TIMEOUT_MS);
+    }
+    xfer->priv = t;
+    ret = libusb_submit_transfer (t);
+    if (ret < 0) {
+        if (xfer->type != I2CMEGA_BULK)
+            free (t->buffer);
+        libusb_free_transfer (t);
+        xfer->priv = NULL;
+        return usb_error (ret);
+    }
+    return 0;
+}
+
+int i2cmega_transport_events (i2cmega_dev_t *dev, const int timeout_ms) {
+    usb_t *usb = dev->priv;
+    struct timeval tv = {
+        .tv_sec  = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000
+    };
+    int ret = libusb_handle_events_timeout_completed (usb->ctx, &tv, NULL);
+
+    return ret < 0 ? usb_error (ret) : 0;
+}
+
+/* The bulk endpoints need the interface, which takes it from the kernel
+ * driver until the device is closed */
+int i2cmega_transport_altsetting (i2cmega_dev_t *dev, const uint8_t alt) {
+    usb_t *usb = dev->priv;
+    int ret;
+
+    if (!usb->claimed) {
+        libusb_set_auto_detach_kernel_driver (usb->handle, 1);
+        ret = libusb_claim_interface (usb->handle, 0);
+        if (ret < 0)
+            return usb_error (ret);
+        usb->claimed = 1;
+    }
+    ret = libusb_set_interface_alt_setting (usb->handle, 0, alt);
+    return ret < 0 ? usb_error (ret) : 0;
+}
@@ -21,24 +21,34 @@
     MA 02110-1301 USA.							     */
 /* ------------------------------------------------------------------------- */
 
-#define __IMU__DEBUG__
-
 #include "Config/LUFAConfig.h"
+#include "Config/AppConfig.h"
 #include "version.h"
 #include "Descriptors.h"
-#include "LUFA/Drivers/Peripheral/TWI.h"
-#ifdef __IMU__DEBUG__
-#include "LUFA/Drivers/Peripheral/Serial.h"
-#define DPRINTF(...) printf (__VA_ARGS__)
-#define DEBUGSPEED   2000000
-#else
-#define DPRINTF(...)
-#endif
+#include <util/atomic.h>
+#include <util/delay.h>
+#include <string.h>
 
 #include "i2ctinyusb.h"
+#include "i2cmegausb.h"
+#include "alert.h"
+#include "batch.h"
+#include "config.h"
+#include "monitor.h"
+#include "poll.h"
+#include "prog.h"
+#include "script.h"
+#include "slave.h"
+#include "stream.h"
+#include "twi.h"
+#include "swi.h"
+#include "queue.h"
+#include "clock.h"
+#include "pec.h"
+#include "trace.h"
+#include "profile.h"
+#include "stats.h"
 
-/* ms - could expand tinyusb protocol to change this */
-const int8_t i2c_timeout = 2;
 // TODO: move to progmem
 const uint32_t supported_caps = I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
 
@@ -47,31 +57,121 @@ volatile int8_t  i2c_status_int = STATUS_UNCONFIGURED;
 volatile int8_t  i2c_datadir;
 volatile int16_t i2c_expected;
 volatile int8_t  i2c_stopafter;
+volatile uint8_t i2c_active;         /* data stage handled by i2c_task */
+volatile uint8_t i2c_altsetting = INTERFACE_ALT_TINYUSB;
+
+/* Phases of a READ_REG request */
+enum {
+    I2C_REG_NONE,       /* not a register read */
+    I2C_REG_POINTER,    /* sending the register number */
+    I2C_REG_DATA        /* reading, the status byte goes last */
+};
+
+static uint8_t i2c_regphase = I2C_REG_NONE;
+static uint8_t i2c_regaddr;
+
+static uint8_t i2c_crc;         /* SMBus PEC of the transaction so far */
+static uint8_t i2c_pecmode;     /* PEC byte still to send or check */
+static uint8_t i2c_pecfailed;   /* PEC check of the message failed */
+static uint8_t i2c_recvlen;     /* count byte of a block read pending */
+static uint8_t i2c_zlp;         /* short read ends on a packet boundary */
+static uint32_t i2c_setup;      /* clock_ticks () at the SETUP of the request */
+
+/* i2c-tiny-usb requests pick their bus with the high byte of wIndex:
+ * I2C_BUS_TWI or I2C_BUS_SWI. i2c_status and i2c_status_int belong to
+ * the bus of the last request, the other bus keeps its pair here. */
+static uint8_t i2c_bus = I2C_BUS_TWI;
+static int8_t  i2c_parked_status     = STATUS_UNCONFIGURED;
+static int8_t  i2c_parked_status_int = STATUS_UNCONFIGURED;
+
+static i2c_cmd_t i2c_next;      /* request taken from the queue */
+static uint8_t   i2c_waiting;   /* i2c_next waits for its bus */
+
+/* The engine of the current bus */
+#define bus_state()             (i2c_bus ? swi_state : twi_state)
+#define bus_busy()              (i2c_bus ? swi_busy () : twi_busy ())
+#define bus_failed()            (i2c_bus ? swi_failed () : twi_failed ())
+#define bus_start(sla, len)     (i2c_bus ? swi_start (sla, len) : twi_start (sla, len))
+#define bus_start_block(sla, max, extra) \
+    (i2c_bus ? swi_start_block (sla, max, extra) : twi_start_block (sla, max, extra))
+#define bus_stop()              (i2c_bus ? swi_stop () : twi_stop ())
+#define bus_abort()             (i2c_bus ? swi_abort () : twi_abort ())
+#define bus_room()              (i2c_bus ? swi_room () : twi_room ())
+#define bus_put(data)           (i2c_bus ? swi_put (data) : twi_put (data))
+#define bus_get(data)           (i2c_bus ? swi_get (data) : twi_get (data))
+
+/* Makes bus the current one, swapping the status pairs */
+static void i2c_select (const uint8_t bus) {
+    int8_t status;
+
+    if (bus == i2c_bus)
+        return;
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        status                = i2c_status;
+        i2c_status            = i2c_parked_status;
+        i2c_parked_status     = status;
+        status                = i2c_status_int;
+        i2c_status_int        = i2c_parked_status_int;
+        i2c_parked_status_int = status;
+        i2c_bus               = bus;
+    }
+}
+
+/* Result of the last transaction on a bus, for GET_STATUS */
+int8_t i2c_bus_status (const uint8_t bus) {
+    if (bus >= I2C_BUSES)
+        return STATUS_UNCONFIGURED;
+    return bus == i2c_bus ? i2c_status : i2c_parked_status;
+}
+
+/* Bus a queued request runs on, I2C_BUSES if there is no such bus */
+static uint8_t i2c_request_bus (const i2c_cmd_t *req) {
+    uint8_t bus = req->index >> 8;
+
+    if ((req->request & ~(CMD_I2C_IO_BEGIN | CMD_I2C_IO_END)) != CMD_I2C_IO &&
+        req->request != CMD_SET_DELAY && req->request != CMD_SET_FREQ)
+        return I2C_BUS_TWI;
+    return bus < I2C_BUSES ? bus : I2C_BUSES;
+}
 
 void i2c_stop (void) {
     if (i2c_status_int != STATUS_IDLE) {
-        DPRINTF ("I2C STOP\r\n");
-        TWI_StopTransmission ();
+        TRACE (TRACE_STOP, i2c_bus, 0, 0);
+        if (bus_busy ())
+            bus_abort ();
+        else
+            bus_stop ();
         i2c_status_int = STATUS_IDLE;
     }
 }
 
-uint8_t i2c_start (const uint8_t address, const uint8_t timeout) {
-    uint8_t result;
-
-    DPRINTF ("I2C START %02x\r\n", address);
-    result = TWI_StartTransmission (address, timeout);
-    if (result == TWI_ERROR_NoError) {
+/* Waits for the address phase of a transfer the engine started, which
+ * the engine's timeout ends at the latest. The data phase is left to the
+ * TWI interrupt and i2c_task (); reads start filling the engine's buffer
+ * right away. */
+static uint8_t i2c_address (const uint8_t address) {
+    TRACE (TRACE_START, address, 0, 0);
+    while (bus_state () == TWI_ADDRESS)
+        _delay_us (1);
+    if (bus_state () == TWI_TIMEOUT)
+        TRACE (TRACE_TIMEOUT, address, 0, 0);
+    if (bus_state () == TWI_DATA || bus_state () == TWI_HOLD) {
         i2c_status     = STATUS_ADDRESS_ACK;
         i2c_status_int = STATUS_RUNNING;
-        DPRINTF ("ACK\r\n");
-    } else {
-        i2c_status     = STATUS_ADDRESS_NAK;
-        i2c_status_int = STATUS_ADDRESS_NAK;
-        DPRINTF ("NAK (%d)\r\n", result);
-        i2c_stop ();
+        TRACE (TRACE_ACK, address, 0, 0);
+        return 0;
     }
-    return result;
+    i2c_status     = STATUS_ADDRESS_NAK;
+    i2c_status_int = STATUS_ADDRESS_NAK;
+    TRACE (TRACE_NAK, address, bus_state (), 0);
+    i2c_stop ();
+    return 1;
+}
+
+/* Starts a transfer of len bytes and waits for the address phase */
+uint8_t i2c_start (const uint8_t address, const uint16_t len) {
+    bus_start (address, len);
+    return i2c_address (address);
 }
 
 /* Resets the software part of the I2C engine */
@@ -80,62 +180,165 @@ void i2c_reset (void) {
         i2c_status_int != STATUS_IDLE)
         i2c_stop ();
     i2c_expected = 0;
+    i2c_active = 0;
     i2c_stopafter = 0;
+    i2c_regphase = I2C_REG_NONE;
+    i2c_pecmode = 0;
+    i2c_recvlen = 0;
+    i2c_zlp = 0;
 }
 
-/* The driver sets a delay in µs. Calculate Prescaler and frequency from it,
- * then convert back to bitlength in host clock cycles. */
+/* TWI setting for a bus clock: SCL = F_CPU / (16 + 2 * TWBR * 4^TWPS).
+ * The bit length is rounded up, so the bus never runs faster than
+ * requested. */
+typedef struct {
+    uint32_t freq;          /* requested clock in Hz */
+    uint32_t actual;        /* resulting clock in Hz */
+    uint8_t  delay;         /* same as i2c-tiny-usb delay in µs, or 0 */
+    uint8_t  prescale;      /* TWPS bits */
+    uint8_t  bitlength;     /* TWBR */
+} i2c_clock_t;
+
+#define I2C_CLOCK_LEN(f)        ((((F_CPU + (f) - 1) / (f)) - 16 + 1) / 2)
+#define I2C_CLOCK_PS(f)         (I2C_CLOCK_LEN (f) <= 255  ? 0 : \
+                                 I2C_CLOCK_LEN (f) <= 1020 ? 1 : \
+                                 I2C_CLOCK_LEN (f) <= 4080 ? 2 : 3)
+#define I2C_CLOCK_TWBR(f)       ((I2C_CLOCK_LEN (f) + (1 << (2 * I2C_CLOCK_PS (f))) - 1) \
+                                 >> (2 * I2C_CLOCK_PS (f)))
+#define I2C_CLOCK_HZ(f)         (F_CPU / (16 + 2 * I2C_CLOCK_TWBR (f) * \
+                                          (1 << (2 * I2C_CLOCK_PS (f)))))
+#define I2C_CLOCK(f)            { (f), I2C_CLOCK_HZ (f), \
+                                  (1000000 % (f)) ? 0 : 1000000 / (f), \
+                                  I2C_CLOCK_PS (f), I2C_CLOCK_TWBR (f) }
+
+/* Common clocks, worked out by the compiler. 1 MHz needs TWBR 0 at
+ * 16 MHz, the fastest the TWI can do. */
+static const i2c_clock_t i2c_clocks[] PROGMEM = {
+    I2C_CLOCK (10000),
+    I2C_CLOCK (50000),
+    I2C_CLOCK (100000),
+    I2C_CLOCK (400000),
+    I2C_CLOCK (1000000)
+};
+
+uint32_t i2c_freq;
+
+/* Works out the TWI setting for clocks not in the table. Returns 0 if
+ * the clock is out of range. */
+static uint8_t i2c_calc_clock (const uint32_t freq, i2c_clock_t *clk) {
+    uint32_t len;
+
+    if (freq > F_CPU / 16 || freq <= F_CPU / (16 + 2 * 255 * 64))
+        return 0;
+    len = (((F_CPU + freq - 1) / freq) - 16 + 1) / 2;
+    for (clk->prescale = 0; len > 255 && clk->prescale < 3; clk->prescale++)
+        len = (len + 3) >> 2;
+    if (len > 255)
+        return 0;
+    clk->bitlength = len;
+    clk->actual = F_CPU / (16 + 2 * len * (1 << (2 * clk->prescale)));
+    return 1;
+}
+
+/* Resets the engine and sets the bus clock, returns it in Hz */
+static uint32_t i2c_set_clock (const i2c_clock_t *clk) {
+    i2c_reset ();
+    twi_init (clk->prescale, clk->bitlength);
+    TRACE (TRACE_TWI_INIT, clk->prescale, clk->bitlength, 0);
+    i2c_status = STATUS_IDLE;
+    i2c_freq   = clk->actual;
+    return i2c_freq;
+}
+
+/* Resets the software master and sets its clock, returns it in Hz */
+static uint32_t i2c_set_swi (const uint32_t freq) {
+    uint32_t actual;
+
+    i2c_reset ();
+    actual = swi_init (freq);
+    if (actual)
+        i2c_status = STATUS_IDLE;
+    return actual;
+}
+
+/* Sets the clock of the current bus in Hz. Returns the actual clock or
+ * 0 if it is out of range. */
+uint32_t i2c_set_freq (const uint32_t freq) {
+    i2c_clock_t clk;
+    uint8_t i;
+
+    if (i2c_bus == I2C_BUS_SWI)
+        return i2c_set_swi (freq);
+
+    for (i = 0; i < sizeof (i2c_clocks) / sizeof (i2c_clocks[0]); i++) {
+        memcpy_P (&clk, &i2c_clocks[i], sizeof (clk));
+        if (clk.freq == freq)
+            return i2c_set_clock (&clk);
+    }
+    if (!i2c_calc_clock (freq, &clk))
+        return 0;
+    return i2c_set_clock (&clk);
+}
+
+/* The driver sets a delay in µs, which is one SCL period. Common values
+ * come from the table, others are converted to a frequency. */
 // TODO: check USB timeouts vs. I2C request duration to find the lower limit
 //       of I2C speed
-int i2c_set_delay (int16_t delay) {
-    uint32_t freq, bitlen;
+uint32_t i2c_set_delay (const uint16_t delay) {
+    i2c_clock_t clk;
+    uint8_t i;
 
-    i2c_reset ();
-    freq = 1000000 / delay;
-    bitlen = TWI_BITLENGTH_FROM_FREQ (1, freq);
-    if (bitlen > 255) {
-        bitlen = TWI_BITLENGTH_FROM_FREQ (4, freq);
-        if (bitlen > 255) {
-            bitlen = TWI_BITLENGTH_FROM_FREQ (16, freq);
-            if (bitlen > 255) {
-                bitlen = TWI_BITLENGTH_FROM_FREQ (64, freq);
-                if (bitlen > 255)
-                    return -1;
-                TWI_Init (TWI_BIT_PRESCALE_64, bitlen);
-                DPRINTF ("TWI Init, Prescale64, %lu clocks\r\n", bitlen);
-            } else {
-                TWI_Init (TWI_BIT_PRESCALE_16, bitlen);
-                DPRINTF ("TWI Init, Prescale16, %lu clocks\r\n", bitlen);
-            }
-        } else {
-            TWI_Init (TWI_BIT_PRESCALE_4, bitlen);
-            DPRINTF ("TWI Init, Prescale4, %lu clocks\r\n", bitlen);
-        }
-    } else {
-        TWI_Init (TWI_BIT_PRESCALE_1, bitlen);
-        DPRINTF ("TWI Init, Prescale1, %lu clocks\r\n", bitlen);
+    if (i2c_bus == I2C_BUS_SWI)
+        return delay ? i2c_set_swi (1000000UL / delay) : 0;
+
+    for (i = 0; i < sizeof (i2c_clocks) / sizeof (i2c_clocks[0]); i++) {
+        memcpy_P (&clk, &i2c_clocks[i], sizeof (clk));
+        if (clk.delay && clk.delay == delay)
+            return i2c_set_clock (&clk);
     }
+    if (!delay)
+        return 0;
+    return i2c_set_freq (1000000UL / delay);
+}
 
-    i2c_status = STATUS_IDLE;
-    return 0;
+/* Sets the clock of a bus in Hz like SET_FREQ, for the power-on
+ * settings. Returns the actual clock or 0 if it is out of range. */
+uint32_t i2c_bus_clock (const uint8_t bus, const uint32_t freq) {
+    uint8_t current = i2c_bus;
+    uint32_t actual;
+
+    i2c_select (bus);
+    actual = i2c_set_freq (freq);
+    i2c_select (current);
+    return actual;
+}
+
+/* Tells if a bus can run at freq Hz, without touching it */
+uint8_t i2c_clock_valid (const uint8_t bus, const uint32_t freq) {
+    i2c_clock_t clk;
+
+    if (!freq)
+        return 0;
+    if (bus == I2C_BUS_SWI)
+        return (F_CPU / 2 + freq - 1) / freq <= 0xffff;
+    return i2c_calc_clock (freq, &clk);
 }
 
-/* This function is called from within the USB Setup Request Callback
- * and only handles 0 byte requests completely. Longer requests are
- * set up to be handled from the mainloop. */
-void i2c_handle_io_request (void) {
-    uint8_t cmd         = USB_ControlRequest.bRequest;
-    uint8_t addr        = (USB_ControlRequest.wIndex) & 0x7f;
+/* This function is called from the main loop for an IO request taken
+ * from the queue and only handles 0 byte requests completely. Longer
+ * requests are set up to be finished by i2c_task (). */
+void i2c_handle_io_request (const i2c_cmd_t *req) {
+    uint8_t cmd         = req->request;
+    uint8_t addr        = (req->index) & 0x7f;
     uint8_t result;
 
-    i2c_datadir  = (USB_ControlRequest.wValue & I2C_M_RD) ? 1 : 0;
-    i2c_expected = USB_ControlRequest.wLength;
+    i2c_datadir  = (req->value & I2C_M_RD) ? 1 : 0;
+    i2c_expected = req->length;
+    i2c_recvlen  = i2c_datadir && i2c_expected && (req->value & I2C_M_RECV_LEN);
+    i2c_pecmode  = i2c_expected && (req->value & I2C_IO_PEC);
+    i2c_zlp      = 0;
 
-    DPRINTF ("i2c %s at 0x%02x%s%s, len = %d\r\n",
-             i2c_datadir ? "rd" : "wr", addr,
-             (cmd&CMD_I2C_IO_BEGIN) ? " START" : "",
-             (cmd&CMD_I2C_IO_END)   ? " STOP"  : "",
-             i2c_expected);
+    TRACE (TRACE_IO, (addr << 1) | i2c_datadir, cmd, i2c_expected);
 
     /* This WILL lead to USB errors due to missing acknowledge. It's up
      * to the driver to prevent this by using correct initialization. */
@@ -143,128 +346,566 @@ void i2c_handle_io_request (void) {
         return;
 
     addr = (addr << 1) | i2c_datadir;
+    /* The PEC covers all messages of the transaction */
+    if (cmd & CMD_I2C_IO_BEGIN)
+        i2c_crc = 0;
+    i2c_crc = pec_update (i2c_crc, addr);
 
-    /* Start / Repeated Start */
-    result = i2c_start (addr, i2c_timeout);
-    if (result != TWI_ERROR_NoError)
+    /* Start / Repeated Start. Block reads take the count byte and at
+     * most as much data as the host asked for. */
+    if (i2c_recvlen) {
+        bus_start_block (addr, i2c_expected > 256 ? 255 : i2c_expected - 1,
+                         i2c_pecmode);
+        result = i2c_address (addr);
+    } else {
+        result = i2c_start (addr, i2c_expected + i2c_pecmode);
+    }
+    if (result)
         i2c_stop ();
 
     i2c_stopafter = 0;
     if ((cmd & CMD_I2C_IO_END)) {
         if (i2c_expected) {
             i2c_stopafter = 1;
-            DPRINTF ("No STOP, pending transaction\r\n");
         } else {
             i2c_stop ();
         }
     }
 
-    /* Send the empty USB acknowledge frame on 0-byte data operations */
+    /* Send the empty USB acknowledge frame on 0-byte data operations.
+     * Without a data stage the status stage is always IN, also for
+     * reads. */
     if (!i2c_expected) {
-        if (i2c_datadir)
-            Endpoint_ClearIN ();
-        Endpoint_ClearStatusStage ();
+        Endpoint_ClearIN ();
+    } else {
+        i2c_active = 1;
     }
 }
 
-/* This function is called from within the main loop to finish
- * transfers set up in the USB Setup Request Callback. This function
- * fills at maximum one frame (8 data Bytes) per call. */
-void i2c_task (void) {
-    uint8_t result;
-    uint8_t data;
+/* Sets up a register read: the register number goes out in a write
+ * message, i2c_task () turns the bus around with a repeated START and
+ * returns the data plus a status byte in the data stage. */
+static void i2c_handle_reg_request (const i2c_cmd_t *req) {
+    uint8_t addr = req->value & 0x7f;
+    uint8_t size = (req->value >> 8) & 0x03;
 
-    if (!i2c_expected)
+    TRACE (TRACE_IO, addr << 1, req->request, req->length);
+
+    if (i2c_status == STATUS_UNCONFIGURED || i2c_status_int == STATUS_RUNNING ||
+        size < 1 || size > 2 || req->length < 2) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    i2c_regaddr   = addr;
+    i2c_regphase  = I2C_REG_POINTER;
+    i2c_pecmode   = 0;
+    i2c_recvlen   = 0;
+    i2c_zlp       = 0;
+    i2c_datadir   = 1;
+    i2c_expected  = req->length;
+    i2c_stopafter = 1;
+    i2c_active    = 1;
+    if (i2c_start (addr << 1, size))
         return;
-    DPRINTF ("i2c_task: %d byte%s pending for %s%s\r\n",
-             i2c_expected, i2c_expected==1?"":"s",
-             i2c_datadir?"read":"write",
-             i2c_stopafter ? " STOP" : "");
-    if (i2c_datadir) {
-        /* pending read */
+    /* Big endian, like the address counters of EEPROMs */
+    if (size == 2)
+        bus_put (req->index >> 8);
+    bus_put (req->index);
+}
+
+/* Waits for the register number of a register read to leave the engine,
+ * then starts the read. Returns 0 while the write is in progress. */
+static uint8_t i2c_reg_turn (void) {
+    if (i2c_status_int == STATUS_RUNNING) {
+        if (bus_busy ())
+            return 0;
+        if (bus_failed ()) {
+            TRACE (TRACE_TX_FAILED, 0, 0, 0);
+            i2c_status_int = STATUS_WRITE_FAILED;
+        } else {
+            /* Repeated START */
+            i2c_start ((i2c_regaddr << 1) | 1, i2c_expected - 1);
+        }
+    }
+    i2c_regphase = I2C_REG_DATA;
+    return 1;
+}
+
+/* Result of a register read for its status byte. A NAKed address has
+ * already been stopped and only shows in i2c_status. */
+static int8_t i2c_reg_status (void) {
+    if (i2c_status_int == STATUS_RUNNING)
+        return STATUS_ADDRESS_ACK;
+    if (i2c_status_int == STATUS_READ_FAILED ||
+        i2c_status_int == STATUS_WRITE_FAILED)
+        return i2c_status_int;
+    return i2c_status;
+}
+
+/* Probes a range of addresses for CMD_SCAN and returns the bitmap of
+ * those that acknowledged. All probes run here in one go, with a short
+ * timeout, as no engine and no i2c-tiny-usb transaction owns the bus. */
+static void i2c_scan (const i2c_cmd_t *req) {
+    uint8_t map[16] = { 0 };
+    uint8_t first = req->value & 0xff, last = req->value >> 8;
+    uint8_t rd = (req->index & I2C_SCAN_READ) ? 1 : 0;
+    uint8_t addr, data, found = 0;
+
+    if (!req->value) {
+        first = 0x03;
+        last  = 0x77;
+    }
+    if (i2c_status == STATUS_UNCONFIGURED || i2c_status_int == STATUS_RUNNING ||
+        first > last || last > 0x7f || !req->length) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    twi_set_probe_timeout (I2C_SCAN_TIMEOUT_US);
+    for (addr = first; addr <= last; addr++) {
+        twi_start ((addr << 1) | rd, rd);
+        while (twi_busy ())
+            _delay_us (1);
+        if (twi_state == TWI_HOLD) {
+            map[addr >> 3] |= 1 << (addr & 7);
+            found++;
+        }
+        /* The byte of a read probe */
+        twi_get (&data);
+        twi_stop ();
+    }
+    twi_set_probe_timeout (0);
+    TRACE (TRACE_SCAN, first, last, found);
+
+    Endpoint_SetEndpointDirection (ENDPOINT_DIR_IN);
+    Endpoint_Write_Control_Stream_LE (map, req->length < sizeof (map) ?
+                                      req->length : sizeof (map));
+    Endpoint_ClearOUT ();
+}
+
+/* Writes the payload of CMD_FANOUT to every address in its bitmap and
+ * keeps the bitmap of those that took all of it for CMD_GET_FANOUT. Like
+ * a scan, the messages run here in one go; the payload always fits into
+ * the engine's buffer, so it is queued before the address goes out. */
+static uint8_t i2c_fanout_map[16];
+
+static void i2c_fanout (const i2c_cmd_t *req) {
+    uint8_t buf[sizeof (i2c_fanout_map) + I2C_FANOUT_MAXLEN];
+    uint8_t len = req->length - sizeof (i2c_fanout_map);
+    uint8_t *payload = buf + sizeof (i2c_fanout_map);
+    uint8_t addr, i, sent = 0, acked = 0;
+
+    if (i2c_status == STATUS_UNCONFIGURED || i2c_status_int == STATUS_RUNNING ||
+        req->length <= sizeof (i2c_fanout_map) || req->length > sizeof (buf)) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    Endpoint_SetEndpointDirection (ENDPOINT_DIR_OUT);
+    if (Endpoint_Read_Control_Stream_LE (buf, req->length))
+        return;
+
+    memset (i2c_fanout_map, 0, sizeof (i2c_fanout_map));
+    for (addr = 0; addr < 0x80; addr++) {
+        if (!(buf[addr >> 3] & (1 << (addr & 7))))
+            continue;
+        twi_start (addr << 1, len);
+        for (i = 0; i < len; i++)
+            twi_put (payload[i]);
+        while (twi_busy ())
+            _delay_us (1);
+        if (twi_state == TWI_HOLD) {
+            i2c_fanout_map[addr >> 3] |= 1 << (addr & 7);
+            acked++;
+        }
+        twi_stop ();
+        sent++;
+    }
+    TRACE (TRACE_FANOUT, sent, acked, len);
+    Endpoint_ClearIN ();
+}
+
+/* Runs a request queued by the control request handler. Everything but
+ * the data stage of IO requests is finished here. */
+static void i2c_execute (const i2c_cmd_t *req) {
+    uint8_t bus = i2c_request_bus (req);
+    uint32_t freq;
+
+    if (bus == I2C_BUSES) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    i2c_select (bus);
+    switch (req->request) {
+    case CMD_SET_DELAY:
+        /* This will fail with an USB error if the value is invalid */
+        if (i2c_set_delay (req->value))
+            Endpoint_ClearIN ();
+        break;
+    case CMD_SET_FREQ:
+        /* Reports the actual clock, 0 if the value is invalid */
+        freq = i2c_set_freq (((uint32_t)(req->index & 0xff) << 16) | req->value);
         Endpoint_SetEndpointDirection (ENDPOINT_DIR_IN);
-        while (i2c_expected && Endpoint_IsReadWriteAllowed ()) {
-            i2c_expected--;
-            if (i2c_status_int == STATUS_RUNNING) {
-                result = TWI_ReceiveByte (&data, i2c_expected==0);
-                if (!result) {
-                    DPRINTF ("ERR RX\r\n");
-                    i2c_status_int = STATUS_READ_FAILED;
-                    Endpoint_Write_8 (0xff);
-                } else {
-                    Endpoint_Write_8 (data);
-                }
-            } else {
-                Endpoint_Write_8 (0xff);
+        if (req->length >= sizeof (freq))
+            Endpoint_Write_32_LE (freq);
+        Endpoint_ClearIN ();
+        break;
+#if !defined(I2C_USB_LOWSPEED)
+    case CMD_SET_POLL:
+        poll_set (req);
+        break;
+    case CMD_SET_STREAM:
+        stream_set (req);
+        break;
+    case CMD_PROGRAM:
+        prog_set (req);
+        break;
+    case CMD_SET_ALERT:
+        alert_set (req);
+        break;
+    case CMD_SET_MONITOR:
+        monitor_set (req);
+        break;
+#endif
+    case CMD_READ_REG:
+        i2c_handle_reg_request (req);
+        break;
+    case CMD_SCAN:
+        i2c_scan (req);
+        break;
+    case CMD_FANOUT:
+        i2c_fanout (req);
+        break;
+    case CMD_SET_SCRIPT:
+        script_set (req);
+        break;
+    case CMD_RUN_SCRIPT:
+        script_run (req);
+        break;
+    case CMD_SET_SLAVE:
+        slave_set (req);
+        break;
+    case CMD_SET_CONFIG:
+        config_set (req);
+        break;
+    default:
+        i2c_handle_io_request (req);
+        break;
+    }
+}
+
+/* A background engine owns the TWI bus */
+static uint8_t i2c_engine_busy (void) {
+    if (script_busy ())
+        return 1;
+#if !defined(I2C_USB_LOWSPEED)
+    if (batch_busy () || poll_busy () || stream_busy () || prog_busy () ||
+        alert_busy ())
+        return 1;
+#endif
+    return 0;
+}
+
+/* The TWI bus is free for a background engine when no i2c-tiny-usb
+ * transaction is open on it and no other engine owns it */
+uint8_t i2c_bus_free (void) {
+    if (i2c_bus == I2C_BUS_TWI ? i2c_status_int == STATUS_RUNNING || i2c_active :
+                                 i2c_parked_status_int == STATUS_RUNNING)
+        return 0;
+    return !i2c_engine_busy ();
+}
+
+/* Sends the PEC after the data of a write or checks it after the data
+ * of a read. Returns 0 while waiting for the engine. */
+static uint8_t i2c_pec_finish (void) {
+    uint8_t data;
+
+    if (i2c_status_int == STATUS_RUNNING) {
+        if (!i2c_datadir) {
+            if (!bus_put (i2c_crc))
+                return 0;
+        } else if (bus_get (&data)) {
+            if (data != i2c_crc) {
+                TRACE (TRACE_PEC_FAILED, i2c_crc, data, 0);
+                i2c_pecfailed = 1;
             }
+        } else if (bus_failed ()) {
+            TRACE (TRACE_RX_FAILED, 0, 0, 0);
+            i2c_status_int = STATUS_READ_FAILED;
+        } else {
+            return 0;
         }
-        Endpoint_ClearIN ();
-    } else {
-        /* pending write */
-        Endpoint_SetEndpointDirection (ENDPOINT_DIR_OUT);
-        DPRINTF ("%d BIE, %d IRWA\r\n",
-                 Endpoint_BytesInEndpoint (), Endpoint_IsReadWriteAllowed ());
+    }
+    i2c_pecmode = 0;
+    return 1;
+}
+
+/* Sizes the data stage of a block read by its count byte. A count the
+ * host has no room for fails the message. */
+static void i2c_block_count (const uint8_t count) {
+    i2c_recvlen = 0;
+    if (!count || count >= i2c_expected) {
+        TRACE (TRACE_RX_FAILED, count, 0, 0);
+        i2c_status_int = STATUS_READ_FAILED;
+        return;
+    }
+    /* A short data stage that fills its last packet ends with a ZLP */
+    if (count + 1 < i2c_expected &&
+        !((count + 1) % FIXED_CONTROL_ENDPOINT_SIZE))
+        i2c_zlp = 1;
+    i2c_expected = count + 1;
+}
+
+/* Serves at most one packet of a pending read from what the engine has
+ * fetched already, ending register reads with their status byte.
+ * Returns the number of bytes moved. */
+static uint8_t i2c_read_packet (void) {
+    uint8_t moved = 0, data;
+
+    if (!i2c_expected && !i2c_zlp && !i2c_pecmode)
+        return 0;
+    Endpoint_SetEndpointDirection (ENDPOINT_DIR_IN);
+    if (!Endpoint_IsINReady ())
+        return 0;
+    /* Nothing left, this is the ZLP */
+    if (!i2c_expected)
+        i2c_zlp = 0;
+    while (i2c_expected &&
+           Endpoint_BytesInEndpoint () < FIXED_CONTROL_ENDPOINT_SIZE) {
+        if (i2c_status_int == STATUS_RUNNING && bus_failed ()) {
+            TRACE (TRACE_RX_FAILED, i2c_expected, 0, 0);
+            i2c_status_int = STATUS_READ_FAILED;
+        }
+        if (i2c_regphase && i2c_expected == 1)
+            data = i2c_reg_status ();
+        else if (i2c_status_int != STATUS_RUNNING)
+            data = 0xff;
+        else if (!bus_get (&data))
+            return moved;
+        else if (i2c_recvlen)
+            i2c_block_count (data);
+        i2c_crc = pec_update (i2c_crc, data);
+        Endpoint_Write_8 (data);
+        i2c_expected--;
+        moved++;
+    }
+    /* The last packet waits for the PEC check, the driver asks for the
+     * status right after it */
+    if (!i2c_expected && i2c_pecmode && !i2c_pec_finish ())
+        return moved;
+    Endpoint_ClearIN ();
+    return moved;
+}
+
+/* Hands the received packet of a pending write to the engine as far as
+ * it has room. Returns the number of bytes moved. */
+static uint8_t i2c_write_packet (void) {
+    uint8_t moved = 0, data;
+
+    Endpoint_SetEndpointDirection (ENDPOINT_DIR_OUT);
+    if (i2c_expected && Endpoint_IsOUTReceived ()) {
         while (i2c_expected && Endpoint_BytesInEndpoint ()) {
-            i2c_expected--;
+            if (i2c_status_int == STATUS_RUNNING && !bus_room ())
+                break;
             data = Endpoint_Read_8 ();
-            if (i2c_status_int == STATUS_RUNNING) {
-                result = TWI_SendByte (data);
-                if (!result) {
-                    DPRINTF ("ERR TX\r\n");
-                    i2c_status_int = STATUS_WRITE_FAILED;
-                }
-            }
+            i2c_expected--;
+            moved++;
+            if (i2c_status_int == STATUS_RUNNING)
+                bus_put (data);
+            i2c_crc = pec_update (i2c_crc, data);
         }
-        Endpoint_ClearOUT ();
+        if (!Endpoint_BytesInEndpoint ())
+            Endpoint_ClearOUT ();
     }
-    DPRINTF ("i2c_task: %d byte%s still pending for %s\r\n",
-             i2c_expected, i2c_expected==1?"":"s",
-             i2c_datadir?"read":"write");
+    if (i2c_status_int == STATUS_RUNNING && bus_failed ()) {
+        TRACE (TRACE_TX_FAILED, i2c_expected, 0, 0);
+        i2c_status_int = STATUS_WRITE_FAILED;
+    }
+    return moved;
+}
 
-    if (!i2c_expected) {
-        /* Bring on RX or TX errors to the driver, if it asks */
-        // TODO: check if the driver could handle the other answers
-        if (i2c_status_int == STATUS_READ_FAILED ||
-            i2c_status_int == STATUS_WRITE_FAILED)
-            i2c_status = STATUS_ADDRESS_NAK;
-        /* Send a STOP on the bus if requested */
-        if (i2c_stopafter)
-            i2c_stop ();
-        /* Handle acknowledge packet after everything is done */
-        if (!i2c_datadir)
-            Endpoint_ClearIN();
+/* This function is called from within the main loop to start requests
+ * from the queue and to finish transfers set up by them. It moves data
+ * between the control endpoint and the TWI engine, at maximum one
+ * packet (FIXED_CONTROL_ENDPOINT_SIZE data Bytes, 64 at full speed, 8
+ * at low speed) per call, and never waits for the bus. */
+void i2c_task (void) {
+    i2c_cmd_t req;
+    uint8_t moved;
+    PROFILE_START ();
+
+    Endpoint_SelectEndpoint (ENDPOINT_CONTROLEP);
+    if (!i2c_active) {
+        if (!i2c_waiting && !queue_get (&i2c_next))
+            return;
+        /* Requests for the TWI wait while an engine owns it, those for
+         * the software master go ahead */
+        i2c_waiting = 1;
+        if (i2c_request_bus (&i2c_next) == I2C_BUS_TWI && i2c_engine_busy ())
+            return;
+        i2c_waiting = 0;
+        req = i2c_next;
+        i2c_execute (&req);
+        PROFILE_END (PROFILE_EXECUTE, 0);
+        if (!i2c_active) {
+            STATS_TIME (STATS_REQUEST, clock_ticks () - req.ticks);
+            return;
+        }
+        i2c_setup = req.ticks;
+        PROFILE_RESTART ();
+    }
+    if (i2c_regphase == I2C_REG_POINTER && !i2c_reg_turn ())
+        return;
+    if (i2c_datadir)
+        moved = i2c_read_packet ();
+    else
+        moved = i2c_write_packet ();
+    if (!i2c_datadir && !i2c_expected && i2c_pecmode && !i2c_pec_finish ())
+        return;
+    /* Writes also wait for the last bytes to leave the engine */
+    if (i2c_expected || i2c_zlp || i2c_pecmode ||
+        (!i2c_datadir && i2c_status_int == STATUS_RUNNING && bus_busy ())) {
+        if (moved)
+            PROFILE_END (i2c_datadir ? PROFILE_READ : PROFILE_WRITE, moved);
+        return;
+    }
+
+    /* Bring on RX or TX errors to the driver, if it asks */
+    // TODO: check if the driver could handle the other answers
+    if (i2c_status_int == STATUS_READ_FAILED ||
+        i2c_status_int == STATUS_WRITE_FAILED)
+        i2c_status = STATUS_ADDRESS_NAK;
+    if (i2c_pecfailed) {
+        i2c_status    = STATUS_PEC_FAILED;
+        i2c_pecfailed = 0;
     }
+    /* Send a STOP on the bus if requested */
+    if (i2c_stopafter)
+        i2c_stop ();
+    /* Handle acknowledge packet after everything is done */
+    if (!i2c_datadir)
+        Endpoint_ClearIN();
+    i2c_active = 0;
+    i2c_regphase = I2C_REG_NONE;
+    TRACE (TRACE_DONE, i2c_status, i2c_status_int, 0);
+    STATS_TIME (STATS_REQUEST, clock_ticks () - i2c_setup);
+    PROFILE_END (i2c_datadir ? PROFILE_READ : PROFILE_WRITE, moved);
 }
 
 int main (void) {
-    USB_Init ();
-#ifdef __IMU__DEBUG__
-    Serial_CreateStream (NULL);
-    Serial_Init (DEBUGSPEED, true);
-#endif
-    GlobalInterruptEnable ();
     /* Enable on-chip Pullups for I2C, see Datasheet Section 20.5.1 */
 // TODO: This doesn't go well with LUFA's multi-device support
     DDRD  &= 0x03;
     PORTD |= 0x03;
-    DPRINTF ("\033[2J\033[0;0HI2C-MEGA-USB " VERSION_STRING "\r\n");
+    clock_init ();
+    /* The saved settings are in place before the host sees the device */
+    config_init ();
+    USB_Init ();
+    GlobalInterruptEnable ();
+    script_init ();
+    TRACE (TRACE_BOOT, VERSION_MAJOR, VERSION_MINOR, VERSION_REVISION);
     for (;;) {
         USB_USBTask ();
+        twi_task ();
         i2c_task ();
+        script_task ();
+#if !defined(I2C_USB_LOWSPEED)
+        batch_task ();
+        alert_task ();
+        poll_task ();
+        stream_task ();
+        monitor_task ();
+        prog_task ();
+#endif
+    }
+}
+
+void EVENT_USB_Device_ConfigurationChanged (void) {
+    i2c_altsetting = INTERFACE_ALT_TINYUSB;
+#if !defined(I2C_USB_LOWSPEED)
+    Endpoint_ConfigureEndpoint (I2C_OUT_EPADDR, EP_TYPE_BULK, I2C_TXRX_EPSIZE, 1);
+    Endpoint_ConfigureEndpoint (I2C_IN_EPADDR,  EP_TYPE_BULK, I2C_TXRX_EPSIZE, 1);
+    Endpoint_ConfigureEndpoint (I2C_EVENT_EPADDR, EP_TYPE_INTERRUPT, I2C_EVENT_EPSIZE, 2);
+    Endpoint_ConfigureEndpoint (I2C_STREAM_EPADDR, EP_TYPE_BULK, I2C_STREAM_EPSIZE, 2);
+#endif
+}
+
+#if !defined(I2C_USB_LOWSPEED)
+static void i2c_reset_endpoint (const uint8_t address) {
+    Endpoint_ResetEndpoint (address);
+    Endpoint_SelectEndpoint (address);
+    Endpoint_ClearStall ();
+    Endpoint_ResetDataToggle ();
+    Endpoint_SelectEndpoint (ENDPOINT_CONTROLEP);
+}
+
+/* Switches between the control-only i2c-tiny-usb setting and the batch
+ * setting with the bulk endpoints. Requests not handled here are
+ * stalled by LUFA. */
+static void i2c_handle_interface_request (void) {
+    switch (USB_ControlRequest.bRequest) {
+    case REQ_SetInterface:
+        if (USB_ControlRequest.wValue > INTERFACE_ALT_BATCH)
+            break;
+        Endpoint_ClearSETUP ();
+        i2c_altsetting = USB_ControlRequest.wValue;
+        i2c_reset_endpoint (I2C_OUT_EPADDR);
+        i2c_reset_endpoint (I2C_IN_EPADDR);
+        i2c_reset_endpoint (I2C_EVENT_EPADDR);
+        i2c_reset_endpoint (I2C_STREAM_EPADDR);
+        Endpoint_ClearStatusStage ();
+        TRACE (TRACE_SET_INTERFACE, i2c_altsetting, 0, 0);
+        break;
+    case REQ_GetInterface:
+        Endpoint_ClearSETUP ();
+        Endpoint_Write_8 (i2c_altsetting);
+        Endpoint_ClearIN ();
+        break;
     }
 }
+#endif
 
 /* The driver sends Control Requests with USB_TYPE_VENDOR | USB_RECIP_INTERFACE
- * for use. The Direction signals read or write. */
+ * for use. The Direction signals read or write. Host tools may also send
+ * them to the device, which works while the kernel driver holds the
+ * interface. */
 #define REQMASK (CONTROL_REQTYPE_TYPE | CONTROL_REQTYPE_RECIPIENT)
 #define REQTARGET (REQTYPE_VENDOR | REQREC_INTERFACE)
+#define REQTARGET_DEVICE (REQTYPE_VENDOR | REQREC_DEVICE)
+
+/* Hands a request that needs the bus over to the main loop, which also
+ * finishes the control transfer. If the queue is full, the request is
+ * dropped and the driver sees an USB error. */
+static void i2c_queue_request (void) {
+    i2c_cmd_t req = {
+        .request = USB_ControlRequest.bRequest,
+        .value   = USB_ControlRequest.wValue,
+        .index   = USB_ControlRequest.wIndex,
+        .length  = USB_ControlRequest.wLength,
+        .ticks   = clock_ticks ()
+    };
 
-/* We handle everything but an IO Request directly in the Control Request
- * Event handler. Note that this is called from within an interrupt handler. */
+    if (!queue_put (&req)) {
+        TRACE (TRACE_QUEUE_FULL, req.request, 0, 0);
+        STATS_ADD (STATS_STALLS, 1);
+    }
+}
+
+/* We handle everything that doesn't touch the bus directly in the Control
+ * Request Event handler, the rest is queued for the main loop. Note that
+ * this is called from within an interrupt handler, so it must never wait
+ * for the bus. */
 void EVENT_USB_Device_ControlRequest (void) {
+    uint8_t target = USB_ControlRequest.bmRequestType & REQMASK;
+    PROFILE_START ();
+
     if ((USB_DeviceState == DEVICE_STATE_Configured) &&
-        ((USB_ControlRequest.bmRequestType & REQMASK) == REQTARGET)) {
+        (target == REQTARGET || target == REQTARGET_DEVICE)) {
         Endpoint_ClearSETUP ();
+        TRACE (TRACE_REQUEST, USB_ControlRequest.bRequest,
+               USB_ControlRequest.wIndex, USB_ControlRequest.wLength);
         /* bRequest is the actual command from the driver to the device */
         switch (USB_ControlRequest.bRequest) {
         case CMD_ECHO:
@@ -272,7 +913,6 @@ void EVENT_USB_Device_ControlRequest (void) {
              * held in wValue to be sent back  */
             Endpoint_Write_16_LE (USB_ControlRequest.wValue);
             Endpoint_ClearIN ();
-            DPRINTF ("EC\r\n");
             break;
         case CMD_GET_FUNC:
             /* GET_FUNC is a read requests that expects the
@@ -281,21 +921,102 @@ void EVENT_USB_Device_ControlRequest (void) {
              * linux kernel */
             Endpoint_Write_32_LE (supported_caps);
             Endpoint_ClearIN ();
-            DPRINTF ("GF\r\n");
             break;
         case CMD_SET_DELAY:
-            /* SET_DELAY is a write request with 0 byte length
-             * This will fail with an USB error if the value is invalid */
-            if (!i2c_set_delay (USB_ControlRequest.wValue))
+            /* SET_DELAY is a write request with 0 byte length. It
+             * reinitializes the TWI, so it is left to the main loop. */
+            i2c_queue_request ();
+            break;
+        case CMD_SET_FREQ:
+            /* SET_FREQ is the same with the clock in Hz, reading back
+             * the actual clock */
+            i2c_queue_request ();
+            break;
+        case CMD_SET_TIMEOUT:
+            /* SET_TIMEOUT is a write request with 0 byte length. The
+             * engine reads the timeout at every bus phase. */
+            if (USB_ControlRequest.wValue) {
+                twi_set_timeout (USB_ControlRequest.wValue);
+                swi_set_timeout (USB_ControlRequest.wValue);
                 Endpoint_ClearIN ();
-            DPRINTF ("SD\r\n");
+            } else {
+                Endpoint_StallTransaction ();
+                STATS_ADD (STATS_STALLS, 1);
+            }
+            break;
+#if !defined(I2C_USB_LOWSPEED)
+        case CMD_SET_POLL:
+            /* SET_POLL replaces the list of the poll engine, which
+             * runs from the main loop */
+            i2c_queue_request ();
+            break;
+        case CMD_SET_STREAM:
+            /* SET_STREAM arms or stops the streaming capture */
+            i2c_queue_request ();
+            break;
+        case CMD_PROGRAM:
+            /* PROGRAM takes over the bulk endpoints for an image */
+            i2c_queue_request ();
+            break;
+        case CMD_SET_ALERT:
+            /* SET_ALERT arms the alert engine, which runs from the main
+             * loop */
+            i2c_queue_request ();
+            break;
+        case CMD_SET_MONITOR:
+            /* SET_MONITOR takes the TWI off the bus */
+            i2c_queue_request ();
             break;
+#endif
         case CMD_GET_STATUS:
             /* GET_STATUS returns the result of the last I2C IO
              * transaction and expects one byte back */
-            Endpoint_Write_8 (i2c_status);
+            Endpoint_Write_8 (i2c_bus_status (USB_ControlRequest.wIndex >> 8));
             Endpoint_ClearIN ();
-            DPRINTF ("GS\r\n");
+            break;
+        case CMD_READ_REG:
+            /* READ_REG is a complete write, repeated START and read
+             * transaction on the bus */
+            i2c_queue_request ();
+            break;
+        case CMD_SCAN:
+            /* SCAN probes many addresses and returns a bitmap */
+            i2c_queue_request ();
+            break;
+        case CMD_SET_SCRIPT:
+            /* SET_SCRIPT may write the EEPROM, which takes long */
+            i2c_queue_request ();
+            break;
+        case CMD_RUN_SCRIPT:
+            /* RUN_SCRIPT answers once the script has ended */
+            i2c_queue_request ();
+            break;
+        case CMD_SET_SLAVE:
+            /* SET_SLAVE takes the TWI from the master engines */
+            i2c_queue_request ();
+            break;
+        case CMD_GET_SLAVE:
+            /* GET_SLAVE reads out and drops the change log */
+            slave_send (USB_ControlRequest.wLength, USB_ControlRequest.wValue);
+            break;
+        case CMD_SET_CONFIG:
+            /* SET_CONFIG writes the EEPROM, which takes long */
+            i2c_queue_request ();
+            break;
+        case CMD_GET_CONFIG:
+            /* GET_CONFIG reads the saved settings back */
+            config_send (USB_ControlRequest.wLength);
+            break;
+        case CMD_FANOUT:
+            /* FANOUT writes to many addresses on the bus */
+            i2c_queue_request ();
+            break;
+        case CMD_GET_FANOUT:
+            /* GET_FANOUT returns who took the last FANOUT */
+            Endpoint_Write_Control_Stream_LE (i2c_fanout_map,
+                USB_ControlRequest.wLength < sizeof (i2c_fanout_map) ?
+                USB_ControlRequest.wLength : sizeof (i2c_fanout_map));
+            Endpoint_ClearOUT ();
             break;
         case CMD_I2C_IO:
         case CMD_I2C_IO + CMD_I2C_IO_BEGIN:
@@ -305,18 +1026,45 @@ void EVENT_USB_Device_ControlRequest (void) {
              * signal if this is the start of a new transaction, the
              * transaction should end after this, or if this part of
              * ongoing set of transactions */
-            i2c_handle_io_request ();
+            i2c_queue_request ();
+            break;
+#if I2C_TRACE_EVENTS
+        case CMD_GET_TRACE:
+            /* GET_TRACE reads out and drops the oldest trace events */
+            trace_send (USB_ControlRequest.wLength);
             break;
+#endif
+#if I2C_PROFILE
+        case CMD_GET_PROFILE:
+            /* GET_PROFILE reads the cycle counters, wValue 1 also
+             * clears them */
+            profile_send (USB_ControlRequest.wLength,
+                          USB_ControlRequest.wValue & 1);
+            break;
+#endif
+#if I2C_STATS
+        case CMD_GET_STATS:
+            /* GET_STATS reads the counters and histograms, wValue 1
+             * also clears them */
+            stats_send (USB_ControlRequest.wLength,
+                        USB_ControlRequest.wValue & 1);
+            break;
+#endif
         default:
-            DPRINTF ("Invalid command received\r\n");
+            TRACE (TRACE_UNKNOWN, USB_ControlRequest.bmRequestType,
+                   USB_ControlRequest.bRequest, USB_ControlRequest.wValue);
+            STATS_ADD (STATS_STALLS, 1);
             break;
         }
+#if !defined(I2C_USB_LOWSPEED)
+    } else if ((USB_DeviceState == DEVICE_STATE_Configured) &&
+               ((USB_ControlRequest.bmRequestType & REQMASK) ==
+                (REQTYPE_STANDARD | REQREC_INTERFACE))) {
+        i2c_handle_interface_request ();
+#endif
     } else {
-        DPRINTF ("%02x %02x %04x %04x %04x\r\n",
-                 USB_ControlRequest.bmRequestType,
-                 USB_ControlRequest.bRequest,
-                 USB_ControlRequest.wValue,
-                 USB_ControlRequest.wIndex,
-                 USB_ControlRequest.wLength);
+        TRACE (TRACE_UNKNOWN, USB_ControlRequest.bmRequestType,
+               USB_ControlRequest.bRequest, USB_ControlRequest.wValue);
     }
+    PROFILE_END (PROFILE_CONTROL, 0);
 }
@@ -0,0 +1,341 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* i2cmegausb.h - i2c-mega-usb extensions to the i2c-tiny-usb protocol	     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __i2cmegausb_h_included__
+#define __i2cmegausb_h_included__
+
+#include <stdint.h>
+
+/* Batched transactions on the bulk endpoints of alternate setting 1.
+ *
+ * OUT: uint16_t length (LE) of the message list that follows, then per
+ *      message: uint8_t address, uint8_t flags, uint8_t length and, for
+ *      writes, length bytes of data.
+ * IN:  the data of all read messages in order, followed by one status
+ *      byte (STATUS_*) per message.
+ *
+ * Messages are run back to back with repeated STARTs in between, a STOP
+ * is sent after messages flagged with I2C_BATCH_STOP and after the last
+ * one. The first NAK aborts the batch: the remaining messages report
+ * STATUS_IDLE and their read data is filled with 0xff.
+ *
+ * A list without messages or with a read of 0 bytes stalls the OUT
+ * endpoint. A reply that fills its last packet is followed by a zero
+ * length packet, so the host may ask for more than it expects. */
+#define I2C_BATCH_RD            0x01    /* read message, same as I2C_M_RD */
+#define I2C_BATCH_STOP          0x02    /* STOP after this message */
+
+/* CMD_I2C_IO extensions in wValue, next to the kernel's I2C_M_* flags.
+ *
+ * I2C_M_RECV_LEN reads an SMBus block: the first byte read is the count
+ * of the data bytes that follow. wLength is the most the host takes,
+ * count byte included; the data stage returns the count byte and the
+ * data and is short if the block is. A count of 0 or one that does not
+ * fit fails the message with STATUS_READ_FAILED.
+ *
+ * I2C_IO_PEC on a message with data appends the SMBus PEC to a write or
+ * reads and checks it after a read, where it is not passed to the host.
+ * The PEC covers all messages since the one with CMD_I2C_IO_BEGIN. A
+ * wrong PEC shows as STATUS_PEC_FAILED in GET_STATUS. */
+#define I2C_IO_PEC              0x0100
+#define STATUS_PEC_FAILED       6
+
+/* Vendor requests beyond the i2c-tiny-usb set. CMD_I2C_IO uses 4 to 7. */
+#define CMD_GET_TRACE           16
+#define CMD_GET_PROFILE         17
+#define CMD_SET_FREQ            18
+#define CMD_SET_POLL            19
+#define CMD_READ_REG            20
+#define CMD_SET_STREAM          21
+#define CMD_GET_STATS           22
+#define CMD_SET_TIMEOUT         23
+#define CMD_SCAN                24
+#define CMD_SET_SCRIPT          25
+#define CMD_RUN_SCRIPT          26
+#define CMD_PROGRAM             27
+#define CMD_SET_ALERT           28
+#define CMD_SET_SLAVE           29
+#define CMD_GET_SLAVE           30
+#define CMD_SET_MONITOR         31
+#define CMD_SET_CONFIG          32
+#define CMD_GET_CONFIG          33
+#define CMD_FANOUT              34
+#define CMD_GET_FANOUT          35
+
+/* GET_TRACE reads wLength bytes at most: the number of events n and the
+ * number of events lost since the last read (saturating), then n events
+ * of 8 bytes each: uint32_t timestamp in CPU cycles (LE), event ID, three
+ * argument bytes. The events are removed from the device. A wLength
+ * below 2 is stalled. */
+
+/* GET_PROFILE (builds with PROFILE=1 only) reads wLength bytes at most of
+ * the cycle counters, per code path in profile.h: uint32_t calls, CPU
+ * cycles and data bytes (LE). wValue 1 clears them after reading. */
+
+/* GET_STATS (builds with STATS=1, the default) reads wLength bytes at
+ * most of the counters in stats.h as uint32_t (LE), then the histograms
+ * of bus time per transaction and of SETUP to completion per queued
+ * request, 16 uint32_t bins each (LE). Bin n counts times of 2^n to
+ * 2^(n+1) - 1 µs. wValue 1 clears everything after reading. */
+
+/* SET_FREQ sets the bus clock in Hz, wValue holds the low 16 bits, the
+ * low byte of wIndex bits 16 to 23 and its high byte the bus. The data
+ * stage returns the actual clock as uint32_t (LE), which is never above
+ * the requested one, or 0 if the clock is out of range (about 500 Hz to
+ * F_CPU / 16 on bus 0, 125 Hz to 50 kHz on bus 1). 10 kHz, 50 kHz,
+ * 100 kHz, 400 kHz and 1 MHz are exact on bus 0. */
+
+/* SET_TIMEOUT sets in wValue how many µs (1 to 65535, 2000 after reset)
+ * a bus phase may take beyond its nominal length at the current clock.
+ * A phase that takes longer, e.g. because a slave stretches the clock
+ * forever or holds SDA low, fails the message as an address NAK, write
+ * or read failure. The firmware then clocks SCL until the slave releases
+ * SDA, at most 9 times, and sends a STOP. */
+
+/* SET_POLL (alternate setting 1 only) replaces the poll list with the
+ * entries in its data stage, an empty list stops polling. Per entry:
+ * uint8_t address, uint8_t register, uint8_t length (1 to 8), uint8_t
+ * flags, uint16_t period in ms (LE). Up to 8 entries.
+ *
+ * Every sample is a record on the event endpoint: uint8_t entry index,
+ * uint8_t status (STATUS_*), uint8_t samples lost before it because the
+ * host did not pick them up (saturating), uint32_t timestamp in CPU
+ * cycles (LE), then length bytes of data, 0xff on failure. Several
+ * records may share a packet. */
+#define I2C_POLL_CHANGED        0x01    /* report only changed samples */
+#define I2C_POLL_NOREG          0x02    /* read without setting the register */
+
+/* SET_STREAM (alternate setting 1 only) arms a capture that reads the
+ * same register over and over: uint8_t address, uint8_t register,
+ * uint8_t length (1 to 61), uint8_t flags, uint16_t interval in µs (LE),
+ * 0 for back to back. An empty data stage stops it.
+ *
+ * The samples go to the stream endpoint (0x84), packed into packets of
+ * up to 64 bytes: uint8_t sequence number, uint8_t samples dropped
+ * before this packet because both endpoint banks were full (saturating),
+ * int8_t status, then whole samples. The status is STATUS_RUNNING while
+ * the capture runs. A failed sample stops it with a last packet that
+ * has no samples and the failure status. */
+#define I2C_STREAM_NOREG        0x02    /* read without setting the register */
+
+/* SCAN probes the addresses from the low to the high byte of wValue, or
+ * 0x03 to 0x77 like i2cdetect if wValue is 0, each with a zero length
+ * write, or with a one byte read if wIndex has I2C_SCAN_READ. The data
+ * stage returns a bitmap of 16 bytes, bit n % 8 of byte n / 8 set if
+ * address n acknowledged. The probes use a timeout of 100 µs. */
+#define I2C_SCAN_READ           0x01
+
+/* FANOUT writes the same payload to many slaves on bus 0, one message
+ * with a STOP per address, back to back in ascending order. Its data
+ * stage is a bitmap of 16 bytes with the addresses, laid out like the
+ * one of SCAN, followed by the payload of 1 to 32 bytes (16 with low
+ * speed USB). A data stage of another length is stalled.
+ *
+ * GET_FANOUT returns the bitmap of 16 bytes of the addresses of the last
+ * FANOUT that acknowledged the address and every byte of the payload. */
+
+/* PROGRAM (alternate setting 1 only) writes an image, which the host
+ * then sends to the bulk OUT endpoint, into a 24Cxx style EEPROM:
+ * uint8_t address, uint8_t flags, uint16_t page size (1 to 128, LE),
+ * uint32_t start address in the EEPROM (LE), uint32_t image length (LE).
+ * An empty data stage stops it. Address bits beyond the one or two
+ * address bytes go into the low bits of the slave address. EEPROMs with
+ * bigger pages can be written in halves or quarters.
+ *
+ * The firmware writes the image page by page and polls the EEPROM after
+ * each until it acknowledges, for up to 50 ms. Every page reports on the
+ * bulk IN endpoint with a record of 6 bytes: int8_t status, uint8_t polls
+ * of the page (saturating), uint32_t bytes written so far (LE). The
+ * status is STATUS_RUNNING while more pages follow; these records are
+ * dropped while both banks are full. The last record is always sent and
+ * has STATUS_ADDRESS_ACK, or the failure status and the bytes written
+ * before the page that failed. A failure also halts the OUT endpoint
+ * until the host clears it, and so does data past the image length.
+ * PROGRAM is stalled while a batch is under way, and no batch is taken
+ * from the bulk endpoints until the last record is sent. */
+#define I2C_PROG_ADDR16         0x01    /* two address bytes, MSB first */
+#define I2C_PROG_VERIFY         0x02    /* read every page back */
+#define STATUS_VERIFY_FAILED    9
+
+/* SET_ALERT (alternate setting 1 only) watches the SMBALERT# line of
+ * bus 0 if wValue is 1 and stops if it is 0. wIndex holds a status
+ * register in its low byte and the bytes to read from it (0 to 8, 0 for
+ * none) in its high byte. A line already low counts as an alert.
+ *
+ * An alert has the firmware read the Alert Response Address (0x0c) and
+ * then the status register of the slave that answered. It is reported
+ * on the event endpoint like a poll sample: uint8_t I2C_ALERT_RECORD,
+ * uint8_t status (STATUS_*), uint8_t records lost, uint32_t timestamp
+ * of the falling edge in CPU cycles (LE), uint8_t 7 bit address of the
+ * slave (0xff if none answered), then the bytes of the status register,
+ * 0xff on failure. While the line stays low after an answer the next
+ * slave is asked; a line that nobody answers for is reported once and
+ * then again after its next falling edge. */
+#define I2C_ALERT_RECORD        0x80    /* entry index of alert records */
+
+/* SET_SLAVE makes bus 0 a slave that answers at a 7 bit address from a
+ * register map in RAM, without the host. Its data stage: uint8_t
+ * address, uint8_t registers (1 to 64), the initial value of every
+ * register, then a write mask per register whose set bits the bus
+ * master may change. An empty data stage ends slave mode. With
+ * I2C_SLAVE_UPDATE in wValue the data stage is a register number and
+ * new values for the registers from there on, which the bus master
+ * sees at once.
+ *
+ * The first byte the master writes selects a register, every further
+ * one is written through the mask to the next register. A register
+ * number beyond the map is acknowledged, as the TWI has sent the ACK
+ * before it sees the byte, but leaves the selected register as it was;
+ * the byte after it is NAKed and the rest of the message is ignored.
+ * Reads return the registers from the
+ * selected one on. The register number wraps at the end of the map.
+ * While slave mode is on, master messages on bus 0 fail; bus 1 still
+ * works, so the host can drive the slave itself through it.
+ *
+ * GET_SLAVE returns the change log: uint8_t n, uint8_t entries lost
+ * since the last read because the log (64 entries) was full (saturating),
+ * then n entries of uint8_t register, uint8_t byte the master wrote, in
+ * order. The entries are removed. With I2C_SLAVE_REGS in wValue it
+ * returns the registers instead. */
+#define I2C_SLAVE_UPDATE        0x01    /* SET_SLAVE wValue */
+#define I2C_SLAVE_REGS          0x01    /* GET_SLAVE wValue */
+
+/* SET_MONITOR (alternate setting 1 only) starts watching bus 0 without
+ * taking part if wValue is 1 and stops if it is 0. Meanwhile the TWI is
+ * off and master messages on bus 0 fail; it can't be started while the
+ * streaming capture or slave mode runs, nor they while it runs. It
+ * keeps up with buses up to 100 kHz.
+ *
+ * The stream endpoint (0x84) carries the bus events as a byte stream of
+ * tokens, which may cross packets. The first byte of a token has the
+ * event (I2C_MON_*) in bits 7..5, in bit 4 a flag that more of the
+ * delta follows and in bits 3..0 the low 4 bits of the delta, the time
+ * since the previous token in µs (since SET_MONITOR for the first one).
+ * The rest of the delta follows in bytes of 7 bits each, least
+ * significant first, bit 7 set in all but the last. I2C_MON_ACK and
+ * I2C_MON_NAK end with the byte, I2C_MON_LOST with the number of events
+ * dropped before the next one because the host did not pick them up
+ * within 3 ms (saturating). Bits of a byte cut short by a START or STOP are
+ * dropped. After the stop a short packet, possibly empty, ends the
+ * stream. */
+#define I2C_MON_START           0       /* START after a STOP */
+#define I2C_MON_RESTART         1       /* repeated START */
+#define I2C_MON_STOP            2
+#define I2C_MON_ACK             3       /* byte, acknowledged */
+#define I2C_MON_NAK             4       /* byte, not acknowledged */
+#define I2C_MON_LOST            5       /* events dropped */
+
+/* SET_CONFIG saves settings to the EEPROM that the firmware applies at
+ * power-on, before it connects to USB: uint32_t clock of bus 0 in Hz
+ * (LE), uint32_t clock of bus 1 in Hz (LE), uint16_t timeout in µs (LE),
+ * uint8_t flags. A clock of 0 leaves its bus unconfigured until the host
+ * sets one, as without saved settings; a timeout of 0 keeps the default.
+ * Clocks out of range and unknown flags are stalled. An empty data stage
+ * deletes the settings. They take effect at the next power-on only.
+ *
+ * GET_CONFIG returns the saved settings in the same format, nothing if
+ * there are none. */
+#define I2C_CONFIG_NOPULLUPS    0x01    /* internal pull-ups of bus 0 off */
+
+/* SET_SCRIPT replaces the script with the up to 128 bytes of its data
+ * stage, an empty one deletes it. With I2C_SCRIPT_SAVE in wValue the
+ * script also goes to the EEPROM, from where it is loaded at power-on;
+ * that takes up to 3.4 ms per changed byte. A script that does not pass
+ * the checks below is stalled and leaves no script.
+ *
+ * RUN_SCRIPT runs the script on bus 0 and returns in its data stage,
+ * once the script has ended, the status (STATUS_ADDRESS_ACK if it ran to
+ * the end), the offset of the op it ended at and the data of all reads,
+ * at most wLength - 2 bytes. The host's control timeout has to cover the
+ * delays and polls of the script.
+ *
+ * A script is a list of ops, each an op code followed by its operands.
+ * An address byte holds the 7 bit address and I2C_SCRIPT_NOSTOP, which
+ * keeps the bus for a repeated START instead of ending the message with
+ * a STOP.
+ *
+ *   END                                ends the script
+ *   WRITE  addr, len, len bytes        writes the bytes (none is a probe)
+ *   READ   addr, len                   reads 1 to 128 bytes into the reply
+ *   DELAY  uint16_t ms (LE)            waits
+ *   POLL   addr, reg, mask, value,     reads the register until its value
+ *          tries, period in ms           AND mask equals value, at most
+ *                                        tries times; a NAK is a miss
+ *   LOOP   count                       runs the ops up to the matching
+ *                                        NEXT count times, nested 4 deep
+ *   NEXT
+ *   JNAK   offset                      see below
+ *
+ * A failed message or a POLL that runs out of tries ends the script with
+ * its status, unless a JNAK follows the op. The script then continues at
+ * the JNAK's offset, which must lie ahead in the same loop, its NEXT
+ * included, or at the end of the script. After an op that did not fail
+ * JNAK does nothing. The data of a failed READ is 0xff. As loops are
+ * bounded and jumps only go forward, every script ends. */
+#define I2C_SCRIPT_END          0x00
+#define I2C_SCRIPT_WRITE        0x01
+#define I2C_SCRIPT_READ         0x02
+#define I2C_SCRIPT_DELAY        0x03
+#define I2C_SCRIPT_POLL         0x04
+#define I2C_SCRIPT_LOOP         0x05
+#define I2C_SCRIPT_NEXT         0x06
+#define I2C_SCRIPT_JNAK         0x07
+#define I2C_SCRIPT_NOSTOP       0x80    /* in an address byte */
+#define I2C_SCRIPT_SAVE         0x01    /* SET_SCRIPT wValue */
+#define STATUS_POLL_FAILED      7       /* POLL ran out of tries */
+#define STATUS_SCRIPT_OVERFLOW  8       /* reads beyond wLength */
+
+/* READ_REG reads a register in one control transfer: START, write of the
+ * register number, repeated START, read of wLength - 1 bytes, STOP.
+ * wValue holds the 7 bit address in the low byte and the size of the
+ * register number (1 or 2 bytes, sent MSB first) in the high byte,
+ * wIndex the register number. The data stage returns the data followed
+ * by one status byte: STATUS_ADDRESS_ACK on success, STATUS_ADDRESS_NAK,
+ * STATUS_WRITE_FAILED or STATUS_READ_FAILED. Data bytes not read are
+ * 0xff. GET_STATUS reports the transaction as usual. */
+
+/* Buses. CMD_I2C_IO, CMD_GET_STATUS, CMD_SET_DELAY and CMD_SET_FREQ
+ * select one with the high byte of wIndex, which stock hosts leave 0.
+ * Each bus has its own clock and status. Bus 1 is a software master on
+ * PB6 (SCL) and PB5 (SDA) that runs at up to 50 kHz; faster clocks are
+ * cut down to that. Its requests don't wait for the batch, poll and
+ * stream engines, which all run on bus 0, so both buses can be busy at
+ * the same time. Everything else runs on bus 0, and SET_TIMEOUT sets
+ * the timeout of both. */
+#define I2C_BUS_TWI             0
+#define I2C_BUS_SWI             1
+#define I2C_BUSES               2
+
+/* Firmware internals shared between the modules */
+extern volatile int8_t i2c_status;
+extern volatile int8_t i2c_status_int;
+extern volatile uint8_t i2c_active;
+extern volatile uint8_t i2c_altsetting;
+extern uint32_t        i2c_freq;
+
+uint8_t  i2c_bus_free (void);
+int8_t   i2c_bus_status (const uint8_t bus);
+uint32_t i2c_bus_clock (const uint8_t bus, const uint32_t freq);
+uint8_t  i2c_clock_valid (const uint8_t bus, const uint32_t freq);
+
+#endif
@@ -0,0 +1,314 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* monitor.c - passive bus monitor					     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Watches bus 0 without taking part, to capture the traffic of another
+ * master. The TWI lets go of the pins and two external interrupts follow
+ * the lines: INT0 on every rising edge of SCL (PD0) samples a bit, INT1
+ * on every change of SDA (PD1) catches a START or a STOP while SCL is
+ * high. The interrupts put the events with the clock into a ring, the main loop turns them into tokens of two or three
+ * bytes for the stream endpoint: the event, the time since the one
+ * before it in µs, varint coded so that idle time of any length takes a
+ * few bytes, and the data byte.
+ *
+ * Every bit costs up to two interrupts, which keeps up with 100 kHz; on
+ * faster buses a START may be over before INT1 looks at SCL. An event
+ * that finds the ring full is dropped and counted, the count goes into
+ * the ring ahead of the next event that fits. Tokens the host does not
+ * pick up leave the events in the ring, and events older than 3 ms are
+ * dropped and counted from there. The timestamps have all 32 bits of
+ * the clock, so an event that waited over a wrap of TCNT1 still tells
+ * its time. */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "Config/AppConfig.h"
+#include "Descriptors.h"
+
+#include "i2ctinyusb.h"
+#include "i2cmegausb.h"
+#include "clock.h"
+#include "monitor.h"
+#include "stats.h"
+#include "stream.h"
+#include "trace.h"
+#include "twi.h"
+
+#if !defined(I2C_USB_LOWSPEED)
+
+#if (I2C_MONITOR_EVENTS & (I2C_MONITOR_EVENTS - 1)) || I2C_MONITOR_EVENTS > 128
+#error I2C_MONITOR_EVENTS must be a power of two up to 128
+#endif
+
+/* Bus pins, fixed by the TWI */
+#define MONITOR_SCL         _BV(PD0)
+#define MONITOR_SDA         _BV(PD1)
+
+#define MONITOR_NOSTART     0xff    /* monitor_bits before the first START */
+#define MONITOR_TOKEN       7       /* longest token */
+#define MONITOR_MAXAGE      (3000 * CLOCK_TICKS_PER_US)
+
+enum {
+    MONITOR_OFF,        /* not armed */
+    MONITOR_RUN,        /* following the bus */
+    MONITOR_END         /* stopped, last packet pending */
+};
+
+typedef struct {
+    uint32_t ticks;     /* clock_ticks () */
+    uint8_t  event;     /* I2C_MON_* */
+    uint8_t  data;
+} monitor_event_t;
+
+static monitor_event_t  monitor_ring[I2C_MONITOR_EVENTS];
+static volatile uint8_t monitor_head;
+static volatile uint8_t monitor_tail;
+static uint8_t          monitor_lost;   /* events dropped, not yet in the ring */
+static uint8_t          monitor_stale;  /* events dropped by the main loop */
+static uint8_t          monitor_bits;   /* bits of the byte on the bus so far */
+static uint8_t          monitor_shift;
+static uint8_t          monitor_state;
+static uint32_t         monitor_last;   /* time of the last token */
+static uint32_t         monitor_first;  /* time of the first byte in the bank */
+static uint8_t          monitor_inbytes;    /* bytes in the current IN bank */
+static uint8_t          monitor_out[MONITOR_TOKEN];     /* token being sent */
+static uint8_t          monitor_outlen;
+static uint8_t          monitor_outpos;
+
+/* Called from the interrupts only */
+static inline void monitor_put (uint8_t head, const uint8_t event,
+                                const uint8_t data) {
+    monitor_event_t *e = &monitor_ring[head & (I2C_MONITOR_EVENTS - 1)];
+
+    e->ticks = clock_ticks ();
+    e->event = event;
+    e->data  = data;
+}
+
+static inline void monitor_push (const uint8_t event, const uint8_t data) {
+    uint8_t head = monitor_head;
+
+    if (monitor_lost) {
+        if ((uint8_t)(head - monitor_tail) == I2C_MONITOR_EVENTS) {
+            if (monitor_lost != 0xff)
+                monitor_lost++;
+            return;
+        }
+        monitor_put (head++, I2C_MON_LOST, monitor_lost);
+        monitor_lost = 0;
+    }
+    if ((uint8_t)(head - monitor_tail) == I2C_MONITOR_EVENTS)
+        monitor_lost = 1;
+    else
+        monitor_put (head++, event, data);
+    monitor_head = head;
+}
+
+/* SCL rose, SDA holds a data bit or, after eight of them, the ACK */
+ISR (INT0_vect) {
+    uint8_t sda = PIND & MONITOR_SDA;
+
+    if (monitor_bits < 8) {
+        monitor_shift = (monitor_shift << 1) | (sda ? 1 : 0);
+        monitor_bits++;
+    } else if (monitor_bits == 8) {
+        monitor_push (sda ? I2C_MON_NAK : I2C_MON_ACK, monitor_shift);
+        monitor_bits = 0;
+    }
+}
+
+/* SDA changed, a START or STOP if SCL is high. Bits of a byte cut short
+ * are dropped. */
+ISR (INT1_vect) {
+    uint8_t pins = PIND;
+
+    if (!(pins & MONITOR_SCL))
+        return;
+    if (pins & MONITOR_SDA) {
+        monitor_push (I2C_MON_STOP, 0);
+        monitor_bits = MONITOR_NOSTART;
+    } else {
+        monitor_push (monitor_bits == MONITOR_NOSTART ? I2C_MON_START :
+                                                        I2C_MON_RESTART, 0);
+        monitor_bits = 0;
+    }
+}
+
+uint8_t monitor_armed (void) {
+    return monitor_state != MONITOR_OFF;
+}
+
+/* Stops following the lines and gives them back to the TWI */
+static void monitor_release (void) {
+    EIMSK &= ~(_BV(INT0) | _BV(INT1));
+    twi_release (0);
+}
+
+/* Starts or stops the monitor. The request is run from the main loop,
+ * so the TWI is idle. */
+void monitor_set (const i2c_cmd_t *req) {
+    if (i2c_altsetting != INTERFACE_ALT_BATCH || req->value > 1 ||
+        (req->value && monitor_state == MONITOR_END) ||
+        (req->value && monitor_state == MONITOR_OFF &&
+         (stream_armed () || !twi_master () || !i2c_bus_free ()))) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    if (req->value && monitor_state == MONITOR_OFF) {
+        monitor_head    = 0;
+        monitor_tail    = 0;
+        monitor_lost    = 0;
+        monitor_stale   = 0;
+        monitor_bits    = MONITOR_NOSTART;
+        monitor_inbytes = 0;
+        monitor_outlen  = 0;
+        monitor_outpos  = 0;
+        monitor_last    = clock_ticks ();
+        monitor_state   = MONITOR_RUN;
+        twi_release (1);
+        /* Rising edges of SCL, both edges of SDA */
+        EICRA = (EICRA & ~(_BV(ISC01) | _BV(ISC00) | _BV(ISC11) | _BV(ISC10))) |
+                _BV(ISC01) | _BV(ISC00) | _BV(ISC10);
+        EIFR  = _BV(INTF0) | _BV(INTF1);
+        EIMSK |= _BV(INT0) | _BV(INT1);
+        TRACE (TRACE_MONITOR, 1, 0, 0);
+    } else if (!req->value && monitor_state == MONITOR_RUN) {
+        monitor_release ();
+        monitor_state = MONITOR_END;
+    }
+    Endpoint_ClearIN ();
+}
+
+/* Codes an event as a token in monitor_out: event, more flag and the
+ * low 4 bits of the delta in µs, the rest of the delta 7 bits per byte,
+ * then the data byte if the event has one */
+static void monitor_token (const monitor_event_t *e, uint32_t delta) {
+    uint8_t n = 1;
+
+    monitor_out[0] = (e->event << 5) | (delta & 0x0f);
+    delta >>= 4;
+    if (delta) {
+        monitor_out[0] |= 0x10;
+        do {
+            monitor_out[n] = delta & 0x7f;
+            delta >>= 7;
+            if (delta)
+                monitor_out[n] |= 0x80;
+            n++;
+        } while (delta);
+    }
+    if (e->event >= I2C_MON_ACK)
+        monitor_out[n++] = e->data;
+    monitor_outlen = n;
+    monitor_outpos = 0;
+}
+
+/* Drops the events that waited too long for the endpoint */
+static void monitor_expire (const uint8_t head, const uint32_t now) {
+    monitor_event_t *e;
+    uint8_t n;
+
+    while (monitor_tail != head) {
+        e = &monitor_ring[monitor_tail & (I2C_MONITOR_EVENTS - 1)];
+        if (now - e->ticks < MONITOR_MAXAGE)
+            break;
+        n = e->event == I2C_MON_LOST ? e->data : 1;
+        monitor_stale = n > 0xff - monitor_stale ? 0xff : monitor_stale + n;
+        monitor_tail++;
+    }
+}
+
+/* Called from the main loop, packs the events into the stream endpoint
+ * as far as its banks allow */
+void monitor_task (void) {
+    monitor_event_t e;
+    uint32_t now, at;
+    uint8_t head;
+
+    if (i2c_altsetting != INTERFACE_ALT_BATCH) {
+        /* The stream endpoint is gone, the host arms a new capture */
+        if (monitor_state == MONITOR_RUN)
+            monitor_release ();
+        monitor_state = MONITOR_OFF;
+        return;
+    }
+    if (monitor_state == MONITOR_OFF)
+        return;
+
+    /* Every event up to head is older than now */
+    head = monitor_head;
+    now  = clock_ticks ();
+    monitor_expire (head, now);
+    Endpoint_SelectEndpoint (I2C_STREAM_EPADDR);
+    for (;;) {
+        /* The rest of the last token goes first, across packets */
+        while (monitor_outpos < monitor_outlen) {
+            if (!Endpoint_IsINReady ())
+                return;
+            if (!monitor_inbytes)
+                monitor_first = now;
+            Endpoint_Write_8 (monitor_out[monitor_outpos++]);
+            if (++monitor_inbytes == I2C_STREAM_EPSIZE) {
+                Endpoint_ClearIN ();
+                monitor_inbytes = 0;
+            }
+        }
+        if (monitor_stale) {
+            /* Reported at the time of the last token */
+            e.event = I2C_MON_LOST;
+            e.data  = monitor_stale;
+            monitor_stale = 0;
+            monitor_token (&e, 0);
+            continue;
+        }
+        if (monitor_tail == head)
+            break;
+        e = monitor_ring[monitor_tail & (I2C_MONITOR_EVENTS - 1)];
+        monitor_tail++;
+        /* The remainder below 1 µs is kept for the next delta */
+        at = e.ticks;
+        if ((int32_t)(at - monitor_last) < 0)
+            at = monitor_last;
+        at = (at - monitor_last) / CLOCK_TICKS_PER_US;
+        monitor_last += at * CLOCK_TICKS_PER_US;
+        monitor_token (&e, at);
+    }
+
+    if (monitor_state == MONITOR_END) {
+        /* A short packet, maybe empty, ends the capture */
+        if (!Endpoint_IsINReady ())
+            return;
+        Endpoint_ClearIN ();
+        monitor_inbytes = 0;
+        monitor_state   = MONITOR_OFF;
+        TRACE (TRACE_MONITOR, 0, 0, 0);
+    } else if (monitor_inbytes &&
+               now - monitor_first >= I2C_STREAM_FLUSH_US * CLOCK_TICKS_PER_US) {
+        /* Tokens don't wait in a bank for long on a quiet bus */
+        Endpoint_ClearIN ();
+        monitor_inbytes = 0;
+    }
+}
+
+#endif
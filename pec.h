@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* pec.h - SMBus packet error code					     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __pec_h_included__
+#define __pec_h_included__
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+extern const uint8_t pec_table[256] PROGMEM;
+
+/* Adds a byte to the CRC-8, one flash read per byte */
+static inline uint8_t pec_update (const uint8_t crc, const uint8_t data) {
+    return pgm_read_byte (&pec_table[crc ^ data]);
+}
+
+#endif
@@ -0,0 +1,270 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* poll.c - autonomous register polling					     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Reads a list of registers at fixed periods without the host asking.
+ * The list comes in with CMD_SET_POLL, the samples go out on the event
+ * endpoint. The periods are kept in Timer1 clock ticks and the next
+ * deadline is advanced by exactly one period, so the samples don't
+ * drift with the main loop latency. Only one poll transaction is on the
+ * bus at a time, between i2c-tiny-usb transactions and batches. The
+ * event endpoint is shared with the SMBus alert records of alert.c,
+ * which go through poll_record (). */
+
+#include <string.h>
+
+#include "Config/AppConfig.h"
+#include "Descriptors.h"
+
+#include "i2ctinyusb.h"
+#include "i2cmegausb.h"
+#include "clock.h"
+#include "poll.h"
+#include "stats.h"
+#include "trace.h"
+#include "twi.h"
+
+#if !defined(I2C_USB_LOWSPEED)
+
+#define POLL_ENTRY_SIZE     6       /* bytes per entry in CMD_SET_POLL */
+#define POLL_RECORD_SIZE    7       /* sample header on the event endpoint */
+
+enum {
+    POLL_OFF,           /* no list */
+    POLL_WAIT,          /* waiting for the next deadline */
+    POLL_REGISTER,      /* writing the register number */
+    POLL_READ           /* reading the sample */
+};
+
+typedef struct {
+    uint8_t  addr;
+    uint8_t  reg;
+    uint8_t  len;
+    uint8_t  flags;
+    uint32_t period;            /* in clock ticks */
+    uint32_t due;               /* next deadline */
+    uint8_t  status;            /* status of the last sample */
+    uint8_t  last[I2C_POLL_MAXLEN];
+} poll_entry_t;
+
+static poll_entry_t poll_list[I2C_POLL_ENTRIES];
+static uint8_t  poll_count;     /* entries in the list */
+static uint8_t  poll_state;
+static uint8_t  poll_cur;       /* entry being sampled */
+static uint8_t  poll_pos;       /* bytes read of the sample */
+static uint8_t  poll_data[I2C_POLL_MAXLEN];
+static uint32_t poll_ticks;     /* time of the sample */
+static uint8_t  poll_lost;      /* records dropped since the last one */
+static uint8_t  poll_inbytes;   /* bytes in the current IN bank */
+
+/* A poll transaction owns the bus from its START to its STOP */
+uint8_t poll_busy (void) {
+    return poll_state > POLL_WAIT;
+}
+
+static void poll_stop (void) {
+    if (poll_busy ()) {
+        if (twi_busy ())
+            twi_abort ();
+        else
+            twi_stop ();
+    }
+    poll_state = poll_count ? POLL_WAIT : POLL_OFF;
+}
+
+/* Sends the records collected so far */
+void poll_flush (void) {
+    if (!poll_inbytes)
+        return;
+    Endpoint_SelectEndpoint (I2C_EVENT_EPADDR);
+    Endpoint_ClearIN ();
+    poll_inbytes = 0;
+}
+
+/* Takes a new list from the data stage of CMD_SET_POLL. The request is
+ * run from the main loop, so no poll transaction is open. */
+void poll_set (const i2c_cmd_t *req) {
+    uint8_t buf[I2C_POLL_ENTRIES * POLL_ENTRY_SIZE];
+    uint8_t *p = buf;
+    poll_entry_t *e;
+    uint32_t now;
+    uint8_t i;
+
+    if (i2c_altsetting != INTERFACE_ALT_BATCH ||
+        req->length > sizeof (buf) || req->length % POLL_ENTRY_SIZE) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    Endpoint_SetEndpointDirection (ENDPOINT_DIR_OUT);
+    if (req->length && Endpoint_Read_Control_Stream_LE (buf, req->length))
+        return;
+    for (i = 0; i < req->length / POLL_ENTRY_SIZE; i++, p += POLL_ENTRY_SIZE) {
+        if (p[0] > 0x7f || !p[2] || p[2] > I2C_POLL_MAXLEN ||
+            !(p[4] | p[5])) {
+            Endpoint_StallTransaction ();
+            STATS_ADD (STATS_STALLS, 1);
+            return;
+        }
+    }
+
+    poll_count = req->length / POLL_ENTRY_SIZE;
+    now = clock_ticks ();
+    for (i = 0, p = buf; i < poll_count; i++, p += POLL_ENTRY_SIZE) {
+        e = &poll_list[i];
+        e->addr   = p[0];
+        e->reg    = p[1];
+        e->len    = p[2];
+        e->flags  = p[3];
+        e->period = (uint16_t)(p[4] | (p[5] << 8)) * (F_CPU / 1000UL);
+        e->due    = now;
+        /* Makes the first sample of every entry count as a change */
+        e->status = 0xff;
+    }
+    poll_cur   = 0;
+    poll_lost  = 0;
+    poll_state = poll_count ? POLL_WAIT : POLL_OFF;
+    TRACE (TRACE_POLL, poll_count, 0, 0);
+    poll_flush ();
+    Endpoint_SelectEndpoint (ENDPOINT_CONTROLEP);
+    Endpoint_ClearIN ();
+}
+
+/* Queues a record on the event endpoint: entry index, status, records
+ * lost before this one, uint32_t timestamp (LE) and the data. Without
+ * room on the event endpoint the record is dropped and counted. */
+void poll_record (const uint8_t index, const uint8_t status,
+                  const uint32_t ticks, const uint8_t *data,
+                  const uint8_t len) {
+    uint8_t i;
+
+    if (poll_inbytes + POLL_RECORD_SIZE + len > I2C_EVENT_EPSIZE)
+        poll_flush ();
+    Endpoint_SelectEndpoint (I2C_EVENT_EPADDR);
+    if (!Endpoint_IsINReady ()) {
+        if (poll_lost != 0xff)
+            poll_lost++;
+        return;
+    }
+    Endpoint_Write_8 (index);
+    Endpoint_Write_8 (status);
+    Endpoint_Write_8 (poll_lost);
+    Endpoint_Write_32_LE (ticks);
+    for (i = 0; i < len; i++)
+        Endpoint_Write_8 (data[i]);
+    poll_inbytes += POLL_RECORD_SIZE + len;
+    poll_lost = 0;
+}
+
+/* Ends the poll transaction and reports the sample */
+static void poll_done (const uint8_t status) {
+    poll_entry_t *e = &poll_list[poll_cur];
+
+    poll_stop ();
+    if (status != STATUS_ADDRESS_ACK)
+        memset (poll_data, 0xff, e->len);
+    if ((e->flags & I2C_POLL_CHANGED) && status == e->status &&
+        !memcmp (poll_data, e->last, e->len))
+        return;
+    e->status = status;
+    memcpy (e->last, poll_data, e->len);
+    poll_record (poll_cur, status, poll_ticks, poll_data, e->len);
+}
+
+/* Starts the entry whose deadline passed first after the current one */
+static void poll_start (void) {
+    poll_entry_t *e;
+    uint32_t now = clock_ticks ();
+    uint8_t i, n = poll_cur;
+
+    for (i = 0; i < poll_count; i++) {
+        if (++n == poll_count)
+            n = 0;
+        e = &poll_list[n];
+        if ((int32_t)(now - e->due) < 0)
+            continue;
+        /* Next deadline one period later, unless that has passed too */
+        e->due += e->period;
+        if ((int32_t)(now - e->due) >= 0)
+            e->due = now + e->period;
+        poll_cur   = n;
+        poll_pos   = 0;
+        poll_ticks = now;
+        if (e->flags & I2C_POLL_NOREG) {
+            twi_start ((e->addr << 1) | 1, e->len);
+            poll_state = POLL_READ;
+        } else {
+            twi_start (e->addr << 1, 1);
+            twi_put (e->reg);
+            poll_state = POLL_REGISTER;
+        }
+        return;
+    }
+    /* Nothing due, send what is there */
+    poll_flush ();
+}
+
+/* Called from the main loop, advances the poll engine as far as the
+ * bus allows */
+void poll_task (void) {
+    poll_entry_t *e = &poll_list[poll_cur];
+
+    if (i2c_altsetting != INTERFACE_ALT_BATCH) {
+        /* The event endpoint is gone, the host sets a new list */
+        if (poll_state != POLL_OFF) {
+            poll_count = 0;
+            poll_stop ();
+        }
+        poll_inbytes = 0;
+        return;
+    }
+    switch (poll_state) {
+    case POLL_WAIT:
+        if (i2c_bus_free ())
+            poll_start ();
+        break;
+    case POLL_REGISTER:
+        if (twi_busy ())
+            break;
+        if (twi_failed ()) {
+            poll_done (twi_state == TWI_ADDR_NAK ? STATUS_ADDRESS_NAK
+                                                 : STATUS_WRITE_FAILED);
+            break;
+        }
+        /* Repeated START */
+        twi_start ((e->addr << 1) | 1, e->len);
+        poll_state = POLL_READ;
+        break;
+    case POLL_READ:
+        while (poll_pos < e->len && twi_get (&poll_data[poll_pos]))
+            poll_pos++;
+        if (poll_pos == e->len) {
+            poll_done (STATUS_ADDRESS_ACK);
+        } else if (twi_failed ()) {
+            poll_done (twi_state == TWI_ADDR_NAK ? STATUS_ADDRESS_NAK
+                                                 : STATUS_READ_FAILED);
+        }
+        break;
+    }
+}
+
+#endif
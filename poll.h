@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* poll.h - autonomous register polling					     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __poll_h_included__
+#define __poll_h_included__
+
+#include <stdint.h>
+
+#include "queue.h"
+
+uint8_t poll_busy (void);
+void    poll_set (const i2c_cmd_t *req);
+void    poll_task (void);
+void    poll_record (const uint8_t index, const uint8_t status,
+                     const uint32_t ticks, const uint8_t *data,
+                     const uint8_t len);
+void    poll_flush (void);
+
+#endif
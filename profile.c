@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* profile.c - CPU cycle counters for benchmarking			     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Counts calls, CPU cycles and data bytes per code path, measured with
+ * the Timer1 clock, which runs at the CPU clock. The counters only exist
+ * in builds with make PROFILE=1, as the measurement itself costs a few
+ * dozen cycles per section. CMD_GET_PROFILE reads them out and
+ * tools/i2cmega-bench.py turns them into cycles per transaction. */
+
+#include <string.h>
+#include <util/atomic.h>
+
+#include "Config/AppConfig.h"
+#include "Descriptors.h"
+
+#include "profile.h"
+
+#if I2C_PROFILE
+
+typedef struct {
+    uint32_t count;
+    uint32_t cycles;
+    uint32_t bytes;
+} profile_slot_t;
+
+static profile_slot_t profile_slots[PROFILE_SLOTS];
+
+void profile_add (const uint8_t slot, const uint16_t cycles,
+                  const uint8_t bytes) {
+    profile_slot_t *p = &profile_slots[slot];
+
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        p->count++;
+        p->cycles += cycles;
+        p->bytes  += bytes;
+    }
+}
+
+/* Sends the counters in the data stage of CMD_GET_PROFILE. LUFA runs
+ * the control request handler with interrupts on, so the counters are
+ * copied, and cleared, in one go and the copy is sent. */
+void profile_send (const uint16_t length, const uint8_t reset) {
+    profile_slot_t slots[PROFILE_SLOTS];
+    uint16_t len = sizeof (slots);
+
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        memcpy (slots, profile_slots, sizeof (slots));
+        if (reset)
+            memset (profile_slots, 0, sizeof (profile_slots));
+    }
+    if (len > length)
+        len = length;
+    Endpoint_Write_Control_Stream_LE (slots, len);
+    Endpoint_ClearOUT ();
+}
+
+#endif
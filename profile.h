@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* profile.h - CPU cycle counters for benchmarking			     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __profile_h_included__
+#define __profile_h_included__
+
+#include <stdint.h>
+
+#include "Config/AppConfig.h"
+#include "clock.h"
+
+/* Code paths with their own counters. CMD_GET_PROFILE returns them in
+ * this order; tools/i2cmega-bench.py has the same list. */
+enum {
+    PROFILE_CONTROL,        /* control request interrupt */
+    PROFILE_EXECUTE,        /* queued request up to the data stage */
+    PROFILE_READ,           /* read data stage, per call moving data */
+    PROFILE_WRITE,          /* write data stage, per call moving data */
+    PROFILE_TWI,            /* TWI interrupt */
+    PROFILE_SLOTS
+};
+
+#if I2C_PROFILE
+void profile_add (const uint8_t slot, const uint16_t cycles,
+                  const uint8_t bytes);
+void profile_send (const uint16_t length, const uint8_t reset);
+
+/* PROFILE_START () opens a measured section in a function, PROFILE_END ()
+ * adds the cycles since then to a slot, PROFILE_RESTART () starts over */
+#define PROFILE_START()         uint16_t profile_start = clock_ticks16 ()
+#define PROFILE_RESTART()       profile_start = clock_ticks16 ()
+#define PROFILE_END(slot, bytes) \
+    profile_add (slot, clock_ticks16 () - profile_start, bytes)
+#else
+#define PROFILE_START()
+#define PROFILE_RESTART()
+#define PROFILE_END(slot, bytes) ((void)(bytes))
+#endif
+
+#endif
@@ -0,0 +1,340 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* prog.c - EEPROM programming over the bulk endpoints			     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Writes an image that the host streams to the bulk OUT endpoint into a
+ * 24Cxx style EEPROM. The image is split at the page boundaries of the
+ * EEPROM; each page is collected from the endpoint, written, and then
+ * the EEPROM is polled with its address until it acknowledges again,
+ * which ends its write cycle. With verification the poll is the write
+ * of the page's address and the page is read back right after. A record
+ * on the bulk IN endpoint reports every page and the end. A page takes
+ * the bus from its write to the end of its poll or read back, the bus is
+ * free for others while the next page comes in. */
+
+#include "Config/AppConfig.h"
+#include "Descriptors.h"
+
+#include "i2ctinyusb.h"
+#include "i2cmegausb.h"
+#include "batch.h"
+#include "clock.h"
+#include "prog.h"
+#include "stats.h"
+#include "trace.h"
+#include "twi.h"
+
+#if !defined(I2C_USB_LOWSPEED)
+
+#define PROG_CONFIG_SIZE    12      /* bytes in CMD_PROGRAM */
+
+enum {
+    PROG_OFF,           /* not armed */
+    PROG_RECEIVE,       /* collecting the page from the OUT endpoint */
+    PROG_WRITE,         /* writing the page */
+    PROG_POLL,          /* polling for the end of the write cycle */
+    PROG_VERIFY,        /* reading the page back */
+    PROG_REPORT         /* sending the last record */
+};
+
+static uint8_t  prog_buf[I2C_PROG_MAXPAGE];
+static uint8_t  prog_state;
+static uint8_t  prog_addr;
+static uint8_t  prog_flags;
+static uint8_t  prog_page;          /* page size of the EEPROM */
+static uint32_t prog_mem;           /* EEPROM address of the page */
+static uint32_t prog_left;          /* bytes of the image not written */
+static uint32_t prog_done;          /* bytes written (and verified) */
+static uint8_t  prog_len;           /* bytes in the page */
+static uint8_t  prog_pos;           /* bytes received, written or read */
+static uint8_t  prog_polls;         /* polls of the page (saturating) */
+static uint8_t  prog_diff;          /* read back differs */
+static uint32_t prog_due;           /* end of the write cycle at the latest */
+static int8_t   prog_status;        /* status of the last record */
+static uint8_t  prog_eof;           /* the whole image came in */
+
+/* The bulk endpoints belong to the programming until its last record */
+uint8_t prog_armed (void) {
+    return prog_state != PROG_OFF;
+}
+
+/* A page owns the bus from its write to its last poll or read back */
+uint8_t prog_busy (void) {
+    return prog_state == PROG_WRITE || prog_state == PROG_POLL ||
+           prog_state == PROG_VERIFY;
+}
+
+/* Sends a record: status, polls of the last page, bytes done (LE).
+ * Returns 0 if both banks are full. */
+static uint8_t prog_record (const int8_t status) {
+    Endpoint_SelectEndpoint (I2C_IN_EPADDR);
+    if (!Endpoint_IsINReady ())
+        return 0;
+    Endpoint_Write_8 (status);
+    Endpoint_Write_8 (prog_polls);
+    Endpoint_Write_32_LE (prog_done);
+    Endpoint_ClearIN ();
+    return 1;
+}
+
+/* Sets up the next page, which ends at a page boundary of the EEPROM */
+static void prog_next_page (void) {
+    prog_len = prog_page - prog_mem % prog_page;
+    if (prog_len > prog_left)
+        prog_len = prog_left;
+    prog_pos   = 0;
+    prog_state = PROG_RECEIVE;
+}
+
+/* Arms or stops the programming from the data stage of CMD_PROGRAM. The
+ * request is run from the main loop, so no page is on the bus. */
+void prog_set (const i2c_cmd_t *req) {
+    uint8_t buf[PROG_CONFIG_SIZE];
+    uint16_t page;
+    uint32_t len;
+
+    if (i2c_altsetting != INTERFACE_ALT_BATCH || batch_armed () ||
+        (req->length && req->length != sizeof (buf))) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    Endpoint_SetEndpointDirection (ENDPOINT_DIR_OUT);
+    if (req->length && Endpoint_Read_Control_Stream_LE (buf, req->length))
+        return;
+    page = buf[2] | (buf[3] << 8);
+    len  = buf[8] | ((uint32_t)buf[9] << 8) | ((uint32_t)buf[10] << 16) |
+           ((uint32_t)buf[11] << 24);
+    if (req->length && (buf[0] > 0x7f || !page || page > I2C_PROG_MAXPAGE ||
+                        !len || i2c_status == STATUS_UNCONFIGURED)) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+
+    if (req->length) {
+        prog_addr  = buf[0];
+        prog_flags = buf[1];
+        prog_page  = page;
+        prog_mem   = buf[4] | ((uint32_t)buf[5] << 8) |
+                     ((uint32_t)buf[6] << 16) | ((uint32_t)buf[7] << 24);
+        prog_left  = len;
+        prog_done  = 0;
+        prog_polls = 0;
+        prog_eof   = 0;
+        prog_next_page ();
+        TRACE (TRACE_PROGRAM, prog_addr, STATUS_RUNNING, 0);
+    } else {
+        prog_state = PROG_OFF;
+    }
+    Endpoint_SelectEndpoint (ENDPOINT_CONTROLEP);
+    Endpoint_ClearIN ();
+}
+
+/* SLA+W of the page. Address bits beyond the address bytes select the
+ * block, like the A0 to A2 bits of 24C04 to 24C16 and 24C1024. */
+static uint8_t prog_sla (void) {
+    uint32_t block = prog_mem >> ((prog_flags & I2C_PROG_ADDR16) ? 16 : 8);
+
+    return ((prog_addr | block) & 0x7f) << 1;
+}
+
+/* Starts a write of the page's address and len bytes */
+static void prog_start (const uint8_t len) {
+    if (prog_flags & I2C_PROG_ADDR16) {
+        twi_start (prog_sla (), 2 + len);
+        twi_put (prog_mem >> 8);
+    } else {
+        twi_start (prog_sla (), 1 + len);
+    }
+    twi_put (prog_mem);
+}
+
+/* Ends the programming, the last record goes out from prog_task () */
+static void prog_end (const int8_t status) {
+    prog_status = status;
+    prog_state  = PROG_REPORT;
+    TRACE (TRACE_PROGRAM, prog_addr, status, prog_polls);
+}
+
+/* Stops at a failed page. The OUT endpoint is halted, so the host learns
+ * about it while it still sends the image. */
+static void prog_fail (const int8_t status) {
+    if (twi_busy ())
+        twi_abort ();
+    else
+        twi_stop ();
+    Endpoint_SelectEndpoint (I2C_OUT_EPADDR);
+    Endpoint_StallTransaction ();
+    STATS_ADD (STATS_STALLS, 1);
+    prog_end (status);
+}
+
+/* Polls the EEPROM, which does not acknowledge during its write cycle.
+ * With verification the poll sets the address for the read back. */
+static void prog_poll (void) {
+    if (prog_flags & I2C_PROG_VERIFY)
+        prog_start (0);
+    else
+        twi_start (prog_sla (), 0);
+    prog_state = PROG_POLL;
+}
+
+static void prog_receive (void) {
+    Endpoint_SelectEndpoint (I2C_OUT_EPADDR);
+    if (prog_pos < prog_len && Endpoint_IsOUTReceived ()) {
+        while (prog_pos < prog_len && Endpoint_BytesInEndpoint ())
+            prog_buf[prog_pos++] = Endpoint_Read_8 ();
+        if (!Endpoint_BytesInEndpoint ())
+            Endpoint_ClearOUT ();
+    }
+    if (prog_pos < prog_len)
+        return;
+    if (prog_len == prog_left)
+        prog_eof = 1;
+    if (!i2c_bus_free ())
+        return;
+    prog_start (prog_len);
+    prog_pos   = 0;
+    prog_polls = 0;
+    prog_state = PROG_WRITE;
+}
+
+static void prog_write (void) {
+    while (prog_pos < prog_len && !twi_failed () && twi_put (prog_buf[prog_pos]))
+        prog_pos++;
+    if (twi_busy () || (prog_pos < prog_len && !twi_failed ()))
+        return;
+    if (twi_failed ()) {
+        prog_fail (twi_state == TWI_ADDR_NAK ? STATUS_ADDRESS_NAK
+                                             : STATUS_WRITE_FAILED);
+        return;
+    }
+    /* The STOP starts the write cycle */
+    twi_stop ();
+    prog_due = clock_ticks () + I2C_PROG_WRITE_MS * (F_CPU / 1000UL);
+    prog_poll ();
+}
+
+/* Goes on with the next page once one is done */
+static void prog_page_done (void) {
+    prog_mem  += prog_len;
+    prog_done += prog_len;
+    prog_left -= prog_len;
+    if (!prog_left) {
+        prog_end (STATUS_ADDRESS_ACK);
+        return;
+    }
+    /* Progress is dropped while the host does not read it */
+    prog_record (STATUS_RUNNING);
+    prog_next_page ();
+}
+
+static void prog_check_poll (void) {
+    if (twi_busy ())
+        return;
+    if (twi_failed ()) {
+        twi_stop ();
+        if (prog_polls != 0xff)
+            prog_polls++;
+        if ((int32_t)(clock_ticks () - prog_due) >= 0)
+            prog_fail (STATUS_ADDRESS_NAK);
+        else
+            prog_poll ();
+        return;
+    }
+    if (!(prog_flags & I2C_PROG_VERIFY)) {
+        twi_stop ();
+        prog_page_done ();
+        return;
+    }
+    /* Repeated START */
+    twi_start (prog_sla () | 1, prog_len);
+    prog_pos   = 0;
+    prog_diff  = 0;
+    prog_state = PROG_VERIFY;
+}
+
+static void prog_verify (void) {
+    uint8_t data;
+
+    while (prog_pos < prog_len && twi_get (&data))
+        prog_diff |= data ^ prog_buf[prog_pos++];
+    if (prog_pos == prog_len) {
+        twi_stop ();
+        if (prog_diff)
+            prog_fail (STATUS_VERIFY_FAILED);
+        else
+            prog_page_done ();
+    } else if (twi_failed ()) {
+        prog_fail (STATUS_READ_FAILED);
+    }
+}
+
+/* Refuses data the host sends past the end of the image, which would
+ * otherwise be taken for a batch once the programming is over. A zero
+ * length packet that ends the image is fine. */
+static void prog_surplus (void) {
+    Endpoint_SelectEndpoint (I2C_OUT_EPADDR);
+    if (!Endpoint_IsOUTReceived ())
+        return;
+    if (Endpoint_BytesInEndpoint ()) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+    }
+    Endpoint_ClearOUT ();
+}
+
+/* Called from the main loop, advances the programming as far as the
+ * endpoints and the bus allow */
+void prog_task (void) {
+    if (i2c_altsetting != INTERFACE_ALT_BATCH) {
+        if (prog_state != PROG_OFF) {
+            if (prog_busy ())
+                twi_abort ();
+            prog_state = PROG_OFF;
+        }
+        return;
+    }
+    if (prog_eof && prog_state != PROG_OFF)
+        prog_surplus ();
+    switch (prog_state) {
+    case PROG_RECEIVE:
+        prog_receive ();
+        break;
+    case PROG_WRITE:
+        prog_write ();
+        break;
+    case PROG_POLL:
+        prog_check_poll ();
+        break;
+    case PROG_VERIFY:
+        prog_verify ();
+        break;
+    case PROG_REPORT:
+        if (prog_record (prog_status))
+            prog_state = PROG_OFF;
+        break;
+    }
+}
+
+#endif
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* queue.c - command queue between the USB interrupt and the main loop	     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Lock-free: the head index is only written by the producer, the tail
+ * index only by the consumer, and single byte accesses are atomic on
+ * the AVR. The barriers keep the compiler from moving the slot accesses
+ * past the index updates. */
+
+#include "Config/AppConfig.h"
+#include "queue.h"
+
+#if (I2C_QUEUE_SIZE & (I2C_QUEUE_SIZE - 1)) || I2C_QUEUE_SIZE > 128
+#error I2C_QUEUE_SIZE must be a power of two up to 128
+#endif
+
+#define barrier() __asm__ __volatile__ ("" ::: "memory")
+
+static i2c_cmd_t        queue[I2C_QUEUE_SIZE];
+static volatile uint8_t queue_head;
+static volatile uint8_t queue_tail;
+
+uint8_t queue_put (const i2c_cmd_t *cmd) {
+    uint8_t head = queue_head;
+
+    if ((uint8_t)(head - queue_tail) == I2C_QUEUE_SIZE)
+        return 0;
+    queue[head & (I2C_QUEUE_SIZE - 1)] = *cmd;
+    barrier ();
+    queue_head = head + 1;
+    return 1;
+}
+
+uint8_t queue_get (i2c_cmd_t *cmd) {
+    uint8_t tail = queue_tail;
+
+    if (queue_head == tail)
+        return 0;
+    barrier ();
+    *cmd = queue[tail & (I2C_QUEUE_SIZE - 1)];
+    barrier ();
+    queue_tail = tail + 1;
+    return 1;
+}
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* queue.h - command queue between the USB interrupt and the main loop	     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __queue_h_included__
+#define __queue_h_included__
+
+#include <stdint.h>
+
+/* A control request that needs the bus, minus bmRequestType which is
+ * always vendor / interface */
+typedef struct {
+    uint8_t  request;
+    uint16_t value;
+    uint16_t index;
+    uint16_t length;
+    uint32_t ticks;     /* clock_ticks () at the SETUP */
+} i2c_cmd_t;
+
+/* Producer side, only called from the control request interrupt */
+uint8_t queue_put (const i2c_cmd_t *cmd);
+/* Consumer side, only called from the main loop */
+uint8_t queue_get (i2c_cmd_t *cmd);
+
+#endif
@@ -0,0 +1,427 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* script.c - uploadable transaction scripts run on the device		     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Runs a fixed sequence of messages, delays and register polls on the
+ * TWI bus as one CMD_RUN_SCRIPT request, see i2cmegausb.h for the ops.
+ * The script is checked when it comes in, so the engine only has to
+ * watch the size of the reply. Like the other engines it runs from the
+ * main loop and never waits for the bus; the data stage of the request
+ * stays open until the script has ended. */
+
+#include <string.h>
+#include <avr/eeprom.h>
+
+#include "Config/AppConfig.h"
+#include "Descriptors.h"
+
+#include "i2ctinyusb.h"
+#include "i2cmegausb.h"
+#include "clock.h"
+#include "script.h"
+#include "stats.h"
+#include "trace.h"
+#include "twi.h"
+
+#define SCRIPT_REPLY_HDR    2       /* status and offset before the data */
+
+enum {
+    SCRIPT_OFF,         /* not running */
+    SCRIPT_FETCH,       /* starting the op at script_pc */
+    SCRIPT_WRITE,       /* writing the data of a WRITE */
+    SCRIPT_READ,        /* reading the data of a READ */
+    SCRIPT_DELAY,       /* waiting for a DELAY or the next POLL try */
+    SCRIPT_POLL,        /* writing the register number of a POLL */
+    SCRIPT_SAMPLE,      /* reading the register of a POLL */
+    SCRIPT_REPLY        /* sending the reply */
+};
+
+static uint8_t  script_buf[I2C_SCRIPT_SIZE];
+static uint8_t  script_len;         /* bytes in script_buf, 0 no script */
+static uint8_t  script_reply[SCRIPT_REPLY_HDR + I2C_SCRIPT_REPLY];
+static uint8_t  script_state;
+static uint8_t  script_pc;          /* offset of the current op */
+static uint8_t  script_data;        /* offset of the next byte to write */
+static uint8_t  script_left;        /* bytes left in the current message */
+static uint8_t  script_pos;         /* data bytes in the reply */
+static uint8_t  script_max;         /* data bytes the host takes */
+static uint8_t  script_tries;       /* POLL tries left */
+static uint8_t  script_open;        /* a message is open on the bus */
+static uint32_t script_due;         /* end of the DELAY */
+static uint8_t  script_depth;       /* loops entered */
+static uint8_t  script_loop[I2C_SCRIPT_DEPTH];  /* offset of the loop body */
+static uint8_t  script_count[I2C_SCRIPT_DEPTH]; /* runs of the body left */
+
+/* The saved script, an erased EEPROM reads as no script. The length is
+ * written last. */
+static uint8_t EEMEM script_ee_len = 0xff;
+static uint8_t EEMEM script_ee[I2C_SCRIPT_SIZE];
+
+/* A script owns the bus from RUN_SCRIPT until it has ended */
+uint8_t script_busy (void) {
+    return script_state != SCRIPT_OFF && script_state != SCRIPT_REPLY;
+}
+
+/* Bytes of the op at buf with its operands, 0 for an unknown op. Checks
+ * only that the op code and the length of a WRITE fit into len. */
+static uint16_t script_oplen (const uint8_t *buf, const uint8_t len) {
+    switch (buf[0]) {
+    case I2C_SCRIPT_END:
+    case I2C_SCRIPT_NEXT:
+        return 1;
+    case I2C_SCRIPT_LOOP:
+    case I2C_SCRIPT_JNAK:
+        return 2;
+    case I2C_SCRIPT_READ:
+    case I2C_SCRIPT_DELAY:
+        return 3;
+    case I2C_SCRIPT_WRITE:
+        return len < 3 ? 3 : 3 + buf[2];
+    case I2C_SCRIPT_POLL:
+        return 7;
+    }
+    return 0;
+}
+
+/* Checks the ops and their operands, the nesting of the loops and the
+ * targets of the jumps */
+static uint8_t script_check (const uint8_t *buf, const uint8_t len) {
+    uint8_t outer[I2C_SCRIPT_SIZE];     /* innermost LOOP + 1 per op */
+    uint8_t stack[I2C_SCRIPT_DEPTH];
+    uint8_t depth = 0, target;
+    uint16_t pos, n;
+
+    memset (outer, 0xff, len);
+    for (pos = 0; pos < len; pos += n) {
+        n = script_oplen (&buf[pos], len - pos);
+        if (!n || pos + n > len)
+            return 0;
+        outer[pos] = depth ? stack[depth-1] + 1 : 0;
+        switch (buf[pos]) {
+        case I2C_SCRIPT_READ:
+            if (!buf[pos+2] || buf[pos+2] > I2C_SCRIPT_REPLY)
+                return 0;
+            break;
+        case I2C_SCRIPT_POLL:
+            if (buf[pos+1] & I2C_SCRIPT_NOSTOP || !buf[pos+5])
+                return 0;
+            break;
+        case I2C_SCRIPT_LOOP:
+            if (depth == I2C_SCRIPT_DEPTH || !buf[pos+1])
+                return 0;
+            stack[depth++] = pos;
+            break;
+        case I2C_SCRIPT_NEXT:
+            if (!depth)
+                return 0;
+            depth--;
+            break;
+        }
+    }
+    if (depth)
+        return 0;
+    for (pos = 0; pos < len; pos++) {
+        if (outer[pos] == 0xff || buf[pos] != I2C_SCRIPT_JNAK)
+            continue;
+        target = buf[pos+1];
+        if (target <= pos || target > len ||
+            (target < len && outer[target] != outer[pos]))
+            return 0;
+    }
+    return 1;
+}
+
+/* Loads the saved script at power-on */
+void script_init (void) {
+    script_len = eeprom_read_byte (&script_ee_len);
+    if (script_len > I2C_SCRIPT_SIZE) {
+        script_len = 0;
+        return;
+    }
+    eeprom_read_block (script_buf, script_ee, script_len);
+    if (!script_check (script_buf, script_len))
+        script_len = 0;
+}
+
+/* Takes a new script from the data stage of CMD_SET_SCRIPT and saves it
+ * if asked to. The request is run from the main loop, so no script is
+ * running. */
+void script_set (const i2c_cmd_t *req) {
+    if (req->length > sizeof (script_buf)) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    script_len = 0;
+    Endpoint_SetEndpointDirection (ENDPOINT_DIR_OUT);
+    if (req->length && Endpoint_Read_Control_Stream_LE (script_buf, req->length))
+        return;
+    if (!script_check (script_buf, req->length)) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    script_len = req->length;
+    if (req->value & I2C_SCRIPT_SAVE) {
+        eeprom_update_byte (&script_ee_len, 0xff);
+        eeprom_update_block (script_buf, script_ee, script_len);
+        eeprom_update_byte (&script_ee_len, script_len);
+    }
+    Endpoint_ClearIN ();
+}
+
+/* Starts the script for CMD_RUN_SCRIPT. The request is run from the
+ * main loop once no other engine owns the bus. */
+void script_run (const i2c_cmd_t *req) {
+    if (!script_len || i2c_status == STATUS_UNCONFIGURED ||
+        i2c_status_int == STATUS_RUNNING || req->length < SCRIPT_REPLY_HDR) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    script_max   = req->length - SCRIPT_REPLY_HDR < I2C_SCRIPT_REPLY ?
+                   req->length - SCRIPT_REPLY_HDR : I2C_SCRIPT_REPLY;
+    script_pc    = 0;
+    script_pos   = 0;
+    script_depth = 0;
+    script_state = SCRIPT_FETCH;
+}
+
+static void script_stop (void) {
+    if (script_open) {
+        if (twi_busy ())
+            twi_abort ();
+        else
+            twi_stop ();
+        script_open = 0;
+    }
+}
+
+/* Ends the script at the current op */
+static void script_end (const uint8_t status) {
+    script_stop ();
+    script_reply[0] = status;
+    script_reply[1] = script_pc;
+    script_state    = SCRIPT_REPLY;
+    TRACE (TRACE_SCRIPT, status, script_pc, script_pos);
+}
+
+/* Goes on after the op at script_pc */
+static void script_next (void) {
+    script_pc   += script_oplen (&script_buf[script_pc], script_len - script_pc);
+    script_state = SCRIPT_FETCH;
+}
+
+/* Ends the message of the current op unless it keeps the bus */
+static void script_done (void) {
+    if (!(script_buf[script_pc+1] & I2C_SCRIPT_NOSTOP))
+        script_stop ();
+    script_next ();
+}
+
+/* Takes the JNAK after a failed op or ends the script */
+static void script_fail (const uint8_t status) {
+    uint8_t pc = script_pc;
+
+    script_stop ();
+    script_next ();
+    if (script_pc < script_len && script_buf[script_pc] == I2C_SCRIPT_JNAK) {
+        script_pc = script_buf[script_pc+1];
+        return;
+    }
+    script_pc = pc;
+    script_end (status);
+}
+
+/* Status of a failed message */
+static uint8_t script_status (const uint8_t failed) {
+    return twi_state == TWI_ADDR_NAK ? STATUS_ADDRESS_NAK : failed;
+}
+
+static void script_poll (void) {
+    twi_start (script_buf[script_pc+1] << 1, 1);
+    twi_put (script_buf[script_pc+2]);
+    script_open  = 1;
+    script_state = SCRIPT_POLL;
+}
+
+/* Counts a POLL try that did not match and waits for the next */
+static void script_miss (void) {
+    script_stop ();
+    if (!--script_tries) {
+        script_fail (STATUS_POLL_FAILED);
+        return;
+    }
+    script_due   = clock_ticks () + script_buf[script_pc+6] * (F_CPU / 1000UL);
+    script_state = SCRIPT_DELAY;
+}
+
+static void script_fetch (void) {
+    const uint8_t *op = &script_buf[script_pc];
+
+    if (script_pc >= script_len || op[0] == I2C_SCRIPT_END) {
+        script_end (STATUS_ADDRESS_ACK);
+        return;
+    }
+    switch (op[0]) {
+    case I2C_SCRIPT_WRITE:
+        twi_start ((op[1] & 0x7f) << 1, op[2]);
+        script_open  = 1;
+        script_left  = op[2];
+        script_data  = script_pc + 3;
+        script_state = SCRIPT_WRITE;
+        break;
+    case I2C_SCRIPT_READ:
+        if (script_pos + op[2] > script_max) {
+            script_end (STATUS_SCRIPT_OVERFLOW);
+            break;
+        }
+        twi_start (((op[1] & 0x7f) << 1) | 1, op[2]);
+        script_open  = 1;
+        script_left  = op[2];
+        script_state = SCRIPT_READ;
+        break;
+    case I2C_SCRIPT_DELAY:
+        script_due   = clock_ticks () +
+                       (uint16_t)(op[1] | (op[2] << 8)) * (F_CPU / 1000UL);
+        script_state = SCRIPT_DELAY;
+        break;
+    case I2C_SCRIPT_POLL:
+        script_tries = op[5];
+        script_poll ();
+        break;
+    case I2C_SCRIPT_LOOP:
+        script_loop[script_depth]  = script_pc + 2;
+        script_count[script_depth] = op[1];
+        script_depth++;
+        script_next ();
+        break;
+    case I2C_SCRIPT_NEXT:
+        if (--script_count[script_depth-1]) {
+            script_pc = script_loop[script_depth-1];
+            break;
+        }
+        script_depth--;
+        script_next ();
+        break;
+    case I2C_SCRIPT_JNAK:
+        /* The op before did not fail */
+        script_next ();
+        break;
+    }
+}
+
+static void script_write (void) {
+    while (script_left && !twi_failed () &&
+           twi_put (script_buf[script_data])) {
+        script_data++;
+        script_left--;
+    }
+    if (twi_busy () || (script_left && !twi_failed ()))
+        return;
+    if (twi_failed ())
+        script_fail (script_status (STATUS_WRITE_FAILED));
+    else
+        script_done ();
+}
+
+static void script_read (void) {
+    while (script_left &&
+           twi_get (&script_reply[SCRIPT_REPLY_HDR + script_pos])) {
+        script_pos++;
+        script_left--;
+    }
+    if (!script_left) {
+        script_done ();
+    } else if (twi_failed ()) {
+        /* Keeps the data of later reads where the host expects it */
+        memset (&script_reply[SCRIPT_REPLY_HDR + script_pos], 0xff, script_left);
+        script_pos += script_left;
+        script_fail (script_status (STATUS_READ_FAILED));
+    }
+}
+
+static void script_sample (void) {
+    const uint8_t *op = &script_buf[script_pc];
+    uint8_t data;
+
+    if (twi_get (&data)) {
+        script_stop ();
+        if ((data & op[3]) == op[4])
+            script_next ();
+        else
+            script_miss ();
+    } else if (twi_failed ()) {
+        script_miss ();
+    }
+}
+
+/* Returns the status, the offset and the data read in the data stage of
+ * RUN_SCRIPT */
+static void script_send (void) {
+    Endpoint_SelectEndpoint (ENDPOINT_CONTROLEP);
+    Endpoint_SetEndpointDirection (ENDPOINT_DIR_IN);
+    Endpoint_Write_Control_Stream_LE (script_reply, SCRIPT_REPLY_HDR + script_pos);
+    Endpoint_ClearOUT ();
+    script_state = SCRIPT_OFF;
+}
+
+/* Called from the main loop, advances the script as far as the bus
+ * allows */
+void script_task (void) {
+    switch (script_state) {
+    case SCRIPT_FETCH:
+        script_fetch ();
+        break;
+    case SCRIPT_WRITE:
+        script_write ();
+        break;
+    case SCRIPT_READ:
+        script_read ();
+        break;
+    case SCRIPT_DELAY:
+        if ((int32_t)(clock_ticks () - script_due) < 0)
+            break;
+        if (script_buf[script_pc] == I2C_SCRIPT_POLL)
+            script_poll ();
+        else
+            script_next ();
+        break;
+    case SCRIPT_POLL:
+        if (twi_busy ())
+            break;
+        if (twi_failed ()) {
+            script_miss ();
+            break;
+        }
+        /* Repeated START */
+        twi_start ((script_buf[script_pc+1] << 1) | 1, 1);
+        script_state = SCRIPT_SAMPLE;
+        break;
+    case SCRIPT_SAMPLE:
+        script_sample ();
+        break;
+    case SCRIPT_REPLY:
+        script_send ();
+        break;
+    }
+}
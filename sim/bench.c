@@ -0,0 +1,1445 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* bench.c - i2c-tiny-usb request stream benchmark on the host simulation     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Replays I2C transfers the way the kernel's i2c-tiny-usb driver sends
+ * them, one CMD_I2C_IO plus CMD_GET_STATUS per message, or as batches
+ * on the bulk endpoints, and reports throughput in simulated time and
+ * the main loop iterations per data byte (per transfer for transfers
+ * without data). Read data is checked against the simulated slave.
+ *
+ * Transfers come from a built-in set or from a file with one transfer
+ * per line in i2ctransfer syntax, e.g. "w1@0x50 0x00 r16@0x50".
+ *
+ * With -p the poll engine samples a register of the slave instead and
+ * the period and jitter of the samples on the event endpoint are
+ * reported, with -t the streaming capture reads one back to back and
+ * the sustained rate on the stream endpoint is reported. -a compares a
+ * bus scan with CMD_SCAN to one probe per address the way i2cdetect
+ * does it through the driver, -x a measurement cycle run as a script
+ * with CMD_RUN_SCRIPT to the same steps sent one by one, -w writing an
+ * EEPROM image with CMD_PROGRAM to page writes and ACK polling through
+ * the driver, -A the alert engine to the host polling a status register
+ * for alerts. -T has a master elsewhere on the bus write and read the
+ * firmware's register map in slave mode and checks the change log, -M
+ * has it run traffic while the firmware monitors the bus and checks the
+ * captured events. -P saves power-on settings and checks that both
+ * buses work right after the next power-on. -F compares one register
+ * write to many addresses with CMD_FANOUT to one write and status read
+ * per address through the driver. -S prints the device's own
+ * statistics at the end. */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "LUFA/Drivers/USB/USB.h"
+#include "Config/AppConfig.h"
+#include "Descriptors.h"
+
+#include "i2ctinyusb.h"
+#include "i2cmegausb.h"
+#include "stats.h"
+
+#include "sim.h"
+
+#define BENCH_MAXMSGS   I2C_BATCH_MAXMSGS
+#define BENCH_MAXLEN    256
+
+#define USB_VENDOR_IN   (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_INTERFACE)
+#define USB_VENDOR_OUT  (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR | REQREC_INTERFACE)
+
+typedef struct {
+    uint8_t  addr;
+    uint16_t flags;
+    uint16_t len;
+    uint8_t  buf[BENCH_MAXLEN];
+} bench_msg_t;
+
+typedef struct {
+    char        name[32];
+    bench_msg_t msgs[BENCH_MAXMSGS];
+    int         num;
+} bench_xfer_t;
+
+static int     bench_count = 1000;
+static int     bench_batch;
+static int     bench_reg;
+static int     bench_pec;
+static int     bench_errors;
+static int     bench_period;
+static int     bench_stream;
+static int     bench_stats;
+static int     bench_scan;
+static int     bench_script;
+static int     bench_image;
+static int     bench_alert;
+static int     bench_target;
+static int     bench_monitor;
+static int     bench_config;
+static int     bench_fanout;
+static int     bench_bus;
+static sim_slave_t *bench_slave = &sim_slave;
+
+/* i2c-tiny-usb driver path */
+static int bench_tinyusb (bench_xfer_t *xfer) {
+    bench_msg_t *msg;
+    uint16_t flags;
+    uint8_t cmd, status;
+    int i, ret = xfer->num;
+
+    for (i = 0; i < xfer->num; i++) {
+        msg = &xfer->msgs[i];
+        cmd = CMD_I2C_IO;
+        if (i == 0)
+            cmd |= CMD_I2C_IO_BEGIN;
+        flags = msg->flags;
+        if (i == xfer->num - 1) {
+            cmd |= CMD_I2C_IO_END;
+            /* The PEC goes at the end of the transaction */
+            if (bench_pec)
+                flags |= I2C_IO_PEC;
+        }
+        if (sim_control ((msg->flags & I2C_M_RD) ? USB_VENDOR_IN : USB_VENDOR_OUT,
+                         cmd, flags, msg->addr | (bench_bus << 8), msg->buf,
+                         msg->len) != msg->len)
+            return -1;
+        if (sim_control (USB_VENDOR_IN, CMD_GET_STATUS, 0, bench_bus << 8,
+                         &status, 1) != 1)
+            return -1;
+        if (status == STATUS_ADDRESS_NAK)
+            ret = -2;
+        if (status == STATUS_PEC_FAILED)
+            ret = -3;
+    }
+    return ret;
+}
+
+/* READ_REG path for register reads, a write of a 1 or 2 byte register
+ * number followed by a read. Returns 0 for other transfers. */
+static int bench_readreg (bench_xfer_t *xfer) {
+    static uint8_t in[BENCH_MAXLEN + 1];
+    bench_msg_t *wr = &xfer->msgs[0], *rd = &xfer->msgs[1];
+    uint16_t reg;
+    int len;
+
+    if (xfer->num != 2 || (wr->flags & I2C_M_RD) || !(rd->flags & I2C_M_RD) ||
+        wr->addr != rd->addr || wr->len < 1 || wr->len > 2 || !rd->len)
+        return 0;
+    reg = wr->len == 2 ? (wr->buf[0] << 8) | wr->buf[1] : wr->buf[0];
+    len = sim_control (USB_VENDOR_IN, CMD_READ_REG, wr->addr | (wr->len << 8),
+                       reg, in, rd->len + 1);
+    if (len != rd->len + 1)
+        return -1;
+    memcpy (rd->buf, in, rd->len);
+    return in[rd->len] == STATUS_ADDRESS_ACK ? xfer->num : -2;
+}
+
+#if !defined(I2C_USB_LOWSPEED)
+/* Bulk batch path */
+static int bench_bulk (bench_xfer_t *xfer) {
+    static uint8_t out[2 + I2C_BATCH_BUFSIZE];
+    static uint8_t in[I2C_BATCH_BUFSIZE + BENCH_MAXMSGS + 1];
+    bench_msg_t *msg;
+    uint16_t len = 0, inlen = 0, pos = 0;
+    int i, ret = xfer->num;
+
+    for (i = 0; i < xfer->num; i++) {
+        msg = &xfer->msgs[i];
+        if (msg->len > 255)
+            return -1;
+        out[2 + len++] = msg->addr;
+        out[2 + len++] = (msg->flags & I2C_M_RD) ? I2C_BATCH_RD : 0;
+        out[2 + len++] = msg->len;
+        if (msg->flags & I2C_M_RD) {
+            inlen += msg->len;
+        } else {
+            memcpy (&out[2 + len], msg->buf, msg->len);
+            len += msg->len;
+        }
+        if (len > I2C_BATCH_BUFSIZE)
+            return -1;
+    }
+    inlen += xfer->num;
+    out[0] = len;
+    out[1] = len >> 8;
+    if (sim_bulk_out (I2C_OUT_EPADDR, out, 2 + len) != 2 + len)
+        return -1;
+    /* One more than the reply, which a short or zero length packet ends */
+    if (sim_bulk_in (I2C_IN_EPADDR, in, inlen + 1) != inlen)
+        return -1;
+    for (i = 0; i < xfer->num; i++) {
+        msg = &xfer->msgs[i];
+        if (msg->flags & I2C_M_RD) {
+            memcpy (msg->buf, &in[pos], msg->len);
+            pos += msg->len;
+        }
+    }
+    for (i = 0; i < xfer->num; i++)
+        if (in[pos + i] != STATUS_ADDRESS_ACK)
+            ret = -2;
+    return ret;
+}
+#endif
+
+/* Runs a transfer and checks reads against the slave. Register reads
+ * are a write of the register number followed by a read. */
+static int bench_run (bench_xfer_t *xfer) {
+    uint8_t ptr = 0;
+    int i, ret = 0;
+
+    /* Transfers READ_REG cannot do take the usual path */
+    if (bench_reg)
+        ret = bench_readreg (xfer);
+#if !defined(I2C_USB_LOWSPEED)
+    if (!ret && bench_batch)
+        ret = bench_bulk (xfer);
+#endif
+    if (!ret)
+        ret = bench_tinyusb (xfer);
+    if (ret < 0)
+        return ret;
+
+    for (i = 0; i < xfer->num; i++) {
+        bench_msg_t *msg = &xfer->msgs[i];
+
+        if (msg->addr != bench_slave->address)
+            continue;
+        if (!(msg->flags & I2C_M_RD)) {
+            if (msg->len)
+                ptr = msg->buf[0] + msg->len - 1;
+            continue;
+        }
+        for (uint16_t n = 0; n < msg->len; n++, ptr++) {
+            if (msg->buf[n] != bench_slave->mem[ptr]) {
+                bench_errors++;
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+static void bench_report (bench_xfer_t *xfer, const int expect) {
+    uint64_t cycles = sim_cycles, iterations = sim_iterations;
+    uint64_t bus_cycles = sim_bus_cycles;
+    uint32_t bytes = 0;
+    struct timespec t0, t1;
+    double wall, sim;
+    int i, n, ret, failed = 0;
+
+    for (i = 0; i < xfer->num; i++)
+        bytes += xfer->msgs[i].len;
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    for (n = 0; n < bench_count; n++) {
+        ret = bench_run (xfer);
+        if (ret != expect)
+            failed++;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+
+    wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    sim  = (double)(sim_cycles - cycles) / F_CPU;
+    cycles = sim_cycles - cycles;
+    iterations = sim_iterations - iterations;
+    printf ("%-24.24s %8.0f %9.0f %7.1f %6.1f%% %10.0f %6d\n", xfer->name,
+            n * xfer->num / sim,
+            n * bytes / sim,
+            bytes ? (double)iterations / (n * bytes) : (double)iterations / n,
+            100.0 * (sim_bus_cycles - bus_cycles) / cycles,
+            n * xfer->num / wall,
+            failed);
+}
+
+/* Parses "w<len>@<addr> <data>... r<len>@<addr>" */
+static int bench_parse (const char *line, bench_xfer_t *xfer) {
+    const char *p = line;
+    char *end;
+    bench_msg_t *msg = NULL;
+    uint16_t filled = 0;
+    unsigned long v;
+
+    memset (xfer, 0, sizeof (*xfer));
+    snprintf (xfer->name, sizeof (xfer->name), "%.*s",
+              (int)strcspn (line, "\n"), line);
+    for (;;) {
+        while (isspace ((unsigned char)*p))
+            p++;
+        if (!*p || *p == '#')
+            break;
+        if (*p == 'w' || *p == 'r') {
+            if (msg && !(msg->flags & I2C_M_RD) && filled != msg->len)
+                return -1;
+            if (xfer->num == BENCH_MAXMSGS)
+                return -1;
+            msg = &xfer->msgs[xfer->num++];
+            msg->flags = (*p == 'r') ? I2C_M_RD : 0;
+            v = strtoul (p + 1, &end, 0);
+            if (*end != '@' || v > BENCH_MAXLEN)
+                return -1;
+            msg->len = v;
+            v = strtoul (end + 1, &end, 0);
+            if (v > 0x7f)
+                return -1;
+            msg->addr = v;
+            filled = 0;
+        } else {
+            if (!msg || (msg->flags & I2C_M_RD) || filled == msg->len)
+                return -1;
+            v = strtoul (p, &end, 0);
+            if (end == p || v > 0xff)
+                return -1;
+            msg->buf[filled++] = v;
+        }
+        p = end;
+    }
+    if (msg && !(msg->flags & I2C_M_RD) && filled != msg->len)
+        return -1;
+    return xfer->num;
+}
+
+static const char *bench_builtin[] = {
+    "w0@0x50",
+    "w0@0x51",
+    "w2@0x50 0x10 0x55",
+    "w1@0x50 0x10 r1@0x50",
+    "w1@0x50 0x20 r2@0x50",
+    "w1@0x50 0x00 r32@0x50",
+    "w1@0x50 0x00 r255@0x50",
+    "w17@0x50 0x40 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16",
+    NULL
+};
+
+#if !defined(I2C_USB_LOWSPEED)
+/* Polls two bytes of the slave every bench_period ms and measures the
+ * time between the samples taken by the firmware */
+static int bench_poll (void) {
+    uint8_t entry[6] = { sim_slave.address, 0x10, 2, 0,
+                         bench_period, bench_period >> 8 };
+    uint8_t buf[I2C_EVENT_EPSIZE], *rec;
+    uint32_t ticks, last = 0, dt, dmin = UINT32_MAX, dmax = 0;
+    uint64_t sum = 0;
+    int samples = 0, lost = 0, failed = 0, len, pos;
+
+    if (sim_control (USB_VENDOR_OUT, CMD_SET_POLL, 0, 0,
+                     entry, sizeof (entry)) < 0) {
+        fprintf (stderr, "SET_POLL failed\n");
+        return -1;
+    }
+    while (samples < bench_count) {
+        len = sim_bulk_in (I2C_EVENT_EPADDR, buf, sizeof (buf));
+        if (len < 0) {
+            fprintf (stderr, "no samples on the event endpoint\n");
+            return -1;
+        }
+        for (pos = 0; pos + 7 + entry[2] <= len; pos += 7 + entry[2]) {
+            rec   = buf + pos;
+            ticks = rec[3] | (rec[4] << 8) | (rec[5] << 16) |
+                    ((uint32_t)rec[6] << 24);
+            lost += rec[2];
+            if (rec[1] != STATUS_ADDRESS_ACK)
+                failed++;
+            else if (rec[7] != sim_slave.mem[0x10] ||
+                     rec[8] != sim_slave.mem[0x11])
+                bench_errors++;
+            if (samples++) {
+                dt   = ticks - last;
+                sum += dt;
+                dmin = dt < dmin ? dt : dmin;
+                dmax = dt > dmax ? dt : dmax;
+            }
+            last = ticks;
+        }
+    }
+    sim_control (USB_VENDOR_OUT, CMD_SET_POLL, 0, 0, NULL, 0);
+
+    printf ("%-10s %8s %10s %10s %10s %6s %6s\n", "period", "samples",
+            "mean us", "min us", "max us", "lost", "failed");
+    printf ("%7d ms %8d %10.1f %10.1f %10.1f %6d %6d\n", bench_period,
+            samples, (double)sum / (samples - 1) / (F_CPU / 1000000),
+            (double)dmin / (F_CPU / 1000000), (double)dmax / (F_CPU / 1000000),
+            lost, failed);
+    return 0;
+}
+
+/* Streams samples of bench_stream bytes back to back for bench_count
+ * packets and reports the rate the host receives them at */
+static int bench_capture (void) {
+    uint8_t config[6] = { sim_slave.address, 0x20, bench_stream, 0, 0, 0 };
+    uint8_t buf[I2C_STREAM_EPSIZE], seq = 0;
+    uint64_t cycles, bus_cycles = sim_bus_cycles;
+    int packets, samples = 0, lost = 0, gaps = 0, len, pos;
+
+    if (sim_control (USB_VENDOR_OUT, CMD_SET_STREAM, 0, 0,
+                     config, sizeof (config)) < 0) {
+        fprintf (stderr, "SET_STREAM failed\n");
+        return -1;
+    }
+    cycles = sim_cycles;
+    for (packets = 0; packets < bench_count; packets++) {
+        len = sim_bulk_in (I2C_STREAM_EPADDR, buf, sizeof (buf));
+        if (len < 3 || buf[2] != STATUS_RUNNING) {
+            fprintf (stderr, "capture stopped\n");
+            return -1;
+        }
+        if (buf[0] != seq)
+            gaps++;
+        seq   = buf[0] + 1;
+        lost += buf[1];
+        for (pos = 3; pos + bench_stream <= len; pos += bench_stream) {
+            if (memcmp (&buf[pos], &sim_slave.mem[0x20], bench_stream))
+                bench_errors++;
+            samples++;
+        }
+    }
+    cycles = sim_cycles - cycles;
+    sim_control (USB_VENDOR_OUT, CMD_SET_STREAM, 0, 0, NULL, 0);
+
+    printf ("%-10s %9s %9s %9s %7s %6s %6s\n", "sample", "samples/s",
+            "byte/s", "packets", "bus", "lost", "gaps");
+    printf ("%7d B %9.0f %9.0f %9d %6.1f%% %6d %6d\n", bench_stream,
+            (double)samples * F_CPU / cycles,
+            (double)samples * bench_stream * F_CPU / cycles, packets,
+            100.0 * (sim_bus_cycles - bus_cycles) / cycles, lost, gaps);
+    return 0;
+}
+#endif
+
+/* Scans 0x03 to 0x77 bench_count times with CMD_SCAN and with zero
+ * length writes plus GET_STATUS, and reports the time per scan */
+static int bench_bus_scan (void) {
+    uint8_t map[16], status;
+    uint64_t cycles[2];
+    int i, addr, found[2] = { 0, 0 };
+
+    cycles[0] = sim_cycles;
+    for (i = 0; i < bench_count; i++) {
+        if (sim_control (USB_VENDOR_IN, CMD_SCAN, 0, 0, map, sizeof (map)) !=
+            sizeof (map)) {
+            fprintf (stderr, "SCAN failed\n");
+            return -1;
+        }
+    }
+    cycles[0] = sim_cycles - cycles[0];
+    for (addr = 0; addr < 0x80; addr++)
+        if (map[addr >> 3] & (1 << (addr & 7)))
+            found[0]++;
+    if (found[0] != 1 || !(map[sim_slave.address >> 3] & (1 << (sim_slave.address & 7))))
+        bench_errors++;
+
+    cycles[1] = sim_cycles;
+    for (i = 0; i < bench_count; i++) {
+        found[1] = 0;
+        for (addr = 0x03; addr <= 0x77; addr++) {
+            if (sim_control (USB_VENDOR_OUT, CMD_I2C_IO + CMD_I2C_IO_BEGIN +
+                             CMD_I2C_IO_END, 0, addr, NULL, 0) < 0 ||
+                sim_control (USB_VENDOR_IN, CMD_GET_STATUS, 0, 0, &status, 1) != 1)
+                return -1;
+            if (status == STATUS_ADDRESS_ACK)
+                found[1]++;
+        }
+    }
+    cycles[1] = sim_cycles - cycles[1];
+    if (found[1] != found[0])
+        bench_errors++;
+
+    printf ("%-10s %10s %6s\n", "scan", "us/scan", "found");
+    printf ("%-10s %10.0f %6d\n", "SCAN", cycles[0] * 1e6 / F_CPU / bench_count, found[0]);
+    printf ("%-10s %10.0f %6d\n", "I2C_IO", cycles[1] * 1e6 / F_CPU / bench_count, found[1]);
+    return 0;
+}
+
+/* The same register write to bench_fanout addresses from 0x50 on, of
+ * which only the simulated slave acknowledges */
+static int bench_fan_out (void) {
+    uint8_t buf[16 + 8], map[2][16], status;
+    uint8_t *payload = buf + 16;
+    uint64_t cycles[2];
+    int i, j, addr, found[2] = { 0, 0 };
+
+    memset (buf, 0, sizeof (buf));
+    for (addr = 0x50; addr < 0x50 + bench_fanout; addr++)
+        buf[addr >> 3] |= 1 << (addr & 7);
+    payload[0] = 0x30;
+    for (i = 1; i < 8; i++)
+        payload[i] = 0x10 * i;
+
+    cycles[0] = sim_cycles;
+    for (i = 0; i < bench_count; i++) {
+        if (sim_control (USB_VENDOR_OUT, CMD_FANOUT, 0, 0, buf, sizeof (buf)) !=
+            sizeof (buf) ||
+            sim_control (USB_VENDOR_IN, CMD_GET_FANOUT, 0, 0, map[0], 16) != 16) {
+            fprintf (stderr, "FANOUT failed\n");
+            return -1;
+        }
+    }
+    cycles[0] = sim_cycles - cycles[0];
+    for (j = 1; j < 8; j++)
+        if (sim_slave.mem[0x30 + j - 1] != payload[j])
+            bench_errors++;
+    for (j = 0; j < 7; j++)
+        sim_slave.mem[0x30 + j] = (0x30 + j) ^ 0xa5;
+
+    cycles[1] = sim_cycles;
+    for (i = 0; i < bench_count; i++) {
+        memset (map[1], 0, sizeof (map[1]));
+        for (addr = 0x50; addr < 0x50 + bench_fanout; addr++) {
+            if (sim_control (USB_VENDOR_OUT, CMD_I2C_IO + CMD_I2C_IO_BEGIN +
+                             CMD_I2C_IO_END, 0, addr, payload, 8) < 0 ||
+                sim_control (USB_VENDOR_IN, CMD_GET_STATUS, 0, 0, &status, 1) != 1)
+                return -1;
+            if (status == STATUS_ADDRESS_ACK)
+                map[1][addr >> 3] |= 1 << (addr & 7);
+        }
+    }
+    cycles[1] = sim_cycles - cycles[1];
+    for (j = 1; j < 8; j++)
+        if (sim_slave.mem[0x30 + j - 1] != payload[j])
+            bench_errors++;
+
+    for (addr = 0; addr < 0x80; addr++)
+        for (i = 0; i < 2; i++)
+            if (map[i][addr >> 3] & (1 << (addr & 7)))
+                found[i]++;
+    if (found[0] != 1 || memcmp (map[0], map[1], sizeof (map[0])))
+        bench_errors++;
+
+    printf ("%-10s %10s %6s\n", "fan-out", "us/round", "acked");
+    printf ("%-10s %10.0f %6d\n", "FANOUT", cycles[0] * 1e6 / F_CPU / bench_count, found[0]);
+    printf ("%-10s %10.0f %6d\n", "I2C_IO", cycles[1] * 1e6 / F_CPU / bench_count, found[1]);
+    return 0;
+}
+
+/* A measurement cycle: configure, wait, poll until ready, read two
+ * blocks, then probe an absent slave, which a JNAK to the end skips */
+static const uint8_t bench_cycle[] = {
+    I2C_SCRIPT_WRITE, 0x50, 2, 0x10, 0x55,
+    I2C_SCRIPT_DELAY, 1, 0,
+    I2C_SCRIPT_POLL, 0x50, 0x10, 0xff, 0x55, 10, 1,
+    I2C_SCRIPT_LOOP, 2,
+    I2C_SCRIPT_WRITE, 0x50 | I2C_SCRIPT_NOSTOP, 1, 0x00,
+    I2C_SCRIPT_READ, 0x50, 8,
+    I2C_SCRIPT_NEXT,
+    I2C_SCRIPT_WRITE, 0x51, 0,
+    I2C_SCRIPT_JNAK, 30,
+    I2C_SCRIPT_END
+};
+
+/* Lets the firmware run until the simulated time, like a host sleeping */
+static void bench_until (const uint64_t cycles) {
+    while (sim_cycles < cycles)
+        sim_loop ();
+}
+
+/* Lets the firmware run for us µs */
+static void bench_sleep (const uint32_t us) {
+    bench_until (sim_cycles + (uint64_t)us * (F_CPU / 1000000));
+}
+
+/* Checks the reply of a bench_cycle run */
+static void bench_check_cycle (const uint8_t *reply, const int len) {
+    int i;
+
+    if (len != 2 + 16 || reply[0] != STATUS_ADDRESS_ACK ||
+        reply[1] != sizeof (bench_cycle) - 1)
+        bench_errors++;
+    for (i = 0; i < 16 && 2 + i < len; i++)
+        if (reply[2 + i] != sim_slave.mem[i % 8])
+            bench_errors++;
+}
+
+/* Runs bench_cycle bench_count times as a script and as i2c-tiny-usb
+ * transfers, and reports the time per cycle */
+static int bench_run_script (void) {
+    static const uint8_t absent[] = { I2C_SCRIPT_READ, 0x51, 2 };
+    uint8_t reply[2 + 16], status, reg, data;
+    uint64_t cycles[2];
+    int i, n, len = 0;
+
+    if (sim_control (USB_VENDOR_OUT, CMD_SET_SCRIPT, I2C_SCRIPT_SAVE, 0,
+                     (void *)bench_cycle, sizeof (bench_cycle)) < 0) {
+        fprintf (stderr, "SET_SCRIPT failed\n");
+        return -1;
+    }
+    cycles[0] = sim_cycles;
+    for (i = 0; i < bench_count; i++) {
+        len = sim_control (USB_VENDOR_IN, CMD_RUN_SCRIPT, 0, 0, reply,
+                           sizeof (reply));
+        if (len < 0) {
+            fprintf (stderr, "RUN_SCRIPT failed\n");
+            return -1;
+        }
+        bench_check_cycle (reply, len);
+    }
+    cycles[0] = sim_cycles - cycles[0];
+
+    cycles[1] = sim_cycles;
+    for (i = 0; i < bench_count; i++) {
+        reg = 0x10;
+        if (sim_control (USB_VENDOR_OUT, CMD_I2C_IO + CMD_I2C_IO_BEGIN +
+                         CMD_I2C_IO_END, 0, 0x50, "\x10\x55", 2) != 2)
+            return -1;
+        bench_sleep (1000);
+        do {
+            if (sim_control (USB_VENDOR_OUT, CMD_I2C_IO + CMD_I2C_IO_BEGIN,
+                             0, 0x50, &reg, 1) != 1 ||
+                sim_control (USB_VENDOR_IN, CMD_I2C_IO + CMD_I2C_IO_END,
+                             I2C_M_RD, 0x50, &data, 1) != 1)
+                return -1;
+        } while (data != 0x55);
+        for (n = 0; n < 2; n++) {
+            if (sim_control (USB_VENDOR_OUT, CMD_I2C_IO + CMD_I2C_IO_BEGIN,
+                             0, 0x50, "", 1) != 1 ||
+                sim_control (USB_VENDOR_IN, CMD_I2C_IO + CMD_I2C_IO_END,
+                             I2C_M_RD, 0x50, &reply[2 + 8 * n], 8) != 8 ||
+                sim_control (USB_VENDOR_IN, CMD_GET_STATUS, 0, 0,
+                             &status, 1) != 1)
+                return -1;
+        }
+        if (sim_control (USB_VENDOR_OUT, CMD_I2C_IO + CMD_I2C_IO_BEGIN +
+                         CMD_I2C_IO_END, 0, 0x51, NULL, 0) < 0 ||
+            sim_control (USB_VENDOR_IN, CMD_GET_STATUS, 0, 0, &status, 1) != 1)
+            return -1;
+    }
+    cycles[1] = sim_cycles - cycles[1];
+    reply[0] = STATUS_ADDRESS_ACK;
+    reply[1] = sizeof (bench_cycle) - 1;
+    bench_check_cycle (reply, sizeof (reply));
+
+    /* Without a JNAK a NAK ends the script */
+    if (sim_control (USB_VENDOR_OUT, CMD_SET_SCRIPT, 0, 0, (void *)absent,
+                     sizeof (absent)) < 0 ||
+        sim_control (USB_VENDOR_IN, CMD_RUN_SCRIPT, 0, 0, reply,
+                     sizeof (reply)) != 4 ||
+        reply[0] != STATUS_ADDRESS_NAK || reply[1] != 0 ||
+        reply[2] != 0xff || reply[3] != 0xff)
+        bench_errors++;
+
+    printf ("%-10s %10s %6s\n", "cycle", "us/cycle", "bytes");
+    printf ("%-10s %10.0f %6d\n", "SCRIPT", cycles[0] * 1e6 / F_CPU / bench_count,
+            len - 2);
+    printf ("%-10s %10.0f %6d\n", "I2C_IO", cycles[1] * 1e6 / F_CPU / bench_count, 16);
+    return 0;
+}
+
+#if !defined(I2C_USB_LOWSPEED)
+/* The slave as a 24C04 to 24C16 style EEPROM */
+#define BENCH_PAGE          16
+#define BENCH_WRITE_US      5000
+
+/* Writes the image with PROGRAM and returns the last record's status */
+static int bench_prog_image (const uint8_t *image, const uint8_t flags) {
+    uint8_t cfg[12] = {
+        sim_slave.address, flags, BENCH_PAGE, 0, 0, 0, 0, 0,
+        bench_image, bench_image >> 8, 0, 0
+    };
+    uint8_t rec[6];
+
+    if (sim_control (USB_VENDOR_OUT, CMD_PROGRAM, 0, 0, cfg, sizeof (cfg)) < 0 ||
+        sim_bulk_out (I2C_OUT_EPADDR, image, bench_image) != bench_image)
+        return -1;
+    do {
+        if (sim_bulk_in (I2C_IN_EPADDR, rec, sizeof (rec)) != sizeof (rec))
+            return -1;
+    } while ((int8_t)rec[0] == STATUS_RUNNING);
+    if (rec[2] + (rec[3] << 8) != bench_image)
+        bench_errors++;
+    return rec[0];
+}
+
+/* Writes the image page by page through I2C_IO and polls with zero
+ * length writes until the EEPROM acknowledges again */
+static int bench_io_image (const uint8_t *image) {
+    uint8_t buf[1 + BENCH_PAGE], status;
+    int pos, len;
+
+    for (pos = 0; pos < bench_image; pos += len) {
+        len = bench_image - pos < BENCH_PAGE ? bench_image - pos : BENCH_PAGE;
+        buf[0] = pos;
+        memcpy (&buf[1], &image[pos], len);
+        if (sim_control (USB_VENDOR_OUT, CMD_I2C_IO + CMD_I2C_IO_BEGIN +
+                         CMD_I2C_IO_END, 0, sim_slave.address, buf, 1 + len) !=
+            1 + len ||
+            sim_control (USB_VENDOR_IN, CMD_GET_STATUS, 0, 0, &status, 1) != 1)
+            return -1;
+        if (status != STATUS_ADDRESS_ACK)
+            return status;
+        do {
+            if (sim_control (USB_VENDOR_OUT, CMD_I2C_IO + CMD_I2C_IO_BEGIN +
+                             CMD_I2C_IO_END, 0, sim_slave.address, NULL, 0) < 0 ||
+                sim_control (USB_VENDOR_IN, CMD_GET_STATUS, 0, 0, &status, 1) != 1)
+                return -1;
+        } while (status != STATUS_ADDRESS_ACK);
+    }
+    return STATUS_ADDRESS_ACK;
+}
+
+/* Writes a bench_image byte image bench_count times with PROGRAM, with
+ * PROGRAM and read back, and through I2C_IO, and reports the time per
+ * image */
+static int bench_program (void) {
+    static const char *const names[3] = { "PROGRAM", "PROGRAM+V", "I2C_IO" };
+    uint8_t image[256];
+    uint64_t cycles;
+    int i, m, status;
+
+    sim_slave.write_cycle = BENCH_WRITE_US * (F_CPU / 1000000);
+    printf ("%-10s %10s %8s\n", "image", "us/image", "byte/s");
+    for (m = 0; m < 3; m++) {
+        cycles = sim_cycles;
+        for (i = 0; i < bench_count; i++) {
+            memset (sim_slave.mem, 0, sizeof (sim_slave.mem));
+            memset (image, i * 3 + m, bench_image);
+            image[0] = i;
+            status = m < 2 ? bench_prog_image (image, m ? I2C_PROG_VERIFY : 0)
+                           : bench_io_image (image);
+            if (status < 0) {
+                fprintf (stderr, "%s failed\n", names[m]);
+                return -1;
+            }
+            if (status != STATUS_ADDRESS_ACK ||
+                memcmp (sim_slave.mem, image, bench_image))
+                bench_errors++;
+        }
+        cycles = sim_cycles - cycles;
+        printf ("%-10s %10.0f %8.0f\n", names[m], cycles * 1e6 / F_CPU / bench_count,
+                (double)bench_image * bench_count * F_CPU / cycles);
+    }
+    return 0;
+}
+
+/* An alert every tenth poll period, with the alert flag in bit 7 of the
+ * slave's status register */
+#define BENCH_ALERT_GAP     10
+#define BENCH_ALERT_REG     0x30
+
+static void bench_raise (const int i) {
+    sim_slave.mem[BENCH_ALERT_REG]     = 0x80 | (i & 0x7f);
+    sim_slave.mem[BENCH_ALERT_REG + 1] = i >> 7;
+    sim_slave.alert = 1;
+}
+
+/* Raises bench_count alerts at pseudo random points, first with the host
+ * reading the status register every bench_alert ms, then with the alert
+ * engine, and reports the time from the alert until the host knows of
+ * it, the USB transfers and the bus time spent */
+static int bench_smbalert (void) {
+    static const char *const names[2] = { "host poll", "SMBALERT" };
+    const uint64_t period = (uint64_t)bench_alert * (F_CPU / 1000);
+    uint64_t start, next, raise, raised, dt, sum, dmax, bus;
+    uint8_t buf[I2C_EVENT_EPSIZE];
+    int i, m, xfers;
+
+    printf ("%-10s %8s %10s %10s %8s %7s\n", "method", "alerts", "mean us",
+            "max us", "xfers", "bus");
+    for (m = 0; m < 2; m++) {
+        if (m && sim_control (USB_VENDOR_OUT, CMD_SET_ALERT, 1,
+                              BENCH_ALERT_REG | (2 << 8), NULL, 0) < 0) {
+            fprintf (stderr, "SET_ALERT failed\n");
+            return -1;
+        }
+        sum = dmax = 0;
+        xfers = 0;
+        start = next = sim_cycles;
+        bus = sim_bus_cycles;
+        for (i = 0; i < bench_count; i++) {
+            raise  = next + (BENCH_ALERT_GAP - 1) * period +
+                     (uint64_t)i * 7919 % period;
+            raised = 0;
+            if (!m) {
+                /* READ_REG every period until the flag shows */
+                do {
+                    if (!raised && raise <= next) {
+                        bench_until (raise);
+                        bench_raise (i);
+                        raised = sim_cycles;
+                    }
+                    bench_until (next);
+                    next += period;
+                    xfers++;
+                    if (sim_control (USB_VENDOR_IN, CMD_READ_REG,
+                                     sim_slave.address | (1 << 8),
+                                     BENCH_ALERT_REG, buf, 3) != 3) {
+                        fprintf (stderr, "READ_REG failed\n");
+                        return -1;
+                    }
+                } while (!raised || !(buf[0] & 0x80));
+                sim_slave.alert = 0;
+            } else {
+                bench_until (raise);
+                bench_raise (i);
+                raised = sim_cycles;
+                xfers++;
+                if (sim_bulk_in (I2C_EVENT_EPADDR, buf, sizeof (buf)) != 7 + 3) {
+                    fprintf (stderr, "no alert record\n");
+                    return -1;
+                }
+                if (buf[0] != I2C_ALERT_RECORD || buf[1] != STATUS_ADDRESS_ACK ||
+                    buf[7] != sim_slave.address || sim_slave.alert)
+                    bench_errors++;
+                memmove (buf, &buf[8], 2);
+                next = sim_cycles;
+            }
+            dt = sim_cycles - raised;
+            sum += dt;
+            dmax = dt > dmax ? dt : dmax;
+            if (buf[0] != sim_slave.mem[BENCH_ALERT_REG] ||
+                buf[1] != sim_slave.mem[BENCH_ALERT_REG + 1])
+                bench_errors++;
+            /* The host clears the flag */
+            sim_slave.mem[BENCH_ALERT_REG] = 0;
+        }
+        printf ("%-10s %8d %10.1f %10.1f %8d %6.1f%%\n", names[m], bench_count,
+                (double)sum / bench_count / (F_CPU / 1000000),
+                (double)dmax / (F_CPU / 1000000), xfers,
+                100.0 * (sim_bus_cycles - bus) / (sim_cycles - start));
+    }
+    sim_control (USB_VENDOR_OUT, CMD_SET_ALERT, 0, 0, NULL, 0);
+    return 0;
+}
+#endif
+
+/* Slave mode map: registers 0 to 7 read-only, the rest writable except
+ * for the upper half of the last one */
+#define BENCH_SLAVE_ADDR    0x42
+#define BENCH_SLAVE_REGS    16
+
+/* Reads the change log and checks it against the writes of the runs */
+static int bench_serve_log (const int first, const int runs) {
+    uint8_t log[2 + 2 * I2C_SLAVE_LOG];
+    int len, i, n = 0;
+
+    len = sim_control (USB_VENDOR_IN, CMD_GET_SLAVE, 0, 0, log, sizeof (log));
+    if (len < 2 || len != 2 + 2 * log[0] || log[1]) {
+        fprintf (stderr, "GET_SLAVE failed\n");
+        return -1;
+    }
+    for (i = first; i < first + runs; i++) {
+        /* Two bytes written per run, from register 8 + i % 8 on */
+        if (log[2 + 2 * n] != 8 + i % 8 || log[3 + 2 * n] != (uint8_t)i ||
+            log[4 + 2 * n] != (9 + i % 8) % BENCH_SLAVE_REGS ||
+            log[5 + 2 * n] != (uint8_t)~i)
+            bench_errors++;
+        n += 2;
+    }
+    return n == log[0] ? 0 : -1;
+}
+
+/* Has a master elsewhere on the bus write two registers and read the
+ * whole map back bench_count times, with the firmware in slave mode,
+ * and reads the change log every few runs. Reports the rate the other
+ * master sees and checks that master messages on bus 0 fail meanwhile. */
+static int bench_serve (void) {
+    uint8_t cfg[2 + 2 * BENCH_SLAVE_REGS], regs[BENCH_SLAVE_REGS], mask;
+    uint8_t wbuf[3], rbuf[BENCH_SLAVE_REGS], reg0 = 0, status;
+    uint64_t cycles = 0, start;
+    int i, r, first = 0, bytes = 0;
+
+    cfg[0] = BENCH_SLAVE_ADDR;
+    cfg[1] = BENCH_SLAVE_REGS;
+    for (r = 0; r < BENCH_SLAVE_REGS; r++) {
+        regs[r] = r ^ 0x3c;
+        cfg[2 + r] = regs[r];
+        cfg[2 + BENCH_SLAVE_REGS + r] = r < 8 ? 0 : r == 15 ? 0x0f : 0xff;
+    }
+    if (sim_control (USB_VENDOR_OUT, CMD_SET_SLAVE, 0, 0, cfg, sizeof (cfg)) < 0) {
+        fprintf (stderr, "SET_SLAVE failed\n");
+        return -1;
+    }
+    if (sim_control (USB_VENDOR_OUT, CMD_I2C_IO + CMD_I2C_IO_BEGIN + CMD_I2C_IO_END,
+                     0, sim_slave.address, &reg0, 1) < 0 ||
+        sim_control (USB_VENDOR_IN, CMD_GET_STATUS, 0, 0, &status, 1) != 1 ||
+        status == STATUS_ADDRESS_ACK)
+        bench_errors++;
+
+    for (i = 0; i < bench_count; i++) {
+        /* Two registers from 8 + i % 8 on, the second may wrap to 0 */
+        wbuf[0] = 8 + i % 8;
+        wbuf[1] = i;
+        wbuf[2] = ~i;
+        start = sim_cycles;
+        if (sim_master_xfer (BENCH_SLAVE_ADDR, wbuf, 3, NULL, 0) != 3 ||
+            sim_master_xfer (BENCH_SLAVE_ADDR, &reg0, 1, rbuf, sizeof (rbuf)) !=
+            1 + (int)sizeof (rbuf)) {
+            fprintf (stderr, "slave did not answer\n");
+            return -1;
+        }
+        cycles += sim_cycles - start;
+        bytes  += 3 + 1 + sizeof (rbuf);
+        for (r = 0; r < 2; r++) {
+            int n = (8 + i % 8 + r) % BENCH_SLAVE_REGS;
+
+            mask    = cfg[2 + BENCH_SLAVE_REGS + n];
+            regs[n] = (regs[n] & ~mask) | (wbuf[1 + r] & mask);
+        }
+        if (memcmp (rbuf, regs, sizeof (regs)))
+            bench_errors++;
+        /* The log holds 64 entries, 2 per run */
+        if (i - first == 16 || i == bench_count - 1) {
+            if (bench_serve_log (first, i + 1 - first) < 0) {
+                fprintf (stderr, "change log mismatch\n");
+                return -1;
+            }
+            first = i + 1;
+        }
+    }
+    /* A register number beyond the map is acknowledged, the byte after
+     * it is not */
+    wbuf[0] = BENCH_SLAVE_REGS;
+    if (sim_master_xfer (BENCH_SLAVE_ADDR, wbuf, 2, NULL, 0) != 1)
+        bench_errors++;
+    sim_control (USB_VENDOR_OUT, CMD_SET_SLAVE, 0, 0, NULL, 0);
+
+    printf ("%-10s %8s %10s %9s\n", "slave", "xfers/s", "byte/s", "us/xfer");
+    printf ("0x%02x      %8.0f %10.0f %9.1f\n", BENCH_SLAVE_ADDR,
+            2.0 * bench_count * F_CPU / cycles, (double)bytes * F_CPU / cycles,
+            cycles * 1e6 / F_CPU / (2 * bench_count));
+    return 0;
+}
+
+/* Saves bus clocks and a timeout with SET_CONFIG on a device that the
+ * host never set up, checks that I/O is dropped until then, and starts
+ * the firmware over as after a replug. Reports how long after power-on
+ * the first transfer on each bus completes, without a setup request. */
+static int bench_power_on (void) {
+    static const uint32_t clocks[I2C_BUSES] = { 400000, 50000 };
+    uint8_t cfg[11] = { 0 }, back[16];
+    bench_xfer_t xfer;
+    sim_slave_t *slave;
+    uint64_t start;
+    int i, len;
+
+    for (i = 0; i < 4; i++) {
+        cfg[i]     = clocks[I2C_BUS_TWI] >> (8 * i);
+        cfg[4 + i] = clocks[I2C_BUS_SWI] >> (8 * i);
+    }
+    cfg[8] = 1000 & 0xff;
+    cfg[9] = 1000 >> 8;
+    cfg[10] = I2C_CONFIG_NOPULLUPS;
+
+    /* Unconfigured, an I/O request never completes */
+    if (sim_control (USB_VENDOR_OUT, CMD_I2C_IO + CMD_I2C_IO_BEGIN + CMD_I2C_IO_END,
+                     0, sim_slave.address, NULL, 0) >= 0)
+        bench_errors++;
+    /* A clock out of range is refused */
+    memcpy (back, cfg, sizeof (cfg));
+    back[0] = 100;
+    back[1] = back[2] = back[3] = 0;
+    if (sim_control (USB_VENDOR_OUT, CMD_SET_CONFIG, 0, 0, back, sizeof (cfg)) >= 0)
+        bench_errors++;
+    if (sim_control (USB_VENDOR_OUT, CMD_SET_CONFIG, 0, 0, cfg, sizeof (cfg)) < 0) {
+        fprintf (stderr, "SET_CONFIG failed\n");
+        return -1;
+    }
+    len = sim_control (USB_VENDOR_IN, CMD_GET_CONFIG, 0, 0, back, sizeof (back));
+    if (len != sizeof (cfg) || memcmp (back, cfg, sizeof (cfg)))
+        bench_errors++;
+
+    /* Unplugged and plugged in again */
+    sim_boot ();
+    if (PORTD & (_BV(PD0) | _BV(PD1)))
+        bench_errors++;
+    printf ("%-6s %8s %18s\n", "bus", "clock", "first transfer us");
+    start = sim_cycles;
+    for (bench_bus = 0; bench_bus < I2C_BUSES; bench_bus++) {
+        slave = bench_bus == I2C_BUS_SWI ? &sim_swi_slave : &sim_slave;
+        bench_parse ("w1@0x50 0x00 r16@0x50", &xfer);
+        if (bench_tinyusb (&xfer) != xfer.num ||
+            memcmp (xfer.msgs[1].buf, slave->mem, 16)) {
+            fprintf (stderr, "bus %d not ready after power-on\n", bench_bus);
+            return -1;
+        }
+        printf ("%-6d %8u %18.1f\n", bench_bus, clocks[bench_bus],
+                (sim_cycles - start) * 1e6 / F_CPU);
+    }
+
+    /* Deleted, the next power-on is unconfigured again */
+    if (sim_control (USB_VENDOR_OUT, CMD_SET_CONFIG, 0, 0, NULL, 0) < 0 ||
+        sim_control (USB_VENDOR_IN, CMD_GET_CONFIG, 0, 0, back, sizeof (back)) != 0)
+        bench_errors++;
+    return 0;
+}
+
+#if !defined(I2C_USB_LOWSPEED)
+typedef struct {
+    uint8_t  event;     /* I2C_MON_* */
+    uint8_t  data;
+    uint64_t us;        /* since SET_MONITOR, from the deltas */
+} bench_event_t;
+
+static bench_event_t *bench_expect;
+static int            bench_expected;
+
+static void bench_expect_event (const uint8_t event, const uint8_t data) {
+    bench_expect[bench_expected].event = event;
+    bench_expect[bench_expected].data  = data;
+    bench_expected++;
+}
+
+/* The events a sim_master_xfer () puts on the bus */
+static void bench_expect_xfer (const uint8_t addr, const uint8_t *wbuf,
+                               const int wlen, const uint8_t *rbuf,
+                               const int rlen, const int acked) {
+    int i;
+
+    bench_expect_event (I2C_MON_START, 0);
+    if (wlen) {
+        bench_expect_event (acked ? I2C_MON_ACK : I2C_MON_NAK, addr << 1);
+        for (i = 0; acked && i < wlen; i++)
+            bench_expect_event (I2C_MON_ACK, wbuf[i]);
+        if (acked && rlen)
+            bench_expect_event (I2C_MON_RESTART, 0);
+    }
+    if (rlen && acked) {
+        bench_expect_event (I2C_MON_ACK, (addr << 1) | 1);
+        for (i = 0; i < rlen; i++)
+            bench_expect_event (i < rlen - 1 ? I2C_MON_ACK : I2C_MON_NAK,
+                                rbuf[i]);
+    }
+    bench_expect_event (I2C_MON_STOP, 0);
+}
+
+/* Splits the token stream into events, -1 if it ends inside a token */
+static int bench_tokens (const uint8_t *buf, const int len,
+                         bench_event_t *events, int *lost) {
+    uint64_t us = 0, delta;
+    int pos = 0, n = 0, shift;
+
+    while (pos < len) {
+        events[n].event = buf[pos] >> 5;
+        delta = buf[pos] & 0x0f;
+        shift = 4;
+        if (buf[pos++] & 0x10) {
+            do {
+                if (pos == len)
+                    return -1;
+                delta |= (uint64_t)(buf[pos] & 0x7f) << shift;
+                shift += 7;
+            } while (buf[pos++] & 0x80);
+        }
+        us += delta;
+        events[n].us = us;
+        if (events[n].event >= I2C_MON_ACK) {
+            if (pos == len)
+                return -1;
+            events[n].data = buf[pos++];
+        }
+        if (events[n].event == I2C_MON_LOST)
+            *lost += events[n].data;
+        else
+            n++;
+    }
+    return n;
+}
+
+/* Picks up what the stream endpoint has, without waiting */
+static int bench_drain (uint8_t *stream, int len) {
+    uint32_t timeout = sim_timeout;
+    int got;
+
+    sim_timeout = 0;
+    while ((got = sim_bulk_in (I2C_STREAM_EPADDR, stream + len,
+                               I2C_STREAM_EPSIZE)) > 0)
+        len += got;
+    sim_timeout = timeout;
+    return len;
+}
+
+/* Has a master elsewhere on the bus run bench_count rounds of a register
+ * write, a register read and a probe of an absent slave at bench_monitor
+ * Hz, with idle gaps of up to 3 ms between them, while the firmware
+ * monitors the bus. The host picks up the stream as it goes, decodes it
+ * and checks the events and the time from one START to the next. */
+static int bench_bus_monitor (void) {
+    const int size = bench_count * 3 * 64;
+    uint8_t *stream = malloc (size), reg = 0x20, status;
+    uint8_t wbuf[3] = { reg }, rbuf[4];
+    bench_event_t *events;
+    uint64_t *starts, start, first;
+    int i, n, k, len = 0, got, lost = 0, bytes = 0, mismatch = 0;
+    double err, maxerr = 0;
+
+    bench_expect = malloc (bench_count * 24 * sizeof (*bench_expect));
+    events       = malloc (bench_count * 24 * sizeof (*events));
+    starts       = malloc (bench_count * 3 * sizeof (*starts));
+    sim_master_bit = F_CPU / bench_monitor;
+    if (sim_control (USB_VENDOR_OUT, CMD_SET_MONITOR, 1, 0, NULL, 0) < 0) {
+        fprintf (stderr, "SET_MONITOR failed\n");
+        return -1;
+    }
+    /* Master messages on bus 0 fail while the TWI is off */
+    if (sim_control (USB_VENDOR_OUT, CMD_I2C_IO + CMD_I2C_IO_BEGIN + CMD_I2C_IO_END,
+                     0, sim_slave.address, &reg, 1) < 0 ||
+        sim_control (USB_VENDOR_IN, CMD_GET_STATUS, 0, 0, &status, 1) != 1 ||
+        status == STATUS_ADDRESS_ACK)
+        bench_errors++;
+
+    first = sim_cycles;
+    for (i = 0; i < bench_count; i++) {
+        wbuf[1] = i;
+        wbuf[2] = ~i;
+        starts[3 * i] = sim_cycles;
+        sim_master_xfer (sim_slave.address, wbuf, 3, NULL, 0);
+        bench_expect_xfer (sim_slave.address, wbuf, 3, NULL, 0, 1);
+        bench_sleep (20);
+        starts[3 * i + 1] = sim_cycles;
+        sim_master_xfer (sim_slave.address, &reg, 1, rbuf, sizeof (rbuf));
+        bench_expect_xfer (sim_slave.address, &reg, 1, rbuf, sizeof (rbuf), 1);
+        bench_sleep (20);
+        starts[3 * i + 2] = sim_cycles;
+        sim_master_xfer (sim_slave.address + 1, &reg, 1, NULL, 0);
+        bench_expect_xfer (sim_slave.address + 1, &reg, 1, NULL, 0, 0);
+        bytes += 3 + 1 + 2 + 1 + sizeof (rbuf) + 1;
+        /* Idle, from a few µs to 3 ms */
+        bench_sleep (20 + (i % 4) * 1000);
+        len = bench_drain (stream, len);
+    }
+    start = sim_cycles;
+    if (sim_control (USB_VENDOR_OUT, CMD_SET_MONITOR, 0, 0, NULL, 0) < 0) {
+        fprintf (stderr, "SET_MONITOR failed\n");
+        return -1;
+    }
+    /* The rest ends with a short packet */
+    do {
+        got = sim_bulk_in (I2C_STREAM_EPADDR, stream + len, I2C_STREAM_EPSIZE);
+        if (got < 0) {
+            fprintf (stderr, "stream did not end\n");
+            return -1;
+        }
+        len += got;
+    } while (got == I2C_STREAM_EPSIZE);
+
+    n = bench_tokens (stream, len, events, &lost);
+    if (n < 0) {
+        fprintf (stderr, "stream ends inside a token\n");
+        return -1;
+    }
+    for (i = k = 0; i < n && i < bench_expected; i++) {
+        if (events[i].event != bench_expect[i].event ||
+            events[i].data != bench_expect[i].data)
+            mismatch++;
+        if (events[i].event != I2C_MON_START)
+            continue;
+        if (k) {
+            err = (double)(events[i].us - events[0].us) -
+                  (double)(starts[k] - starts[0]) * 1e6 / F_CPU;
+            if (err < 0)
+                err = -err;
+            maxerr = err > maxerr ? err : maxerr;
+        }
+        k++;
+    }
+    if (n != bench_expected || mismatch || lost)
+        bench_errors++;
+
+    printf ("%-10s %8s %8s %9s %7s %6s %6s %8s\n", "monitor", "events",
+            "bus B", "stream B", "B/event", "lost", "wrong", "max err");
+    printf ("%6d kHz %8d %8d %9d %7.2f %6d %6d %5.1f us\n",
+            bench_monitor / 1000, n, bytes, len, (double)len / n, lost,
+            mismatch + abs (n - bench_expected), maxerr);
+    printf ("capture %.1f ms, stream %.0f byte/s\n",
+            (start - first) * 1e3 / F_CPU, (double)len * F_CPU / (start - first));
+    free (stream);
+    free (bench_expect);
+    free (events);
+    free (starts);
+    return 0;
+}
+#endif
+
+#if I2C_STATS
+/* Reads and prints what CMD_GET_STATS collected over the whole run */
+static void bench_print_stats (void) {
+    static const char *const counters[STATS_COUNTERS] = {
+        "transactions", "read bytes", "write bytes", "address NAKs",
+        "data NAKs", "bus errors", "timeouts", "stalls"
+    };
+    static const char *const histograms[STATS_HISTOGRAMS] = {
+        "bus time", "request time"
+    };
+    uint32_t buf[STATS_COUNTERS + STATS_HISTOGRAMS * STATS_BINS];
+    int i, h;
+
+    if (sim_control (USB_VENDOR_IN, CMD_GET_STATS, 0, 0,
+                     buf, sizeof (buf)) != sizeof (buf)) {
+        fprintf (stderr, "GET_STATS failed\n");
+        return;
+    }
+    for (i = 0; i < STATS_COUNTERS; i++)
+        printf ("%-14s %10u\n", counters[i], buf[i]);
+    for (h = 0; h < STATS_HISTOGRAMS; h++) {
+        printf ("%s:\n", histograms[h]);
+        for (i = 0; i < STATS_BINS; i++)
+            if (buf[STATS_COUNTERS + h * STATS_BINS + i])
+                printf ("  %6u us %10u\n", i ? 1u << i : 0,
+                        buf[STATS_COUNTERS + h * STATS_BINS + i]);
+    }
+}
+#endif
+
+static void usage (const char *name) {
+    fprintf (stderr,
+             "usage: %s [-b | -r] [-e] [-a | -x] [-S] [-B bus] [-n count] [-d delay | -c freq] [-l cycles] [-u latency]\n"
+             "          [-s stretch] [-o timeout] [-k bytes] [-f file | -p period | -t length | -w size | -A period | -T\n"
+             "          | -M freq | -P | -F count]\n"
+             "  -b          send batches on the bulk endpoints\n"
+             "  -r          send register reads with READ_REG\n"
+             "  -e          use SMBus PEC on i2c-tiny-usb transfers\n"
+             "  -a          time bus scans instead\n"
+             "  -x          time a measurement cycle as a script instead\n"
+             "  -S          print the device statistics at the end\n"
+             "  -B bus      run i2c-tiny-usb transfers on this bus (0)\n"
+             "  -n count    runs per transfer (%d)\n"
+             "  -d delay    i2c-tiny-usb SET_DELAY in us (10 = 100 kHz)\n"
+             "  -c freq     bus clock in Hz with SET_FREQ instead\n"
+             "  -l cycles   CPU cycles per main loop iteration (%u)\n"
+             "  -u latency  host latency per USB transfer in us\n"
+             "  -s stretch  clock stretching per byte in us\n"
+             "  -o timeout  bus phase timeout in us with SET_TIMEOUT\n"
+             "  -k bytes    slave NAKs written bytes after this many\n"
+             "  -f file     transfers in i2ctransfer syntax, one per line\n"
+             "  -p period   poll a register every period ms instead\n"
+             "  -t length   stream samples of length bytes instead\n"
+             "  -w size     write an EEPROM image of size bytes instead\n"
+             "  -A period   time alerts against polling every period ms instead\n"
+             "  -T          serve another master in slave mode instead\n"
+             "  -M freq     monitor another master at freq Hz instead\n"
+             "  -P          save power-on settings and replug instead\n"
+             "  -F count    time a register write to count addresses instead\n",
+             name, bench_count, sim_loop_cycles);
+    exit (1);
+}
+
+int main (int argc, char **argv) {
+    bench_xfer_t xfer;
+    const char *file = NULL;
+    char line[1024];
+    uint32_t freq = 0, actual = 0;
+    int delay = 10, timeout = 0, opt, expect, i;
+    FILE *f;
+
+    while ((opt = getopt (argc, argv, "breaxSTPB:n:d:c:l:u:s:o:k:f:p:t:w:A:M:F:")) != -1) {
+        switch (opt) {
+        case 'b':
+            bench_batch = 1;
+            break;
+        case 'r':
+            bench_reg = 1;
+            break;
+        case 'e':
+            bench_pec = 1;
+            sim_slave.pec = 1;
+            break;
+        case 'a':
+            bench_scan = 1;
+            break;
+        case 'x':
+            bench_script = 1;
+            break;
+        case 'B':
+            bench_bus = atoi (optarg);
+            break;
+        case 'S':
+            bench_stats = 1;
+            break;
+        case 'T':
+            bench_target = 1;
+            break;
+        case 'P':
+            bench_config = 1;
+            break;
+        case 'n':
+            bench_count = atoi (optarg);
+            break;
+        case 'd':
+            delay = atoi (optarg);
+            break;
+        case 'c':
+            freq = strtoul (optarg, NULL, 0);
+            break;
+        case 'l':
+            sim_loop_cycles = atoi (optarg);
+            break;
+        case 'u':
+            sim_usb_latency = atoi (optarg) * (F_CPU / 1000000);
+            break;
+        case 's':
+            sim_slave.stretch = atoi (optarg) * (F_CPU / 1000000);
+            break;
+        case 'o':
+            timeout = atoi (optarg);
+            break;
+        case 'k':
+            sim_slave.nak_after = atoi (optarg);
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        case 'p':
+            bench_period = atoi (optarg);
+            break;
+        case 't':
+            bench_stream = atoi (optarg);
+            break;
+        case 'w':
+            bench_image = atoi (optarg);
+            break;
+        case 'A':
+            bench_alert = atoi (optarg);
+            break;
+        case 'M':
+            bench_monitor = atoi (optarg);
+            break;
+        case 'F':
+            bench_fanout = atoi (optarg);
+            break;
+        default:
+            usage (argv[0]);
+        }
+    }
+#if defined(I2C_USB_LOWSPEED)
+    if (bench_batch || bench_period || bench_stream || bench_image || bench_alert ||
+        bench_monitor) {
+        fprintf (stderr, "%s: low speed builds have no bulk endpoints\n", argv[0]);
+        return 1;
+    }
+#endif
+    if (bench_count < 1 || delay < 1 || bench_period < 0 || bench_period > 0xffff ||
+        bench_stream < 0 || bench_stream > I2C_STREAM_EPSIZE - 3 ||
+        bench_image < 0 || bench_image > 256 || bench_alert < 0 ||
+        bench_monitor < 0 || bench_monitor > 400000 ||
+        bench_fanout < 0 || bench_fanout > 0x78 - 0x50 ||
+        (bench_pec && (bench_batch || bench_reg)) || bench_bus < 0 ||
+        bench_bus >= I2C_BUSES || (bench_bus && (bench_batch || bench_reg ||
+        bench_pec || bench_scan || bench_script || bench_period || bench_stream ||
+        bench_image || bench_alert || bench_target || bench_monitor ||
+        bench_config || bench_fanout)))
+        usage (argv[0]);
+    if (bench_bus == I2C_BUS_SWI)
+        bench_slave = &sim_swi_slave;
+    for (i = 0; i < 256; i++) {
+        sim_slave.mem[i]     = i ^ 0xa5;
+        sim_swi_slave.mem[i] = i ^ 0x5a;
+    }
+    sim_swi_slave.nak_after = sim_slave.nak_after;
+
+    sim_boot ();
+    /* Before any setup request */
+    if (bench_config)
+        return bench_power_on () < 0 || bench_errors != 0;
+    if (freq) {
+        if (sim_control (USB_VENDOR_IN, CMD_SET_FREQ, freq,
+                         (freq >> 16) | (bench_bus << 8),
+                         &actual, sizeof (actual)) != sizeof (actual) || !actual) {
+            fprintf (stderr, "%s: SET_FREQ %u failed\n", argv[0], freq);
+            return 1;
+        }
+        printf ("bus clock %u Hz\n", actual);
+    } else if (sim_control (USB_VENDOR_OUT, CMD_SET_DELAY, delay, bench_bus << 8,
+                            NULL, 0) < 0) {
+        fprintf (stderr, "%s: SET_DELAY %d failed\n", argv[0], delay);
+        return 1;
+    }
+    if (timeout && sim_control (USB_VENDOR_OUT, CMD_SET_TIMEOUT, timeout, 0,
+                                NULL, 0) < 0) {
+        fprintf (stderr, "%s: SET_TIMEOUT %d failed\n", argv[0], timeout);
+        return 1;
+    }
+    if ((bench_batch || bench_period || bench_stream || bench_image || bench_alert ||
+         bench_monitor) &&
+        sim_control (REQDIR_HOSTTODEVICE | REQTYPE_STANDARD | REQREC_INTERFACE,
+                     REQ_SetInterface, INTERFACE_ALT_BATCH, 0, NULL, 0) < 0) {
+        fprintf (stderr, "%s: SET_INTERFACE failed\n", argv[0]);
+        return 1;
+    }
+
+#if I2C_STATS
+    if (bench_stats)
+        atexit (bench_print_stats);
+#else
+    if (bench_stats)
+        fprintf (stderr, "%s: built with STATS=0\n", argv[0]);
+#endif
+    if (bench_scan)
+        return bench_bus_scan () < 0 || bench_errors != 0;
+    if (bench_script)
+        return bench_run_script () < 0 || bench_errors != 0;
+    if (bench_target)
+        return bench_serve () < 0 || bench_errors != 0;
+    if (bench_fanout)
+        return bench_fan_out () < 0 || bench_errors != 0;
+#if !defined(I2C_USB_LOWSPEED)
+    if (bench_period)
+        return bench_poll () < 0 || bench_errors != 0;
+    if (bench_stream)
+        return bench_capture () < 0 || bench_errors != 0;
+    if (bench_image)
+        return bench_program () < 0 || bench_errors != 0;
+    if (bench_alert)
+        return bench_smbalert () < 0 || bench_errors != 0;
+    if (bench_monitor)
+        return bench_bus_monitor () < 0 || bench_errors != 0;
+#endif
+
+    printf ("%-24s %8s %9s %7s %7s %10s %6s\n", "transfer", "msg/s",
+            "byte/s", "it/byte", "bus", "host msg/s", "failed");
+    f = file ? fopen (file, "r") : NULL;
+    if (file && !f) {
+        perror (file);
+        return 1;
+    }
+    for (i = 0; ; i++) {
+        if (f) {
+            if (!fgets (line, sizeof (line), f))
+                break;
+        } else {
+            if (!bench_builtin[i])
+                break;
+            snprintf (line, sizeof (line), "%s", bench_builtin[i]);
+        }
+        if (bench_parse (line, &xfer) < 0) {
+            fprintf (stderr, "%s: cannot parse \"%s\"\n", argv[0], xfer.name);
+            return 1;
+        }
+        if (!xfer.num)
+            continue;
+        /* Transfers to other addresses and writes beyond the slave's
+         * limit are expected to fail */
+        expect = xfer.num;
+        for (int m = 0; m < xfer.num; m++)
+            if (xfer.msgs[m].addr != bench_slave->address ||
+                (!(xfer.msgs[m].flags & I2C_M_RD) && bench_slave->nak_after &&
+                 xfer.msgs[m].len > bench_slave->nak_after))
+                expect = -2;
+        bench_report (&xfer, expect);
+    }
+    if (f)
+        fclose (f);
+    if (bench_errors)
+        printf ("%d read data mismatches\n", bench_errors);
+    if (sim_slave.pec_errors)
+        printf ("%u writes with a wrong PEC\n", sim_slave.pec_errors);
+    return bench_errors != 0 || sim_slave.pec_errors != 0;
+}
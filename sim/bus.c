@@ -0,0 +1,510 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* bus.c - simulated TWI engine, bus and slave				     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Replaces twi.c with the same interface and buffer behaviour. Instead
+ * of the TWI interrupt, every bus phase (START and address, one data
+ * byte, STOP) is scheduled to end after its duration on the bus, and
+ * sim_twi_step () finishes the phases the simulated time has passed.
+ * A phase that finds the buffer empty (write) or full (read) stalls the
+ * engine until the firmware touches the buffer, like the real clock
+ * stretching by the master. The slave behind the bus is a register file
+ * with a write pointer, as found in EEPROMs and most sensors. With PEC
+ * on, it sends the SMBus PEC as the last byte of every read and checks
+ * the PEC of every transaction that wrote data. Like an EEPROM it can
+ * ignore its address for a write cycle after data was written, and it
+ * answers the SMBus Alert Response Address while it raises an alert
+ * (sim_slave.alert, on PB4 through hw.c). A master elsewhere on the bus
+ * (sim_master_xfer ()) talks to slave.c the way the TWI interrupt does
+ * in slave mode, or else to the register file, and drives the lines on
+ * PD0 and PD1 bit by bit for the bus monitor. A phase stretched past
+ * the timeout ends like the firmware's watchdog does, with the bus
+ * recovery and a STOP. */
+
+#include <avr/io.h>
+#include <util/twi.h>
+
+#include "Config/AppConfig.h"
+#include "clock.h"
+#include "pec.h"
+#include "slave.h"
+#include "stats.h"
+#include "twi.h"
+
+#include "sim.h"
+
+#define BUS_ARA             0x0c    /* SMBus Alert Response Address */
+/* How long the slave interrupt holds SCL low per byte */
+#define BUS_SLAVE_ISR       80
+
+enum {
+    BUS_IDLE,           /* no phase running */
+    BUS_ADDRESS,        /* START and address byte */
+    BUS_WRITE,          /* data byte to the slave */
+    BUS_READ,           /* data byte from the slave */
+    BUS_TIMEOUT         /* phase given up, recovering the bus */
+};
+
+volatile uint8_t twi_state = TWI_IDLE;
+
+sim_slave_t sim_slave = {
+    .address = 0x50,
+    .present = 1
+};
+uint64_t sim_bus_bytes;
+uint32_t sim_master_bit = F_CPU / 400000;
+uint64_t sim_bus_cycles;
+
+static uint8_t  twi_buf[TWI_BUFSIZE];
+static uint8_t  twi_head;
+static uint8_t  twi_tail;
+static uint8_t  twi_sla;
+static uint16_t twi_left;
+static uint8_t  twi_stalled;
+static uint8_t  twi_phase = BUS_IDLE;
+static uint8_t  twi_data;
+static uint64_t twi_until;      /* end of the running phase */
+static uint64_t twi_free;       /* end of the last STOP */
+static uint16_t twi_written;    /* bytes the slave took in this message */
+static uint8_t  twi_block;      /* block read, count byte pending */
+static uint8_t  twi_blockmax;
+static uint8_t  twi_extra;
+static uint8_t  twi_last;       /* the master NAKs the running read */
+static uint8_t  twi_crc;        /* slave side PEC of the transaction */
+static uint8_t  twi_wrote;      /* the transaction wrote data */
+static uint8_t  twi_stored;     /* the transaction wrote to mem */
+static uint8_t  twi_ara;        /* the message reads the ARA */
+static uint32_t twi_bit = 16 + 2 * 72;  /* SCL period, 100 kHz */
+static uint32_t twi_timeout = I2C_TIMEOUT_US * (F_CPU / 1000000);
+static uint32_t twi_probe;      /* timeout of probes, 0 none */
+static uint8_t  twi_target;     /* slave address, 0 master */
+static uint8_t  twi_passive;    /* off for the bus monitor */
+static uint8_t  bus_scl = 1;    /* lines of the other master */
+static uint8_t  bus_sda = 1;
+static uint8_t  bus_first;      /* its next byte selects the register */
+#if I2C_STATS
+static uint16_t twi_len;        /* bytes of the message */
+static uint8_t  twi_open;       /* transaction counted, no STOP yet */
+static uint32_t twi_begin;      /* clock_ticks () at its first START */
+#endif
+
+static void twi_schedule (const uint8_t phase, const uint64_t at,
+                          const uint32_t bits) {
+    uint32_t cycles = bits * twi_bit + sim_slave.stretch;
+    uint32_t timeout = twi_probe ? twi_probe : twi_timeout;
+
+    twi_phase  = phase;
+    /* The firmware allows the address phase plus the timeout */
+    if (cycles > 10 * twi_bit + timeout) {
+        cycles    = 10 * twi_bit + timeout;
+        twi_phase = BUS_TIMEOUT;
+    }
+    twi_until  = at + cycles;
+    sim_bus_cycles += cycles;
+}
+
+/* What the interrupt does after a phase: start the next byte or stall */
+static void twi_next (const uint64_t at) {
+    if (!twi_left) {
+        twi_state = TWI_HOLD;
+        return;
+    }
+    if (twi_sla & TW_READ) {
+        if ((uint8_t)(twi_head - twi_tail) == TWI_BUFSIZE) {
+            twi_stalled = 1;
+            return;
+        }
+        twi_left--;
+        twi_last = !twi_left && !twi_block;
+        twi_schedule (BUS_READ, at, 9);
+    } else {
+        if (twi_head == twi_tail) {
+            twi_stalled = 1;
+            return;
+        }
+        twi_data = twi_buf[twi_tail++ & (TWI_BUFSIZE - 1)];
+        twi_left--;
+        twi_schedule (BUS_WRITE, at, 9);
+    }
+}
+
+void sim_twi_step (void) {
+    uint8_t phase, data;
+
+    while (twi_phase != BUS_IDLE && twi_until <= sim_cycles) {
+        phase = twi_phase;
+        twi_phase = BUS_IDLE;
+        sim_bus_bytes++;
+        switch (phase) {
+        case BUS_ADDRESS:
+            twi_ara = twi_sla == ((BUS_ARA << 1) | TW_READ) &&
+                      sim_slave.present && sim_slave.alert;
+            if (twi_ara) {
+                twi_state = TWI_DATA;
+                break;
+            }
+            if (!sim_slave.present || (twi_sla >> 1) != sim_slave.address ||
+                twi_until < sim_slave.busy_until) {
+                twi_state = TWI_ADDR_NAK;
+                STATS_ADD (STATS_ADDR_NAKS, 1);
+                continue;
+            }
+            twi_state   = TWI_DATA;
+            twi_written = 0;
+            twi_crc     = pec_update (twi_crc, twi_sla);
+            break;
+        case BUS_WRITE:
+            if (sim_slave.nak_after && twi_written >= sim_slave.nak_after) {
+                twi_state = TWI_DATA_NAK;
+                STATS_ADD (STATS_DATA_NAKS, 1);
+                continue;
+            }
+            if (twi_written++) {
+                sim_slave.mem[sim_slave.ptr++] = twi_data;
+                twi_stored = 1;
+            } else
+                sim_slave.ptr = twi_data;
+            twi_crc   = pec_update (twi_crc, twi_data);
+            twi_wrote = 1;
+            break;
+        case BUS_READ:
+            if (twi_ara) {
+                /* Its address, which releases SMBALERT# */
+                data = sim_slave.address << 1;
+                sim_slave.alert = 0;
+            } else if (sim_slave.pec && twi_last)
+                data = twi_crc;
+            else
+                data = sim_slave.mem[sim_slave.ptr++];
+            twi_crc = pec_update (twi_crc, data);
+            twi_buf[twi_head++ & (TWI_BUFSIZE - 1)] = data;
+            if (twi_block) {
+                twi_block = 0;
+                twi_left  = (data && data <= twi_blockmax) ? data + twi_extra : 1;
+#if I2C_STATS
+                twi_len  += twi_left;
+#endif
+            }
+            break;
+        case BUS_TIMEOUT:
+            /* The slave never holds SDA, so the recovery is the STOP:
+             * four steps of 5 µs */
+            twi_free = twi_until + 4 * 5 * (F_CPU / 1000000);
+            sim_bus_cycles += twi_free - twi_until;
+            sim_bus_bytes--;
+            twi_state = TWI_TIMEOUT;
+            STATS_ADD (STATS_TIMEOUTS, 1);
+            continue;
+        }
+        twi_next (twi_until);
+    }
+}
+
+static void twi_resume (void) {
+    if (twi_stalled) {
+        twi_stalled = 0;
+        twi_next (sim_cycles);
+    }
+}
+
+/* The recovery is part of the timed out phase here */
+void twi_task (void) {
+}
+
+void twi_init (const uint8_t prescale, const uint8_t bitlength) {
+    TWSR = prescale;
+    TWBR = bitlength;
+    twi_bit     = 16 + 2 * bitlength * (1 << (2 * prescale));
+    twi_phase   = BUS_IDLE;
+    twi_state   = TWI_IDLE;
+    twi_stalled = 0;
+}
+
+#if I2C_STATS
+static void twi_account (const uint8_t stop) {
+    if (!twi_open)
+        return;
+    STATS_ADD ((twi_sla & TW_READ) ? STATS_READ_BYTES : STATS_WRITE_BYTES,
+               twi_len - twi_left);
+    twi_len = 0;
+    if (stop) {
+        STATS_TIME (STATS_BUS, clock_ticks () - twi_begin);
+        twi_open = 0;
+    }
+}
+#else
+#define twi_account(stop)       ((void)0)
+#endif
+
+void twi_slave (const uint8_t addr) {
+    twi_target = addr;
+    twi_state  = TWI_IDLE;
+}
+
+void twi_release (const uint8_t off) {
+    twi_passive = off;
+    twi_state   = TWI_IDLE;
+}
+
+uint8_t twi_master (void) {
+    return !twi_target && !twi_passive;
+}
+
+void twi_set_pullups (const uint8_t on) {
+    PORTD = (PORTD & ~(_BV(PD0) | _BV(PD1))) | (on ? _BV(PD0) | _BV(PD1) : 0);
+}
+/* Only in builds with the bus monitor */
+void INT0_vect (void) __attribute__ ((weak));
+void INT1_vect (void) __attribute__ ((weak));
+
+/* An edge on an external interrupt pin, taken as EICRA says: any change,
+ * falling or rising edge */
+static void bus_edge (const uint8_t n, const uint8_t level,
+                      void (*vect) (void)) {
+    uint8_t sense = (EICRA >> (2 * n)) & 3;
+
+    if ((EIMSK & _BV(n)) && vect && (sense == 1 || sense == (level ? 3 : 2)))
+        vect ();
+}
+
+/* Drives the lines of the other master and holds them for cycles */
+static void bus_lines (const uint8_t scl, const uint8_t sda,
+                       const uint32_t cycles) {
+    uint8_t was_scl = bus_scl, was_sda = bus_sda;
+
+    bus_scl = scl;
+    bus_sda = sda;
+    PIND = (PIND & ~(_BV(PD0) | _BV(PD1))) |
+           (scl ? _BV(PD0) : 0) | (sda ? _BV(PD1) : 0);
+    if (scl != was_scl)
+        bus_edge (INT0, scl, INT0_vect);
+    if (sda != was_sda)
+        bus_edge (INT1, sda, INT1_vect);
+    sim_advance (cycles);
+}
+
+/* One SCL period: SDA changes in the low half, SCL rises at its middle */
+static void bus_bit (const uint8_t bit) {
+    bus_lines (0, bus_sda, sim_master_bit / 4);
+    bus_lines (0, bit, sim_master_bit / 4);
+    bus_lines (1, bit, sim_master_bit / 2);
+}
+
+/* START, or a repeated START after a byte */
+static void bus_start (void) {
+    if (!bus_sda)
+        bus_bit (1);
+    bus_lines (1, 0, sim_master_bit / 2);
+}
+
+static void bus_stop (void) {
+    bus_bit (0);
+    bus_lines (1, 1, sim_master_bit / 2);
+}
+
+static void bus_byte (const uint8_t data) {
+    int8_t i;
+
+    for (i = 7; i >= 0; i--)
+        bus_bit ((data >> i) & 1);
+}
+
+/* The ninth clock. The TWI interrupt of slave mode holds SCL low before
+ * it. */
+static uint8_t bus_ack (const uint8_t ack) {
+    if (twi_target)
+        sim_advance (BUS_SLAVE_ISR);
+    bus_bit (!ack);
+    return ack;
+}
+
+/* The receiving end of a byte from the other master */
+static uint8_t bus_receive (const uint8_t data) {
+    if (twi_target)
+        return slave_receive (data);
+    if (bus_first)
+        sim_slave.ptr = data;
+    else
+        sim_slave.mem[sim_slave.ptr++] = data;
+    bus_first = 0;
+    return 1;
+}
+
+static uint8_t bus_transmit (void) {
+    return twi_target ? slave_transmit () : sim_slave.mem[sim_slave.ptr++];
+}
+
+/* A master elsewhere on the bus writes wlen bytes to addr and then, after
+ * a repeated START, reads rlen bytes. Returns the bytes moved, -1 if the
+ * address was not acknowledged. Slave mode answers it, or else the
+ * register file. The lines change bit by bit, so that the bus monitor
+ * can follow. */
+int sim_master_xfer (const uint8_t addr, const uint8_t *wbuf, const int wlen,
+                     uint8_t *rbuf, const int rlen) {
+    uint8_t target = twi_target ? addr == twi_target :
+                                  sim_slave.present && addr == sim_slave.address;
+    uint8_t ack = 1;
+    int i, moved = 0;
+
+    bus_start ();
+    if (wlen) {
+        bus_byte (addr << 1);
+        if (!bus_ack (target))
+            goto nak;
+        if (twi_target)
+            slave_begin (0);
+        bus_first = 1;
+        for (i = 0; i < wlen; i++) {
+            bus_byte (wbuf[i]);
+            /* Like the TWI, the receiver decided on this ACK with the
+             * byte before */
+            if (!bus_ack (ack))
+                break;
+            ack = bus_receive (wbuf[i]);
+            moved++;
+        }
+        if (rlen)
+            bus_start ();
+    }
+    if (rlen) {
+        bus_byte ((addr << 1) | 1);
+        if (!bus_ack (target))
+            goto nak;
+        if (twi_target)
+            slave_begin (1);
+        for (i = 0; i < rlen; i++) {
+            rbuf[i] = bus_transmit ();
+            bus_byte (rbuf[i]);
+            /* The master NAKs the last byte */
+            bus_ack (i < rlen - 1);
+            moved++;
+        }
+    }
+    bus_stop ();
+    return moved;
+nak:
+    bus_stop ();
+    return -1;
+}
+
+static void twi_go (const uint8_t sla, const uint16_t len) {
+    uint64_t at = sim_cycles > twi_free ? sim_cycles : twi_free;
+
+    if (!twi_master ()) {
+        twi_state = TWI_ERROR;
+        return;
+    }
+
+    /* A START after a STOP begins a new transaction */
+    if (twi_state == TWI_IDLE) {
+        twi_crc    = 0;
+        twi_wrote  = 0;
+        twi_stored = 0;
+    }
+#if I2C_STATS
+    if (twi_open) {
+        twi_account (0);
+    } else {
+        twi_open  = 1;
+        twi_begin = clock_ticks ();
+        STATS_ADD (STATS_TRANSACTIONS, 1);
+    }
+    twi_len     = len;
+#endif
+    twi_head    = 0;
+    twi_tail    = 0;
+    twi_sla     = sla;
+    twi_left    = len;
+    twi_stalled = 0;
+    twi_state   = TWI_ADDRESS;
+    /* START condition and the address byte */
+    twi_schedule (BUS_ADDRESS, at, 1 + 9);
+}
+
+uint16_t twi_set_timeout (const uint16_t us) {
+    uint16_t old = twi_timeout / (F_CPU / 1000000);
+
+    twi_timeout = (uint32_t)us * (F_CPU / 1000000);
+    return old;
+}
+
+void twi_set_probe_timeout (const uint16_t us) {
+    twi_probe = (uint32_t)us * (F_CPU / 1000000);
+}
+
+void twi_start (const uint8_t sla, const uint16_t len) {
+    twi_block = 0;
+    twi_go (sla, len);
+}
+
+void twi_start_block (const uint8_t sla, const uint8_t max,
+                      const uint8_t extra) {
+    twi_block    = 1;
+    twi_blockmax = max;
+    twi_extra    = extra;
+    twi_go (sla | TW_READ, 1);
+}
+
+void twi_stop (void) {
+    twi_account (1);
+    if (twi_state != TWI_IDLE && twi_state < TWI_ERROR) {
+        twi_free = sim_cycles + twi_bit;
+        sim_bus_cycles += twi_bit;
+        /* The PEC sent last makes the CRC of the whole transaction 0 */
+        if (sim_slave.pec && twi_wrote && twi_state == TWI_HOLD && twi_crc)
+            sim_slave.pec_errors++;
+        if (twi_stored)
+            sim_slave.busy_until = twi_free + sim_slave.write_cycle;
+    }
+    twi_phase   = BUS_IDLE;
+    twi_stalled = 0;
+    twi_state   = TWI_IDLE;
+}
+
+void twi_abort (void) {
+    twi_account (1);
+    twi_phase   = BUS_IDLE;
+    twi_stalled = 0;
+    twi_state   = TWI_IDLE;
+}
+
+uint8_t twi_room (void) {
+    return TWI_BUFSIZE - (uint8_t)(twi_head - twi_tail);
+}
+
+uint8_t twi_put (const uint8_t data) {
+    if ((uint8_t)(twi_head - twi_tail) == TWI_BUFSIZE)
+        return 0;
+    twi_buf[twi_head & (TWI_BUFSIZE - 1)] = data;
+    twi_head++;
+    twi_resume ();
+    return 1;
+}
+
+uint8_t twi_get (uint8_t *data) {
+    if (twi_head == twi_tail)
+        return 0;
+    *data = twi_buf[twi_tail & (TWI_BUFSIZE - 1)];
+    twi_tail++;
+    twi_resume ();
+    return 1;
+}
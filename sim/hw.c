@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* hw.c - simulated registers and time					     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* The registers are plain variables. Timer1 and Timer3 run: their
+ * counters follow the simulated time, and the Timer1 overflow and the
+ * Timer3 compare match interrupts are called as on the device. Busy waits and main loop
+ * iterations advance the time and let the simulated bus catch up. The
+ * slave's SMBALERT# drives its pin and the pin change interrupt. */
+
+#include <avr/io.h>
+#include <util/delay.h>
+
+#include "Config/AppConfig.h"
+
+#include "sim.h"
+
+#define SIM_REG(type, name)     volatile type name;
+
+SIM_REG (uint8_t, DDRB)  SIM_REG (uint8_t, PORTB)  SIM_REG (uint8_t, PINB)
+SIM_REG (uint8_t, DDRC)  SIM_REG (uint8_t, PORTC)  SIM_REG (uint8_t, PINC)
+SIM_REG (uint8_t, DDRD)  SIM_REG (uint8_t, PORTD)  SIM_REG (uint8_t, PIND)
+SIM_REG (uint8_t, DDRE)  SIM_REG (uint8_t, PORTE)  SIM_REG (uint8_t, PINE)
+SIM_REG (uint8_t, DDRF)  SIM_REG (uint8_t, PORTF)  SIM_REG (uint8_t, PINF)
+SIM_REG (uint8_t, TWCR)  SIM_REG (uint8_t, TWSR)   SIM_REG (uint8_t, TWBR)
+SIM_REG (uint8_t, TWDR)  SIM_REG (uint8_t, TWAR)   SIM_REG (uint8_t, TWAMR)
+SIM_REG (uint8_t, TCCR1A) SIM_REG (uint8_t, TCCR1B) SIM_REG (uint8_t, TCCR1C)
+SIM_REG (uint16_t, TCNT1) SIM_REG (uint16_t, OCR1A) SIM_REG (uint16_t, OCR1B)
+SIM_REG (uint16_t, OCR1C)
+SIM_REG (uint8_t, TIMSK1) SIM_REG (uint8_t, TIFR1)
+SIM_REG (uint8_t, TCCR3A) SIM_REG (uint8_t, TCCR3B)
+SIM_REG (uint16_t, TCNT3) SIM_REG (uint16_t, OCR3A)
+SIM_REG (uint8_t, TIMSK3) SIM_REG (uint8_t, TIFR3)
+SIM_REG (uint8_t, PCICR) SIM_REG (uint8_t, PCMSK0) SIM_REG (uint8_t, PCIFR)
+SIM_REG (uint8_t, EICRA) SIM_REG (uint8_t, EIMSK)  SIM_REG (uint8_t, EIFR)
+
+uint64_t sim_cycles;
+uint32_t sim_loop_cycles = 200;
+
+void TIMER1_OVF_vect (void);
+/* Only in builds with the alert engine */
+void PCINT0_vect (void) __attribute__ ((weak));
+
+static void sim_alert_pin (void) {
+    uint8_t pin = sim_slave.alert ? 0 : _BV(I2C_ALERT_BIT);
+
+    if ((I2C_ALERT_PIN & _BV(I2C_ALERT_BIT)) == pin)
+        return;
+    I2C_ALERT_PIN = (I2C_ALERT_PIN & ~_BV(I2C_ALERT_BIT)) | pin;
+    if ((PCICR & _BV(PCIE0)) && (PCMSK0 & _BV(I2C_ALERT_PCINT)) && PCINT0_vect)
+        PCINT0_vect ();
+}
+
+void sim_advance (const uint32_t cycles) {
+    uint32_t count;
+
+    sim_cycles += cycles;
+    if (TCCR3B & (_BV(CS30) | _BV(CS31) | _BV(CS32))) {
+        /* CTC mode on OCR3A without prescaler, the bit-banged bus */
+        count = (uint32_t)TCNT3 + cycles;
+        while (count > OCR3A) {
+            count -= (uint32_t)OCR3A + 1;
+            if (TIMSK3 & _BV(OCIE3A))
+                sim_swi_tick ();
+        }
+        TCNT3 = count;
+    }
+    if (TCCR1B & (_BV(CS10) | _BV(CS11) | _BV(CS12))) {
+        /* The firmware only runs Timer1 without prescaler */
+        count = (uint32_t)TCNT1 + cycles;
+        while (count > 0xffff) {
+            count -= 0x10000;
+            if (TIMSK1 & _BV(TOIE1))
+                TIMER1_OVF_vect ();
+        }
+        TCNT1 = count;
+    }
+    sim_twi_step ();
+    sim_alert_pin ();
+}
+
+void _delay_us (double us) {
+    sim_advance ((uint32_t)(us * (F_CPU / 1000000)));
+}
+
+void _delay_ms (double ms) {
+    sim_advance ((uint32_t)(ms * (F_CPU / 1000)));
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* LUFA/Common/Common.h - common LUFA definitions for the host simulation     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __sim_lufa_common_h_included__
+#define __sim_lufa_common_h_included__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#define ARCH_AVR8               0
+#define ARCH_UC3                1
+#define ARCH_XMEGA              2
+#ifndef ARCH
+#define ARCH                    ARCH_AVR8
+#endif
+
+#if defined(USE_LUFA_CONFIG_HEADER)
+#include "LUFAConfig.h"
+#endif
+
+#define ATTR_WARN_UNUSED_RESULT
+#define ATTR_NON_NULL_PTR_ARG(...)
+#define ATTR_ALWAYS_INLINE
+#define ATTR_CONST
+#define ATTR_PACKED             __attribute__((packed))
+
+#define MIN(x, y)               ((x) < (y) ? (x) : (y))
+#define MAX(x, y)               ((x) > (y) ? (x) : (y))
+
+#define le16_to_cpu(x)          (x)
+#define cpu_to_le16(x)          (x)
+
+typedef uint8_t uint_reg_t;
+
+static inline void GlobalInterruptEnable (void) { }
+static inline void GlobalInterruptDisable (void) { }
+static inline uint_reg_t GetGlobalInterruptMask (void) { return 0; }
+static inline void SetGlobalInterruptMask (const uint_reg_t mask) { (void) mask; }
+
+#endif
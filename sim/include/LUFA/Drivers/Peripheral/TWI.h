@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* LUFA/Drivers/Peripheral/TWI.h - TWI helper macros for the host simulation     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __sim_lufa_twi_h_included__
+#define __sim_lufa_twi_h_included__
+
+#include "../../Common/Common.h"
+
+/* Only the bit rate helpers; the firmware drives the TWI itself */
+#define TWI_BIT_PRESCALE_1      0
+#define TWI_BIT_PRESCALE_4      1
+#define TWI_BIT_PRESCALE_16     2
+#define TWI_BIT_PRESCALE_64     3
+
+#define TWI_BITLENGTH_FROM_FREQ(Prescale, Frequency) \
+    ((((F_CPU / (Prescale)) / (Frequency)) - 16) / 2)
+
+#endif
@@ -0,0 +1,226 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* LUFA/Drivers/USB/USB.h - USB device stack stand-in for the host simulation     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __sim_lufa_usb_h_included__
+#define __sim_lufa_usb_h_included__
+
+#include "../../Common/Common.h"
+
+/* The subset of the LUFA device API the firmware uses. The endpoints
+ * are emulated by sim/usb.c, which also plays the host side. */
+
+typedef struct {
+    uint8_t  bmRequestType;
+    uint8_t  bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+} ATTR_PACKED USB_Request_Header_t;
+
+extern USB_Request_Header_t USB_ControlRequest;
+extern volatile uint8_t USB_DeviceState;
+
+enum USB_Device_States_t {
+    DEVICE_STATE_Unattached,
+    DEVICE_STATE_Powered,
+    DEVICE_STATE_Default,
+    DEVICE_STATE_Addressed,
+    DEVICE_STATE_Configured,
+    DEVICE_STATE_Suspended
+};
+
+#define CONTROL_REQTYPE_DIRECTION       0x80
+#define CONTROL_REQTYPE_TYPE            0x60
+#define CONTROL_REQTYPE_RECIPIENT       0x1f
+#define REQDIR_HOSTTODEVICE             (0 << 7)
+#define REQDIR_DEVICETOHOST             (1 << 7)
+#define REQTYPE_STANDARD                (0 << 5)
+#define REQTYPE_CLASS                   (1 << 5)
+#define REQTYPE_VENDOR                  (2 << 5)
+#define REQREC_DEVICE                   (0 << 0)
+#define REQREC_INTERFACE                (1 << 0)
+#define REQREC_ENDPOINT                 (2 << 0)
+#define REQREC_OTHER                    (3 << 0)
+
+enum USB_Control_Request_t {
+    REQ_GetStatus           = 0,
+    REQ_ClearFeature        = 1,
+    REQ_SetFeature          = 3,
+    REQ_SetAddress          = 5,
+    REQ_GetDescriptor       = 6,
+    REQ_SetDescriptor       = 7,
+    REQ_GetConfiguration    = 8,
+    REQ_SetConfiguration    = 9,
+    REQ_GetInterface        = 10,
+    REQ_SetInterface        = 11,
+    REQ_SynchFrame          = 12
+};
+
+#define ENDPOINT_DIR_MASK               0x80
+#define ENDPOINT_DIR_IN                 0x80
+#define ENDPOINT_DIR_OUT                0x00
+#define ENDPOINT_EPNUM_MASK             0x0f
+#define ENDPOINT_CONTROLEP              0
+#define ENDPOINT_TOTAL_ENDPOINTS        7
+
+#define EP_TYPE_CONTROL                 0x00
+#define EP_TYPE_ISOCHRONOUS             0x01
+#define EP_TYPE_BULK                    0x02
+#define EP_TYPE_INTERRUPT               0x03
+
+#define ENDPOINT_ATTR_NO_SYNC           (0 << 2)
+#define ENDPOINT_USAGE_DATA             (0 << 4)
+
+#define NO_DESCRIPTOR                   0
+#define USE_INTERNAL_SERIAL             0xdc
+#define LANGUAGE_ID_ENG                 0x0409
+#define USB_CONFIG_ATTR_RESERVED        0x80
+#define USB_CONFIG_ATTR_SELFPOWERED     0x40
+#define USB_CONFIG_POWER_MA(mA)         ((mA) >> 1)
+#define VERSION_BCD(Major, Minor, Revision) \
+    (((Major & 0xff) << 8) | ((Minor & 0x0f) << 4) | (Revision & 0x0f))
+#define USB_CSCP_VendorSpecificClass    0xff
+#define USB_CSCP_NoDeviceClass          0x00
+#define USB_CSCP_NoDeviceSubclass       0x00
+#define USB_CSCP_NoDeviceProtocol       0x00
+
+enum USB_DescriptorTypes_t {
+    DTYPE_Device            = 0x01,
+    DTYPE_Configuration     = 0x02,
+    DTYPE_String            = 0x03,
+    DTYPE_Interface         = 0x04,
+    DTYPE_Endpoint          = 0x05
+};
+
+typedef struct {
+    uint8_t Size;
+    uint8_t Type;
+} ATTR_PACKED USB_Descriptor_Header_t;
+
+typedef struct {
+    USB_Descriptor_Header_t Header;
+    uint16_t USBSpecification;
+    uint8_t  Class;
+    uint8_t  SubClass;
+    uint8_t  Protocol;
+    uint8_t  Endpoint0Size;
+    uint16_t VendorID;
+    uint16_t ProductID;
+    uint16_t ReleaseNumber;
+    uint8_t  ManufacturerStrIndex;
+    uint8_t  ProductStrIndex;
+    uint8_t  SerialNumStrIndex;
+    uint8_t  NumberOfConfigurations;
+} ATTR_PACKED USB_Descriptor_Device_t;
+
+typedef struct {
+    USB_Descriptor_Header_t Header;
+    uint16_t TotalConfigurationSize;
+    uint8_t  TotalInterfaces;
+    uint8_t  ConfigurationNumber;
+    uint8_t  ConfigurationStrIndex;
+    uint8_t  ConfigAttributes;
+    uint8_t  MaxPowerConsumption;
+} ATTR_PACKED USB_Descriptor_Configuration_Header_t;
+
+typedef struct {
+    USB_Descriptor_Header_t Header;
+    uint8_t InterfaceNumber;
+    uint8_t AlternateSetting;
+    uint8_t TotalEndpoints;
+    uint8_t Class;
+    uint8_t SubClass;
+    uint8_t Protocol;
+    uint8_t InterfaceStrIndex;
+} ATTR_PACKED USB_Descriptor_Interface_t;
+
+typedef struct {
+    USB_Descriptor_Header_t Header;
+    uint8_t  EndpointAddress;
+    uint8_t  Attributes;
+    uint16_t EndpointSize;
+    uint8_t  PollingIntervalMS;
+} ATTR_PACKED USB_Descriptor_Endpoint_t;
+
+typedef struct {
+    USB_Descriptor_Header_t Header;
+    uint16_t UnicodeString[];
+} ATTR_PACKED USB_Descriptor_String_t;
+
+#define USB_STRING_LEN(UnicodeChars) \
+    (sizeof(USB_Descriptor_Header_t) + ((UnicodeChars) << 1))
+#define USB_STRING_DESCRIPTOR(String) \
+    { .Header = { .Size = sizeof(USB_Descriptor_Header_t) + (sizeof(String) - 2), \
+                  .Type = DTYPE_String }, .UnicodeString = String }
+#define USB_STRING_DESCRIPTOR_ARRAY(...) \
+    { .Header = { .Size = sizeof(USB_Descriptor_Header_t) + sizeof((uint16_t[]){__VA_ARGS__}), \
+                  .Type = DTYPE_String }, .UnicodeString = {__VA_ARGS__} }
+
+/* Device management */
+void     USB_Init (void);
+void     USB_USBTask (void);
+uint16_t USB_Device_GetFrameNumber (void);
+void     USB_Device_EnableSOFEvents (void);
+void     USB_Device_DisableSOFEvents (void);
+
+/* Endpoint management */
+bool     Endpoint_ConfigureEndpoint (const uint8_t Address, const uint8_t Type,
+                                     const uint16_t Size, const uint8_t Banks);
+void     Endpoint_SelectEndpoint (const uint8_t Address);
+uint8_t  Endpoint_GetCurrentEndpoint (void);
+void     Endpoint_ResetEndpoint (const uint8_t Address);
+bool     Endpoint_IsConfigured (void);
+void     Endpoint_SetEndpointDirection (const uint8_t DirectionMask);
+uint16_t Endpoint_BytesInEndpoint (void);
+bool     Endpoint_IsReadWriteAllowed (void);
+bool     Endpoint_IsSETUPReceived (void);
+bool     Endpoint_IsINReady (void);
+bool     Endpoint_IsOUTReceived (void);
+void     Endpoint_ClearSETUP (void);
+void     Endpoint_ClearIN (void);
+void     Endpoint_ClearOUT (void);
+void     Endpoint_ClearStatusStage (void);
+void     Endpoint_StallTransaction (void);
+void     Endpoint_ClearStall (void);
+bool     Endpoint_IsStalled (void);
+void     Endpoint_ResetDataToggle (void);
+
+uint8_t  Endpoint_Read_8 (void);
+uint16_t Endpoint_Read_16_LE (void);
+uint32_t Endpoint_Read_32_LE (void);
+void     Endpoint_Write_8 (const uint8_t Data);
+void     Endpoint_Write_16_LE (const uint16_t Data);
+void     Endpoint_Write_32_LE (const uint32_t Data);
+
+uint8_t  Endpoint_Write_Control_Stream_LE (const void *const Buffer, uint16_t Length);
+uint8_t  Endpoint_Write_Control_PStream_LE (const void *const Buffer, uint16_t Length);
+uint8_t  Endpoint_Read_Control_Stream_LE (void *const Buffer, uint16_t Length);
+
+/* Application callbacks */
+void     EVENT_USB_Device_Connect (void);
+void     EVENT_USB_Device_Disconnect (void);
+void     EVENT_USB_Device_ConfigurationChanged (void);
+void     EVENT_USB_Device_ControlRequest (void);
+void     EVENT_USB_Device_StartOfFrame (void);
+
+#endif
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* avr/eeprom.h - EEPROM access stand-ins for the host simulation	     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __sim_avr_eeprom_h_included__
+#define __sim_avr_eeprom_h_included__
+
+#include <stdint.h>
+#include <string.h>
+
+/* EEMEM variables are plain variables, which keep their contents for
+ * the run of the simulation */
+#define EEMEM
+
+static inline uint8_t eeprom_read_byte (const uint8_t *addr) {
+    return *addr;
+}
+
+static inline void eeprom_update_byte (uint8_t *addr, const uint8_t value) {
+    *addr = value;
+}
+
+static inline void eeprom_read_block (void *dst, const void *src,
+                                      const size_t len) {
+    memcpy (dst, src, len);
+}
+
+static inline void eeprom_update_block (const void *src, void *dst,
+                                        const size_t len) {
+    memcpy (dst, src, len);
+}
+
+#endif
@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* avr/io.h - register stand-ins for the host simulation		     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __sim_avr_io_h_included__
+#define __sim_avr_io_h_included__
+
+#include <stdint.h>
+
+#define _BV(bit)        (1 << (bit))
+
+/* Plain variables, defined in sim/hw.c. Registers with side effects on
+ * the real hardware (the TWI, the timers) are either not used by the
+ * firmware modules built here or emulated by the simulation. */
+#define SIM_REG8(name)  extern volatile uint8_t name;
+#define SIM_REG16(name) extern volatile uint16_t name;
+
+SIM_REG8 (DDRB)  SIM_REG8 (PORTB)  SIM_REG8 (PINB)
+SIM_REG8 (DDRC)  SIM_REG8 (PORTC)  SIM_REG8 (PINC)
+SIM_REG8 (DDRD)  SIM_REG8 (PORTD)  SIM_REG8 (PIND)
+SIM_REG8 (DDRE)  SIM_REG8 (PORTE)  SIM_REG8 (PINE)
+SIM_REG8 (DDRF)  SIM_REG8 (PORTF)  SIM_REG8 (PINF)
+SIM_REG8 (TWCR)  SIM_REG8 (TWSR)   SIM_REG8 (TWBR)  SIM_REG8 (TWDR)
+SIM_REG8 (TWAR)  SIM_REG8 (TWAMR)
+SIM_REG8 (TCCR1A) SIM_REG8 (TCCR1B) SIM_REG8 (TCCR1C)
+SIM_REG16 (TCNT1) SIM_REG16 (OCR1A) SIM_REG16 (OCR1B) SIM_REG16 (OCR1C)
+SIM_REG8 (TIMSK1) SIM_REG8 (TIFR1)
+SIM_REG8 (TCCR3A) SIM_REG8 (TCCR3B)
+SIM_REG16 (TCNT3) SIM_REG16 (OCR3A)
+SIM_REG8 (TIMSK3) SIM_REG8 (TIFR3)
+SIM_REG8 (PCICR) SIM_REG8 (PCMSK0) SIM_REG8 (PCIFR)
+SIM_REG8 (EICRA) SIM_REG8 (EIMSK)  SIM_REG8 (EIFR)
+
+/* TWI */
+#define TWINT   7
+#define TWEA    6
+#define TWSTA   5
+#define TWSTO   4
+#define TWWC    3
+#define TWEN    2
+#define TWIE    0
+#define TWPS1   1
+#define TWPS0   0
+#define TWGCE   0
+
+/* Timer 1 and 3 */
+#define CS10    0
+#define CS11    1
+#define CS12    2
+#define WGM12   3
+#define TOIE1   0
+#define OCIE1A  1
+#define OCIE1B  2
+#define TOV1    0
+#define OCF1A   1
+#define OCF1B   2
+#define CS30    0
+#define CS31    1
+#define CS32    2
+#define WGM32   3
+#define OCIE3A  1
+#define OCF3A   1
+
+/* Port pins */
+#define PB0     0
+#define PB1     1
+#define PB2     2
+#define PB3     3
+#define PB4     4
+#define PB5     5
+#define PB6     6
+#define PB7     7
+#define PD0     0
+#define PD1     1
+
+/* Pin change and external interrupts */
+#define PCIE0   0
+#define PCINT4  4
+#define PCIF0   0
+#define ISC00   0
+#define ISC01   1
+#define ISC10   2
+#define ISC11   3
+#define INT0    0
+#define INT1    1
+#define INTF0   0
+#define INTF1   1
+
+#endif
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* util/atomic.h - atomic block stand-ins for the host simulation	     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __sim_util_atomic_h_included__
+#define __sim_util_atomic_h_included__
+
+/* Interrupts only ever run between main loop iterations in the
+ * simulation, so every block is atomic already */
+#define ATOMIC_BLOCK(type)      for (int __atomic_once = 1; __atomic_once; __atomic_once = 0)
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+
+#endif
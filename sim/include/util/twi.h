@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* util/twi.h - TWI status codes for the host simulation		     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __sim_util_twi_h_included__
+#define __sim_util_twi_h_included__
+
+#include <avr/io.h>
+
+#define TW_START                0x08
+#define TW_REP_START            0x10
+#define TW_MT_SLA_ACK           0x18
+#define TW_MT_SLA_NACK          0x20
+#define TW_MT_DATA_ACK          0x28
+#define TW_MT_DATA_NACK         0x30
+#define TW_MT_ARB_LOST          0x38
+#define TW_MR_ARB_LOST          0x38
+#define TW_MR_SLA_ACK           0x40
+#define TW_MR_SLA_NACK          0x48
+#define TW_MR_DATA_ACK          0x50
+#define TW_MR_DATA_NACK         0x58
+#define TW_BUS_ERROR            0x00
+#define TW_STATUS_MASK          0xf8
+#define TW_STATUS               (TWSR & TW_STATUS_MASK)
+#define TW_READ                 1
+#define TW_WRITE                0
+
+#endif
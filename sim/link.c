@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* link.c - host library transport into the simulated firmware		     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Lets the host library and its tools run against the simulation. The
+ * transfers in flight are carried out in submission order by
+ * i2cmega_handle_events (), through the same host side as the benchmark.
+ * The host's per transfer latency (I2CMEGA_SIM_LATENCY in µs, 250 by
+ * default) counts from the hand-off to the transport, so a transfer
+ * handed over while others were in flight starts right after them, like
+ * one queued at the host controller. Time is the simulated time. */
+
+#include <stdlib.h>
+
+#include "LUFA/Drivers/USB/USB.h"
+#include "Descriptors.h"
+
+#include "host/i2cmega.h"
+
+#include "sim.h"
+
+#define LINK_LATENCY_US     250
+
+#define USB_VENDOR_IN       (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_DEVICE)
+#define USB_VENDOR_OUT      (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR | REQREC_DEVICE)
+
+typedef struct {
+    i2cmega_xfer_t *head;           /* in flight, oldest first */
+    i2cmega_xfer_t *tail;
+    uint32_t        latency;        /* in cycles */
+} link_t;
+
+int i2cmega_transport_open (i2cmega_dev_t *dev) {
+    link_t *link = calloc (1, sizeof (*link));
+    const char *env = getenv ("I2CMEGA_SIM_LATENCY");
+    int i;
+
+    if (!link)
+        return I2CMEGA_ERR_IO;
+    link->latency = (env ? atoi (env) : LINK_LATENCY_US) * (F_CPU / 1000000);
+    for (i = 0; i < 256; i++)
+        sim_slave.mem[i] = i ^ 0xa5;
+    sim_usb_latency = 0;
+    sim_boot ();
+    dev->priv = link;
+    return 0;
+}
+
+void i2cmega_transport_close (i2cmega_dev_t *dev) {
+    free (dev->priv);
+}
+
+uint64_t i2cmega_transport_now (i2cmega_dev_t *dev) {
+    (void)dev;
+    return sim_cycles * 1000 / (F_CPU / 1000000);
+}
+
+int i2cmega_transport_submit (i2cmega_dev_t *dev, i2cmega_xfer_t *xfer) {
+    link_t *link = dev->priv;
+
+    xfer->priv = NULL;
+    if (link->tail)
+        link->tail->priv = xfer;
+    else
+        link->head = xfer;
+    link->tail = xfer;
+    return 0;
+}
+
+static int link_result (const int ret) {
+    return ret < 0 ? I2CMEGA_ERR_STALL : ret;
+}
+
+/* Runs the oldest transfer in flight */
+static void link_run (link_t *link) {
+    i2cmega_xfer_t *xfer = link->head;
+    uint64_t start = xfer->started * (F_CPU / 1000000) / 1000 + link->latency;
+    int ret;
+
+    link->head = xfer->priv;
+    if (!link->head)
+        link->tail = NULL;
+    xfer->priv = NULL;
+    while (sim_cycles < start)
+        sim_loop ();
+    switch (xfer->type) {
+    case I2CMEGA_CONTROL_IN:
+    case I2CMEGA_CONTROL_OUT:
+        ret = sim_control (xfer->type == I2CMEGA_CONTROL_IN ? USB_VENDOR_IN
+                                                            : USB_VENDOR_OUT,
+                          xfer->request, xfer->value, xfer->index,
+                          xfer->buf, xfer->length);
+        break;
+    default:
+        if (xfer->endpoint & ENDPOINT_DIR_IN)
+            ret = sim_bulk_in (xfer->endpoint, xfer->buf, xfer->length);
+        else
+            ret = sim_bulk_out (xfer->endpoint, xfer->buf, xfer->length);
+        break;
+    }
+    i2cmega_complete (xfer, link_result (ret));
+}
+
+/* Completes the transfers in flight, at least one if there is one */
+int i2cmega_transport_events (i2cmega_dev_t *dev, const int timeout_ms) {
+    link_t *link = dev->priv;
+    uint64_t until = sim_cycles + (uint64_t)timeout_ms * (F_CPU / 1000);
+
+    if (!link->head)
+        return 0;
+    do {
+        link_run (link);
+    } while (link->head && sim_cycles < until);
+    return 0;
+}
+
+int i2cmega_transport_altsetting (i2cmega_dev_t *dev, const uint8_t alt) {
+    (void)dev;
+    return sim_control (REQDIR_HOSTTODEVICE | REQTYPE_STANDARD | REQREC_INTERFACE,
+                        REQ_SetInterface, alt, 0, NULL, 0) < 0 ? I2CMEGA_ERR_STALL : 0;
+}
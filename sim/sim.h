@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* sim.h - host simulation of the firmware				     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __sim_h_included__
+#define __sim_h_included__
+
+#include <stdint.h>
+
+/* Simulated time in CPU cycles (F_CPU) since the reset */
+extern uint64_t sim_cycles;
+/* Cycles a main loop iteration is assumed to take */
+extern uint32_t sim_loop_cycles;
+/* Main loop iterations run so far */
+extern uint64_t sim_iterations;
+
+void     sim_advance (const uint32_t cycles);
+
+/* USB host side, usb.c. Transfers return the number of bytes moved or
+ * -1 on a stall or when the firmware does not finish the transfer
+ * within sim_timeout main loop iterations. */
+extern uint32_t sim_timeout;
+/* Cycles between two transfers of the host */
+extern uint32_t sim_usb_latency;
+
+void     sim_boot (void);
+void     sim_loop (void);
+int      sim_control (const uint8_t type, const uint8_t request,
+                      const uint16_t value, const uint16_t index,
+                      void *data, const uint16_t length);
+int      sim_bulk_out (const uint8_t epaddr, const void *data,
+                       const uint16_t length);
+int      sim_bulk_in (const uint8_t epaddr, void *data,
+                      const uint16_t length);
+
+/* Simulated bus and slave, bus.c */
+typedef struct {
+    uint8_t  address;       /* 7 bit slave address */
+    uint8_t  present;       /* acknowledges its address */
+    uint16_t nak_after;     /* NAKs written bytes after this many, 0 never */
+    uint32_t stretch;       /* clock stretching per byte in cycles */
+    uint8_t  mem[256];      /* register file, first written byte selects */
+    uint8_t  ptr;
+    uint8_t  pec;           /* sends and checks the SMBus PEC */
+    uint32_t pec_errors;    /* transactions written with a wrong PEC */
+    uint32_t write_cycle;   /* NAKs its address this long after a STOP
+                               that ended a write of data, 0 never */
+    uint64_t busy_until;    /* end of the write cycle */
+    uint8_t  alert;         /* holds SMBALERT# low until it has sent its
+                               address to the Alert Response Address */
+} sim_slave_t;
+
+extern sim_slave_t sim_slave;
+extern uint64_t    sim_bus_bytes;   /* bytes moved on the bus */
+extern uint64_t    sim_bus_cycles;  /* cycles the bus was busy */
+extern uint32_t    sim_master_bit;  /* SCL period of the other master */
+
+void     sim_twi_step (void);
+int      sim_master_xfer (const uint8_t addr, const uint8_t *wbuf,
+                          const int wlen, uint8_t *rbuf, const int rlen);
+
+/* Slave on the bit-banged second bus, swbus.c */
+extern sim_slave_t sim_swi_slave;
+
+void     sim_swi_tick (void);
+
+#endif
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* swbus.c - simulated slave on the bit-banged bus			     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* The second bus runs the real swi.c, so unlike bus.c this works at the
+ * pin level: hw.c calls sim_swi_tick () for every Timer3 compare match,
+ * and the slave here watches the SCL and SDA levels the firmware leaves
+ * on the port between two interrupts, as open drain lines with pull-ups.
+ * It acknowledges its address, takes written bytes with a write pointer
+ * like the slave in bus.c and shifts out register bytes on reads. No
+ * clock stretching and no PEC. */
+
+#include <avr/io.h>
+
+#include "Config/AppConfig.h"
+
+#include "sim.h"
+
+sim_slave_t sim_swi_slave = {
+    .address = 0x50,
+    .present = 1
+};
+
+#define SW_SCL          _BV(I2C_SWI_SCL)
+#define SW_SDA          _BV(I2C_SWI_SDA)
+
+static struct {
+    uint8_t  scl, sda;      /* line levels after the last step */
+    uint8_t  drive;         /* slave pulls SDA low */
+    uint8_t  active;        /* addressed, or the address is coming */
+    uint8_t  address;       /* the byte is the address */
+    uint8_t  tx;            /* slave sends */
+    uint8_t  ack;           /* in the ACK clock */
+    uint8_t  nak;           /* master NAKed the byte sent */
+    uint8_t  bit;           /* bits of the byte so far */
+    uint8_t  byte;
+    uint16_t written;       /* bytes taken in this message */
+} sw = { .scl = 1, .sda = 1 };
+
+void TIMER3_COMPA_vect (void);
+
+static void sw_rising (const uint8_t sda) {
+    if (sw.ack) {
+        if (sw.tx)
+            sw.nak = sda;
+        return;
+    }
+    if (!sw.tx)
+        sw.byte = (sw.byte << 1) | sda;
+    sw.bit++;
+}
+
+static void sw_falling (void) {
+    sim_slave_t *s = &sim_swi_slave;
+
+    if (sw.ack) {
+        /* The ACK clock is over */
+        sw.ack   = 0;
+        sw.bit   = 0;
+        sw.drive = 0;
+        if (sw.tx && !sw.nak) {
+            sw.byte  = s->mem[s->ptr++];
+            sw.drive = !(sw.byte & 0x80);
+        } else if (sw.tx) {
+            sw.active = 0;
+        }
+        return;
+    }
+    if (sw.bit < 8) {
+        if (sw.tx)
+            sw.drive = !(sw.byte & (0x80 >> sw.bit));
+        return;
+    }
+    /* Eight bits done, the ACK clock follows */
+    sw.ack   = 1;
+    sw.drive = 0;
+    if (sw.address) {
+        sw.address = 0;
+        if (!s->present || (sw.byte >> 1) != s->address) {
+            sw.active = 0;
+            sw.ack    = 0;
+            return;
+        }
+        sw.tx      = sw.byte & 1;
+        sw.nak     = 0;
+        sw.written = 0;
+        sw.drive   = 1;
+    } else if (!sw.tx) {
+        if (s->nak_after && sw.written >= s->nak_after)
+            return;
+        if (sw.written++)
+            s->mem[s->ptr++] = sw.byte;
+        else
+            s->ptr = sw.byte;
+        sw.drive = 1;
+    }
+}
+
+/* Lets the slave react to the levels the firmware left and updates the
+ * input register */
+static void sw_update (void) {
+    uint8_t scl, sda;
+
+    scl = !((DDRB & SW_SCL) && !(PORTB & SW_SCL));
+    sda = !((DDRB & SW_SDA) && !(PORTB & SW_SDA)) && !sw.drive;
+    if (sw.scl && scl && sw.sda != sda) {
+        /* SDA changing while SCL is high is a START or a STOP */
+        sw.active  = !sda;
+        sw.address = !sda;
+        sw.tx      = 0;
+        sw.ack     = 0;
+        sw.bit     = 0;
+        sw.drive   = 0;
+    } else if (sw.active && !sw.scl && scl) {
+        sw_rising (sda);
+    } else if (sw.active && sw.scl && !scl) {
+        sw_falling ();
+    }
+    sda = !((DDRB & SW_SDA) && !(PORTB & SW_SDA)) && !sw.drive;
+    sw.scl = scl;
+    sw.sda = sda;
+    PINB = (PINB & ~(SW_SCL | SW_SDA)) | (scl ? SW_SCL : 0) | (sda ? SW_SDA : 0);
+}
+
+void sim_swi_tick (void) {
+    sim_bus_cycles += (uint32_t)OCR3A + 1;
+    sw_update ();
+    TIMER3_COMPA_vect ();
+    sw_update ();
+}
@@ -0,0 +1,523 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* usb.c - simulated USB controller and host				     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* The firmware's main () runs as a coroutine that yields in every
+ * USB_USBTask () call, so one sim_loop () is one main loop iteration.
+ * Control requests call EVENT_USB_Device_ControlRequest () between two
+ * iterations like the USB interrupt does. The host side is always
+ * listening on the control endpoint, bulk IN packets are only picked
+ * up while the host waits in sim_bulk_in (). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include "LUFA/Drivers/USB/USB.h"
+
+#include "sim.h"
+
+#define SIM_EP_BANKS    2
+#define SIM_EP_MAXSIZE  64
+#define SIM_STACKSIZE   (256 * 1024)
+
+typedef struct {
+    uint8_t  dir;
+    uint8_t  banks;
+    uint16_t size;
+    uint8_t  stalled;
+    uint8_t  fill[SIM_EP_MAXSIZE];          /* IN packet being written */
+    uint16_t count;
+    uint8_t  data[SIM_EP_BANKS][SIM_EP_MAXSIZE];   /* full banks */
+    uint16_t len[SIM_EP_BANKS];
+    uint8_t  head;
+    uint8_t  queued;
+    uint16_t pos;                           /* OUT read position */
+} sim_ep_t;
+
+enum {
+    CTL_IDLE,
+    CTL_DATA,
+    CTL_STATUS,
+    CTL_DONE,
+    CTL_STALL
+};
+
+USB_Request_Header_t USB_ControlRequest;
+volatile uint8_t     USB_DeviceState;
+
+uint32_t sim_timeout = 100000;
+uint32_t sim_usb_latency;
+uint64_t sim_iterations;
+
+static sim_ep_t   sim_ep[ENDPOINT_TOTAL_ENDPOINTS];
+static sim_ep_t   sim_ep0_out;
+static uint8_t    sim_ep0_dir;
+static uint8_t    sim_cur;
+static uint8_t    sim_setup;
+
+static uint8_t    ctl_stage;
+static uint8_t   *ctl_data;
+static uint16_t   ctl_length;
+static uint16_t   ctl_done;     /* data stage bytes moved */
+static uint16_t   ctl_loaded;   /* OUT data stage bytes handed over */
+
+static ucontext_t sim_host_ctx;
+static ucontext_t sim_fw_ctx;
+static uint8_t    sim_fw_stack[SIM_STACKSIZE];
+
+int firmware_main (void);
+
+/* Endpoint queues */
+
+static void ep_reset (sim_ep_t *ep) {
+    ep->count   = 0;
+    ep->head    = 0;
+    ep->queued  = 0;
+    ep->pos     = 0;
+    ep->stalled = 0;
+}
+
+static void ep_push (sim_ep_t *ep, const uint8_t *data, const uint16_t len) {
+    uint8_t bank = (ep->head + ep->queued) % SIM_EP_BANKS;
+
+    memcpy (ep->data[bank], data, len);
+    ep->len[bank] = len;
+    ep->queued++;
+}
+
+static void ep_pop (sim_ep_t *ep) {
+    ep->head = (ep->head + 1) % SIM_EP_BANKS;
+    ep->queued--;
+    ep->pos = 0;
+}
+
+static sim_ep_t *ep_current (void) {
+    if (sim_cur == ENDPOINT_CONTROLEP && sim_ep0_dir == ENDPOINT_DIR_OUT)
+        return &sim_ep0_out;
+    return &sim_ep[sim_cur];
+}
+
+static uint8_t ep_is_in (void) {
+    if (sim_cur == ENDPOINT_CONTROLEP)
+        return sim_ep0_dir == ENDPOINT_DIR_IN;
+    return sim_ep[sim_cur].dir == ENDPOINT_DIR_IN;
+}
+
+/* Hands the next packet of an OUT data stage to the control endpoint */
+static void ctl_load (void) {
+    uint16_t len = MIN (ctl_length - ctl_loaded, FIXED_CONTROL_ENDPOINT_SIZE);
+
+    ep_push (&sim_ep0_out, ctl_data + ctl_loaded, len);
+    ctl_loaded += len;
+}
+
+/* Device management */
+
+void USB_Init (void) {
+    USB_DeviceState = DEVICE_STATE_Powered;
+}
+
+void USB_USBTask (void) {
+    swapcontext (&sim_fw_ctx, &sim_host_ctx);
+}
+
+uint16_t USB_Device_GetFrameNumber (void) {
+    return (sim_cycles / (F_CPU / 1000)) & 0x7ff;
+}
+
+void USB_Device_EnableSOFEvents (void) { }
+void USB_Device_DisableSOFEvents (void) { }
+
+/* Endpoint management */
+
+bool Endpoint_ConfigureEndpoint (const uint8_t Address, const uint8_t Type,
+                                 const uint16_t Size, const uint8_t Banks) {
+    sim_ep_t *ep = &sim_ep[Address & ENDPOINT_EPNUM_MASK];
+
+    (void) Type;
+    if (Size > SIM_EP_MAXSIZE || Banks > SIM_EP_BANKS)
+        return false;
+    ep->dir   = Address & ENDPOINT_DIR_MASK;
+    ep->size  = Size;
+    ep->banks = Banks;
+    ep_reset (ep);
+    return true;
+}
+
+void Endpoint_SelectEndpoint (const uint8_t Address) {
+    sim_cur = Address & ENDPOINT_EPNUM_MASK;
+}
+
+uint8_t Endpoint_GetCurrentEndpoint (void) {
+    if (sim_cur == ENDPOINT_CONTROLEP)
+        return sim_ep0_dir;
+    return sim_cur | sim_ep[sim_cur].dir;
+}
+
+void Endpoint_ResetEndpoint (const uint8_t Address) {
+    sim_ep_t *ep = &sim_ep[Address & ENDPOINT_EPNUM_MASK];
+    uint8_t stalled = ep->stalled;
+
+    ep_reset (ep);
+    ep->stalled = stalled;
+}
+
+bool Endpoint_IsConfigured (void) {
+    return sim_ep[sim_cur].size != 0;
+}
+
+void Endpoint_SetEndpointDirection (const uint8_t DirectionMask) {
+    if (sim_cur == ENDPOINT_CONTROLEP)
+        sim_ep0_dir = DirectionMask;
+}
+
+uint16_t Endpoint_BytesInEndpoint (void) {
+    sim_ep_t *ep = ep_current ();
+
+    if (ep_is_in ())
+        return ep->count;
+    if (!ep->queued)
+        return 0;
+    return ep->len[ep->head] - ep->pos;
+}
+
+bool Endpoint_IsReadWriteAllowed (void) {
+    sim_ep_t *ep = ep_current ();
+
+    if (ep_is_in ())
+        return ep->count < ep->size;
+    return ep->queued && ep->pos < ep->len[ep->head];
+}
+
+bool Endpoint_IsSETUPReceived (void) {
+    return sim_cur == ENDPOINT_CONTROLEP && sim_setup;
+}
+
+bool Endpoint_IsINReady (void) {
+    /* The host collects control IN packets right away */
+    if (sim_cur == ENDPOINT_CONTROLEP)
+        return true;
+    return sim_ep[sim_cur].queued < sim_ep[sim_cur].banks;
+}
+
+bool Endpoint_IsOUTReceived (void) {
+    if (sim_cur == ENDPOINT_CONTROLEP)
+        return sim_ep0_out.queued != 0;
+    return sim_ep[sim_cur].queued != 0;
+}
+
+void Endpoint_ClearSETUP (void) {
+    sim_setup = 0;
+}
+
+void Endpoint_ClearIN (void) {
+    sim_ep_t *ep = &sim_ep[sim_cur];
+    uint16_t len;
+
+    if (sim_cur != ENDPOINT_CONTROLEP) {
+        if (ep->queued < ep->banks)
+            ep_push (ep, ep->fill, ep->count);
+        ep->count = 0;
+        return;
+    }
+    if ((USB_ControlRequest.bmRequestType & CONTROL_REQTYPE_DIRECTION) &&
+        ctl_stage == CTL_DATA) {
+        len = MIN (ep->count, ctl_length - ctl_done);
+        memcpy (ctl_data + ctl_done, ep->fill, len);
+        ctl_done += len;
+        /* A short packet or the full length end the data stage, the
+         * status stage is acknowledged by the controller */
+        if (ep->count < FIXED_CONTROL_ENDPOINT_SIZE || ctl_done == ctl_length)
+            ctl_stage = CTL_DONE;
+    } else if (ctl_stage == CTL_STATUS || ctl_stage == CTL_DATA) {
+        /* Zero length status packet */
+        ctl_stage = CTL_DONE;
+    }
+    ep->count = 0;
+}
+
+void Endpoint_ClearOUT (void) {
+    sim_ep_t *ep = (sim_cur == ENDPOINT_CONTROLEP) ? &sim_ep0_out : &sim_ep[sim_cur];
+
+    if (!ep->queued)
+        return;
+    ep_pop (ep);
+    if (sim_cur != ENDPOINT_CONTROLEP || ctl_stage != CTL_DATA ||
+        (USB_ControlRequest.bmRequestType & CONTROL_REQTYPE_DIRECTION))
+        return;
+    ctl_done = ctl_loaded;
+    if (ctl_loaded < ctl_length)
+        ctl_load ();
+    else
+        ctl_stage = CTL_STATUS;
+}
+
+void Endpoint_ClearStatusStage (void) {
+    if (USB_ControlRequest.bmRequestType & CONTROL_REQTYPE_DIRECTION) {
+        ctl_stage = CTL_DONE;
+    } else {
+        sim_ep0_dir = ENDPOINT_DIR_IN;
+        Endpoint_ClearIN ();
+    }
+}
+
+void Endpoint_StallTransaction (void) {
+    if (sim_cur == ENDPOINT_CONTROLEP)
+        ctl_stage = CTL_STALL;
+    else
+        sim_ep[sim_cur].stalled = 1;
+}
+
+void Endpoint_ClearStall (void) {
+    sim_ep[sim_cur].stalled = 0;
+}
+
+bool Endpoint_IsStalled (void) {
+    return sim_ep[sim_cur].stalled;
+}
+
+void Endpoint_ResetDataToggle (void) { }
+
+uint8_t Endpoint_Read_8 (void) {
+    sim_ep_t *ep = ep_current ();
+    uint8_t data;
+
+    if (!ep->queued || ep->pos >= ep->len[ep->head])
+        return 0;
+    data = ep->data[ep->head][ep->pos++];
+    return data;
+}
+
+uint16_t Endpoint_Read_16_LE (void) {
+    uint16_t data = Endpoint_Read_8 ();
+
+    return data | (Endpoint_Read_8 () << 8);
+}
+
+uint32_t Endpoint_Read_32_LE (void) {
+    uint32_t data = Endpoint_Read_16_LE ();
+
+    return data | ((uint32_t)Endpoint_Read_16_LE () << 16);
+}
+
+void Endpoint_Write_8 (const uint8_t Data) {
+    sim_ep_t *ep = &sim_ep[sim_cur];
+
+    if (ep->count < SIM_EP_MAXSIZE)
+        ep->fill[ep->count++] = Data;
+}
+
+void Endpoint_Write_16_LE (const uint16_t Data) {
+    Endpoint_Write_8 (Data);
+    Endpoint_Write_8 (Data >> 8);
+}
+
+void Endpoint_Write_32_LE (const uint32_t Data) {
+    Endpoint_Write_16_LE (Data);
+    Endpoint_Write_16_LE (Data >> 16);
+}
+
+uint8_t Endpoint_Write_Control_Stream_LE (const void *const Buffer,
+                                          uint16_t Length) {
+    const uint8_t *data = Buffer;
+    uint16_t sent = 0;
+
+    if (Length > USB_ControlRequest.wLength)
+        Length = USB_ControlRequest.wLength;
+    do {
+        while (sent < Length &&
+               Endpoint_BytesInEndpoint () < FIXED_CONTROL_ENDPOINT_SIZE)
+            Endpoint_Write_8 (data[sent++]);
+        Endpoint_ClearIN ();
+    } while (sent < Length);
+    return 0;
+}
+
+uint8_t Endpoint_Write_Control_PStream_LE (const void *const Buffer,
+                                           uint16_t Length) {
+    return Endpoint_Write_Control_Stream_LE (Buffer, Length);
+}
+
+uint8_t Endpoint_Read_Control_Stream_LE (void *const Buffer, uint16_t Length) {
+    uint8_t *data = Buffer;
+
+    sim_ep0_dir = ENDPOINT_DIR_OUT;
+    while (Length) {
+        if (!Endpoint_IsOUTReceived ())
+            return 1;
+        while (Length && Endpoint_BytesInEndpoint ()) {
+            *data++ = Endpoint_Read_8 ();
+            Length--;
+        }
+        Endpoint_ClearOUT ();
+    }
+    sim_ep0_dir = ENDPOINT_DIR_IN;
+    return 0;
+}
+
+/* Host side */
+
+static void sim_entry (void) {
+    firmware_main ();
+    fprintf (stderr, "sim: firmware main () returned\n");
+    exit (1);
+}
+
+/* Runs the firmware up to the main loop and configures the device */
+void sim_boot (void) {
+    getcontext (&sim_fw_ctx);
+    sim_fw_ctx.uc_stack.ss_sp   = sim_fw_stack;
+    sim_fw_ctx.uc_stack.ss_size = sizeof (sim_fw_stack);
+    sim_fw_ctx.uc_link          = NULL;
+    makecontext (&sim_fw_ctx, sim_entry, 0);
+    swapcontext (&sim_host_ctx, &sim_fw_ctx);
+
+    sim_ep[ENDPOINT_CONTROLEP].dir  = ENDPOINT_DIR_IN;
+    sim_ep[ENDPOINT_CONTROLEP].size = FIXED_CONTROL_ENDPOINT_SIZE;
+    sim_ep0_out.dir  = ENDPOINT_DIR_OUT;
+    sim_ep0_out.size = FIXED_CONTROL_ENDPOINT_SIZE;
+    USB_DeviceState = DEVICE_STATE_Configured;
+    EVENT_USB_Device_ConfigurationChanged ();
+}
+
+/* One main loop iteration */
+void sim_loop (void) {
+    sim_iterations++;
+    sim_advance (sim_loop_cycles);
+    swapcontext (&sim_host_ctx, &sim_fw_ctx);
+}
+
+/* Lets the firmware run while the host gets to the next transfer */
+static void sim_host_latency (void) {
+    uint64_t until = sim_cycles + sim_usb_latency;
+
+    while (sim_cycles < until)
+        sim_loop ();
+}
+
+int sim_control (const uint8_t type, const uint8_t request,
+                 const uint16_t value, const uint16_t index,
+                 void *data, const uint16_t length) {
+    uint32_t wait = sim_timeout;
+
+    sim_host_latency ();
+    USB_ControlRequest.bmRequestType = type;
+    USB_ControlRequest.bRequest      = request;
+    USB_ControlRequest.wValue        = value;
+    USB_ControlRequest.wIndex        = index;
+    USB_ControlRequest.wLength       = length;
+
+    ep_reset (&sim_ep[ENDPOINT_CONTROLEP]);
+    ep_reset (&sim_ep0_out);
+    ctl_data   = data;
+    ctl_length = length;
+    ctl_done   = 0;
+    ctl_loaded = 0;
+    ctl_stage  = length ? CTL_DATA : CTL_STATUS;
+    sim_ep0_dir = (type & CONTROL_REQTYPE_DIRECTION) ? ENDPOINT_DIR_IN
+                                                     : ENDPOINT_DIR_OUT;
+    if (!(type & CONTROL_REQTYPE_DIRECTION) && length)
+        ctl_load ();
+
+    /* The request interrupt, with the endpoint selection saved */
+    sim_setup = 1;
+    {
+        uint8_t cur = sim_cur;
+
+        sim_cur = ENDPOINT_CONTROLEP;
+        EVENT_USB_Device_ControlRequest ();
+        sim_cur = cur;
+    }
+    /* Nobody took the request, LUFA stalls it */
+    if (sim_setup) {
+        sim_setup = 0;
+        ctl_stage = CTL_STALL;
+    }
+
+    while (ctl_stage != CTL_DONE && ctl_stage != CTL_STALL && wait--)
+        sim_loop ();
+    if (ctl_stage != CTL_DONE) {
+        ctl_stage = CTL_IDLE;
+        return -1;
+    }
+    ctl_stage = CTL_IDLE;
+    return ctl_done;
+}
+
+/* Returns once the last packet went into the endpoint */
+int sim_bulk_out (const uint8_t epaddr, const void *data,
+                  const uint16_t length) {
+    sim_ep_t *ep = &sim_ep[epaddr & ENDPOINT_EPNUM_MASK];
+    const uint8_t *buf = data;
+    uint16_t sent = 0, len;
+    uint32_t wait = sim_timeout;
+
+    if (!ep->size)
+        return -1;
+    sim_host_latency ();
+    while (sent < length) {
+        if (ep->stalled)
+            return -1;
+        if (ep->queued < ep->banks) {
+            len = MIN (length - sent, ep->size);
+            ep_push (ep, buf + sent, len);
+            sent += len;
+            continue;
+        }
+        if (!wait--)
+            return -1;
+        sim_loop ();
+    }
+    return sent;
+}
+
+/* Reads until length bytes or a short packet arrived */
+int sim_bulk_in (const uint8_t epaddr, void *data, const uint16_t length) {
+    sim_ep_t *ep = &sim_ep[epaddr & ENDPOINT_EPNUM_MASK];
+    uint8_t *buf = data;
+    uint16_t got = 0, len, plen;
+    uint32_t wait = sim_timeout;
+
+    if (!ep->size)
+        return -1;
+    sim_host_latency ();
+    while (got < length) {
+        if (ep->stalled)
+            return -1;
+        if (ep->queued) {
+            plen = ep->len[ep->head];
+            len  = MIN (plen, length - got);
+            memcpy (buf + got, ep->data[ep->head], len);
+            got += len;
+            ep_pop (ep);
+            if (plen < ep->size)
+                break;
+            continue;
+        }
+        if (!wait--)
+            return -1;
+        sim_loop ();
+    }
+    return got;
+}
@@ -0,0 +1,195 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* slave.c - I2C slave mode with a register map				     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Lets the TWI answer as a slave from a register map in RAM, for test
+ * rigs that need a device on the bus. The host loads the map with
+ * CMD_SET_SLAVE; from then on the TWI interrupt serves the bus master
+ * without the host: the first byte of a write selects the register,
+ * the following ones are written through the register's write mask,
+ * reads return the registers from the selected one on. The register
+ * number advances with every byte and wraps at the end of the map.
+ * Every byte written goes into a change log that the host reads in
+ * batches with CMD_GET_SLAVE. When the log is full, the oldest entries
+ * are overwritten and counted as lost.
+ *
+ * The TWI is either master or slave: while the map is loaded, master
+ * messages on bus 0 fail at once. */
+
+#include <string.h>
+#include <util/atomic.h>
+
+#include "Config/AppConfig.h"
+#include "Descriptors.h"
+
+#include "i2ctinyusb.h"
+#include "i2cmegausb.h"
+#include "slave.h"
+#include "stats.h"
+#include "trace.h"
+#include "twi.h"
+
+#if (I2C_SLAVE_LOG & (I2C_SLAVE_LOG - 1)) || I2C_SLAVE_LOG > 128
+#error I2C_SLAVE_LOG must be a power of two up to 128
+#endif
+
+#define SLAVE_HDR           2       /* address and size in CMD_SET_SLAVE */
+
+static uint8_t          slave_regs[I2C_SLAVE_SIZE];
+static uint8_t          slave_mask[I2C_SLAVE_SIZE];  /* writable bits */
+static uint8_t          slave_addr;     /* 7 bit address, 0 off */
+static uint8_t          slave_size;     /* registers in the map */
+static uint8_t          slave_ptr;      /* current register */
+static uint8_t          slave_first;    /* next byte written selects it */
+static uint8_t          slave_log[I2C_SLAVE_LOG][2];    /* register, byte */
+static volatile uint8_t slave_head;
+static volatile uint8_t slave_tail;
+static volatile uint8_t slave_lost;
+
+/* The TWI interrupt calls these while the TWI holds SCL low */
+
+/* The master addressed the slave, for a write or a read */
+void slave_begin (const uint8_t read) {
+    if (!read)
+        slave_first = 1;
+}
+
+/* Takes a byte from the master, returns 0 to NAK the next one. The ACK
+ * of this one has already gone out. */
+uint8_t slave_receive (const uint8_t data) {
+    uint8_t *entry;
+
+    if (slave_first) {
+        if (data >= slave_size)
+            return 0;
+        slave_ptr   = data;
+        slave_first = 0;
+        return 1;
+    }
+    slave_regs[slave_ptr] = (slave_regs[slave_ptr] & ~slave_mask[slave_ptr]) |
+                            (data & slave_mask[slave_ptr]);
+    entry = slave_log[slave_head++ & (I2C_SLAVE_LOG - 1)];
+    if ((uint8_t)(slave_head - slave_tail) > I2C_SLAVE_LOG) {
+        slave_tail++;
+        if (slave_lost != 0xff)
+            slave_lost++;
+    }
+    entry[0] = slave_ptr;
+    entry[1] = data;
+    if (++slave_ptr == slave_size)
+        slave_ptr = 0;
+    return 1;
+}
+
+/* The next byte for the master */
+uint8_t slave_transmit (void) {
+    uint8_t data = slave_regs[slave_ptr];
+
+    if (++slave_ptr == slave_size)
+        slave_ptr = 0;
+    return data;
+}
+
+/* Loads a map from the data stage of CMD_SET_SLAVE, an empty one ends
+ * slave mode. With I2C_SLAVE_UPDATE the data stage holds a register
+ * number and new values for the registers from there on instead. The
+ * request is run from the main loop once no engine owns the bus. */
+void slave_set (const i2c_cmd_t *req) {
+    uint8_t buf[SLAVE_HDR + 2 * I2C_SLAVE_SIZE];
+    uint8_t update = req->value & I2C_SLAVE_UPDATE;
+
+    if (req->length > sizeof (buf) || (update && !slave_addr) ||
+        (!update && req->length &&
+         (!i2c_bus_free () || (!slave_addr && !twi_master ())))) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    Endpoint_SetEndpointDirection (ENDPOINT_DIR_OUT);
+    if (req->length && Endpoint_Read_Control_Stream_LE (buf, req->length))
+        return;
+
+    if (update) {
+        if (!req->length || buf[0] + req->length - 1 > slave_size) {
+            Endpoint_StallTransaction ();
+            STATS_ADD (STATS_STALLS, 1);
+            return;
+        }
+        ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+            memcpy (&slave_regs[buf[0]], &buf[1], req->length - 1);
+        }
+    } else if (!req->length) {
+        twi_slave (0);
+        slave_addr = 0;
+    } else {
+        if (req->length < SLAVE_HDR || buf[0] < 0x08 || buf[0] > 0x77 ||
+            !buf[1] || buf[1] > I2C_SLAVE_SIZE ||
+            req->length != SLAVE_HDR + 2 * buf[1]) {
+            Endpoint_StallTransaction ();
+            STATS_ADD (STATS_STALLS, 1);
+            return;
+        }
+        twi_slave (0);
+        slave_addr  = buf[0];
+        slave_size  = buf[1];
+        slave_ptr   = 0;
+        slave_first = 0;
+        slave_head  = 0;
+        slave_tail  = 0;
+        slave_lost  = 0;
+        memcpy (slave_regs, &buf[SLAVE_HDR], slave_size);
+        memcpy (slave_mask, &buf[SLAVE_HDR + slave_size], slave_size);
+        twi_slave (slave_addr);
+    }
+    TRACE (TRACE_SLAVE, slave_addr, slave_size, update);
+    Endpoint_ClearIN ();
+}
+
+/* Sends the data stage of CMD_GET_SLAVE: the change log, whose entries
+ * are dropped, or with I2C_SLAVE_REGS the registers */
+void slave_send (const uint16_t length, const uint16_t value) {
+    uint8_t buf[2 + 2 * I2C_SLAVE_LOG];
+    uint8_t count, i;
+    uint16_t len;
+
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        if (value & I2C_SLAVE_REGS) {
+            len = slave_addr ? slave_size : 0;
+            memcpy (buf, slave_regs, len);
+        } else {
+            count = slave_head - slave_tail;
+            if (length < 2)
+                count = 0;
+            else if (count > (length - 2) / 2)
+                count = (length - 2) / 2;
+            buf[0] = count;
+            buf[1] = slave_lost;
+            slave_lost = 0;
+            for (i = 0; i < count; i++, slave_tail++)
+                memcpy (&buf[2 + 2 * i],
+                        slave_log[slave_tail & (I2C_SLAVE_LOG - 1)], 2);
+            len = 2 + 2 * count;
+        }
+    }
+    Endpoint_Write_Control_Stream_LE (buf, len < length ? len : length);
+    Endpoint_ClearOUT ();
+}
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* slave.h - I2C slave mode with a register map				     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __slave_h_included__
+#define __slave_h_included__
+
+#include <stdint.h>
+
+#include "queue.h"
+
+void    slave_set (const i2c_cmd_t *req);
+void    slave_send (const uint16_t length, const uint16_t value);
+
+/* Called from the TWI interrupt */
+void    slave_begin (const uint8_t read);
+uint8_t slave_receive (const uint8_t data);
+uint8_t slave_transmit (void);
+
+#endif
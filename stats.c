@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* stats.c - transaction counters and latency histograms		     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Counts what the adapter does on the bus and how long requests take,
+ * for finding slow slaves and tuning the bus clock in the field. Times
+ * come from the Timer1 clock and go into histograms with power of two
+ * bins, so recording one costs a few shifts. CMD_GET_STATS reads
+ * everything out and tools/i2cmega-stats.py prints it. Build with
+ * STATS=0 to leave the counters out. */
+
+#include <string.h>
+#include <util/atomic.h>
+
+#include "Config/AppConfig.h"
+#include "Descriptors.h"
+
+#include "clock.h"
+#include "stats.h"
+
+#if I2C_STATS
+
+typedef struct {
+    uint32_t counter[STATS_COUNTERS];
+    uint32_t histogram[STATS_HISTOGRAMS][STATS_BINS];
+} stats_t;
+
+static stats_t stats;
+
+void stats_add (const uint8_t counter, const uint16_t n) {
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        stats.counter[counter] += n;
+    }
+}
+
+void stats_time (const uint8_t histogram, const uint32_t ticks) {
+    uint32_t us = ticks / CLOCK_TICKS_PER_US;
+    uint8_t bin = 0;
+
+    while (us > 1 && bin < STATS_BINS - 1) {
+        us >>= 1;
+        bin++;
+    }
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        stats.histogram[histogram][bin]++;
+    }
+}
+
+/* Sends the counters in the data stage of CMD_GET_STATS. LUFA runs the
+ * control request handler with interrupts on, so the counters are
+ * copied, and cleared, in one go and the copy is sent. It is static, as
+ * it is too big for the interrupt's stack. */
+void stats_send (const uint16_t length, const uint8_t reset) {
+    static stats_t copy;
+    uint16_t len = sizeof (copy);
+
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        memcpy (&copy, &stats, sizeof (copy));
+        if (reset)
+            memset (&stats, 0, sizeof (stats));
+    }
+    if (len > length)
+        len = length;
+    Endpoint_Write_Control_Stream_LE (&copy, len);
+    Endpoint_ClearOUT ();
+}
+
+#endif
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* stats.h - transaction counters and latency histograms		     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __stats_h_included__
+#define __stats_h_included__
+
+#include <stdint.h>
+
+#include "Config/AppConfig.h"
+
+/* Counters of the TWI bus (bus 0), the software master of the second
+ * bus has none. CMD_GET_STATS returns them in this order, followed by the
+ * histograms; tools/i2cmega-stats.py has the same lists. */
+enum {
+    STATS_TRANSACTIONS,     /* STARTs after a STOP, all engines */
+    STATS_READ_BYTES,       /* bytes read on the bus */
+    STATS_WRITE_BYTES,      /* bytes written on the bus */
+    STATS_ADDR_NAKS,        /* addresses not acknowledged */
+    STATS_DATA_NAKS,        /* written bytes not acknowledged */
+    STATS_BUS_ERRORS,       /* bus errors and lost arbitration */
+    STATS_TIMEOUTS,         /* bus phases timed out and recovered */
+    STATS_STALLS,           /* vendor requests stalled or dropped */
+    STATS_COUNTERS
+};
+
+/* Histograms of times in µs, bin n counts 2^n to 2^(n+1) - 1, the first
+ * bin also 0 and the last everything above */
+enum {
+    STATS_BUS,              /* START to STOP of a transaction */
+    STATS_REQUEST,          /* SETUP to completion of a queued request */
+    STATS_HISTOGRAMS
+};
+
+#define STATS_BINS              16
+
+#if I2C_STATS
+void stats_add (const uint8_t counter, const uint16_t n);
+void stats_time (const uint8_t histogram, const uint32_t ticks);
+void stats_send (const uint16_t length, const uint8_t reset);
+
+#define STATS_ADD(counter, n)   stats_add (counter, n)
+#define STATS_TIME(hist, ticks) stats_time (hist, ticks)
+#else
+#define STATS_ADD(counter, n)   ((void)0)
+#define STATS_TIME(hist, ticks) ((void)0)
+#endif
+
+#endif
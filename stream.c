@@ -0,0 +1,260 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* stream.c - continuous register capture on a bulk endpoint		     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Reads the same register again and again, back to back or at a fixed
+ * interval, and packs the samples into the stream endpoint. The bytes go
+ * from the TWI engine straight into the endpoint bank. The endpoint has
+ * two banks, so the bus fills one while the host reads the other. A
+ * sample that finds no free bank is still read, to keep the sampling
+ * rate, but dropped and counted. Samples take the bus one at a time,
+ * between i2c-tiny-usb transactions, batches and polls. */
+
+#include "Config/AppConfig.h"
+#include "Descriptors.h"
+
+#include "i2ctinyusb.h"
+#include "i2cmegausb.h"
+#include "clock.h"
+#include "monitor.h"
+#include "stream.h"
+#include "stats.h"
+#include "trace.h"
+#include "twi.h"
+
+#if !defined(I2C_USB_LOWSPEED)
+
+#define STREAM_CONFIG_SIZE  6       /* bytes in SET_STREAM */
+#define STREAM_HEADER_SIZE  3       /* bytes in front of every packet */
+
+enum {
+    STREAM_OFF,         /* not armed */
+    STREAM_WAIT,        /* waiting for the next sample */
+    STREAM_REGISTER,    /* writing the register number */
+    STREAM_READ,        /* reading the sample */
+    STREAM_END          /* failed, last packet pending */
+};
+
+static uint8_t  stream_state;
+static uint8_t  stream_addr;
+static uint8_t  stream_reg;
+static uint8_t  stream_len;
+static uint8_t  stream_flags;
+static uint32_t stream_interval;    /* in clock ticks, 0 back to back */
+static uint32_t stream_due;         /* next sample */
+static uint32_t stream_first;       /* time of the first sample in the bank */
+static uint8_t  stream_pos;         /* bytes read of the sample */
+static uint8_t  stream_keep;        /* the sample has room in the bank */
+static uint8_t  stream_inbytes;     /* bytes in the current IN bank */
+static uint8_t  stream_seq;         /* packet sequence number */
+static uint8_t  stream_lost;        /* samples dropped since the last packet */
+static int8_t   stream_status;      /* status of the last packet */
+
+uint8_t stream_armed (void) {
+    return stream_state != STREAM_OFF;
+}
+
+/* A sample owns the bus from its START to its STOP */
+uint8_t stream_busy (void) {
+    return stream_state == STREAM_REGISTER || stream_state == STREAM_READ;
+}
+
+/* Sends the samples collected so far */
+static void stream_flush (void) {
+    if (!stream_inbytes)
+        return;
+    Endpoint_SelectEndpoint (I2C_STREAM_EPADDR);
+    Endpoint_ClearIN ();
+    stream_inbytes = 0;
+}
+
+/* Starts a packet: sequence number, samples lost before it, status */
+static void stream_header (const int8_t status) {
+    Endpoint_Write_8 (stream_seq++);
+    Endpoint_Write_8 (stream_lost);
+    Endpoint_Write_8 (status);
+    stream_inbytes = STREAM_HEADER_SIZE;
+    stream_lost    = 0;
+}
+
+/* Arms or stops the capture from the data stage of SET_STREAM. The
+ * request is run from the main loop, so no sample is on the bus. */
+void stream_set (const i2c_cmd_t *req) {
+    uint8_t buf[STREAM_CONFIG_SIZE];
+
+    if (i2c_altsetting != INTERFACE_ALT_BATCH ||
+        (req->length && (req->length != sizeof (buf) || monitor_armed ()))) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    Endpoint_SetEndpointDirection (ENDPOINT_DIR_OUT);
+    if (req->length && Endpoint_Read_Control_Stream_LE (buf, req->length))
+        return;
+    if (req->length && (buf[0] > 0x7f || !buf[2] ||
+                        buf[2] > I2C_STREAM_EPSIZE - STREAM_HEADER_SIZE)) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+
+    stream_flush ();
+    if (req->length) {
+        stream_addr     = buf[0];
+        stream_reg      = buf[1];
+        stream_len      = buf[2];
+        stream_flags    = buf[3];
+        stream_interval = (uint16_t)(buf[4] | (buf[5] << 8)) * CLOCK_TICKS_PER_US;
+        stream_due      = clock_ticks ();
+        stream_seq      = 0;
+        stream_lost     = 0;
+        stream_state    = STREAM_WAIT;
+        TRACE (TRACE_STREAM, stream_addr, stream_len, STATUS_RUNNING);
+    } else {
+        stream_state    = STREAM_OFF;
+        TRACE (TRACE_STREAM, stream_addr, 0, STATUS_IDLE);
+    }
+    Endpoint_SelectEndpoint (ENDPOINT_CONTROLEP);
+    Endpoint_ClearIN ();
+}
+
+/* Starts the next sample, in the current bank if there is one */
+static void stream_start (const uint32_t now) {
+    Endpoint_SelectEndpoint (I2C_STREAM_EPADDR);
+    stream_keep = Endpoint_IsINReady ();
+    if (!stream_keep) {
+        if (stream_lost != 0xff)
+            stream_lost++;
+    } else if (!stream_inbytes) {
+        stream_header (STATUS_RUNNING);
+        stream_first = now;
+    }
+    stream_pos = 0;
+    if (stream_flags & I2C_STREAM_NOREG) {
+        twi_start ((stream_addr << 1) | 1, stream_len);
+        stream_state = STREAM_READ;
+    } else {
+        twi_start (stream_addr << 1, 1);
+        twi_put (stream_reg);
+        stream_state = STREAM_REGISTER;
+    }
+}
+
+/* Ends the sample on the bus and closes the bank if the next one would
+ * not fit */
+static void stream_done (void) {
+    if (twi_busy ())
+        twi_abort ();
+    else
+        twi_stop ();
+    if (stream_keep) {
+        stream_inbytes += stream_len;
+        if (stream_inbytes + stream_len > I2C_STREAM_EPSIZE)
+            stream_flush ();
+    }
+    stream_state = STREAM_WAIT;
+}
+
+/* Stops the capture after a failed sample. The sample is padded, the
+ * packets so far go out and a last one carries the status. */
+static void stream_fail (const int8_t status) {
+    Endpoint_SelectEndpoint (I2C_STREAM_EPADDR);
+    if (stream_keep)
+        for (; stream_pos < stream_len; stream_pos++)
+            Endpoint_Write_8 (0xff);
+    stream_done ();
+    stream_flush ();
+    stream_status = status;
+    stream_state  = STREAM_END;
+    TRACE (TRACE_STREAM, stream_addr, 0, status);
+}
+
+/* Called from the main loop, advances the capture as far as the bus
+ * allows */
+void stream_task (void) {
+    uint32_t now;
+    uint8_t data;
+
+    if (i2c_altsetting != INTERFACE_ALT_BATCH) {
+        /* The stream endpoint is gone, the host arms a new capture */
+        if (stream_state != STREAM_OFF) {
+            if (stream_busy ())
+                twi_abort ();
+            stream_state   = STREAM_OFF;
+            stream_inbytes = 0;
+        }
+        return;
+    }
+    switch (stream_state) {
+    case STREAM_WAIT:
+        now = clock_ticks ();
+        /* Samples don't wait in a bank for long at low rates */
+        if (stream_inbytes &&
+            now - stream_first >= I2C_STREAM_FLUSH_US * CLOCK_TICKS_PER_US)
+            stream_flush ();
+        if ((int32_t)(now - stream_due) < 0 || !i2c_bus_free ())
+            break;
+        /* Next sample one interval later, unless that has passed too */
+        stream_due += stream_interval;
+        if ((int32_t)(now - stream_due) >= 0)
+            stream_due = now + stream_interval;
+        stream_start (now);
+        break;
+    case STREAM_REGISTER:
+        if (twi_busy ())
+            break;
+        if (twi_failed ()) {
+            stream_fail (twi_state == TWI_ADDR_NAK ? STATUS_ADDRESS_NAK
+                                                   : STATUS_WRITE_FAILED);
+            break;
+        }
+        /* Repeated START */
+        twi_start ((stream_addr << 1) | 1, stream_len);
+        stream_state = STREAM_READ;
+        break;
+    case STREAM_READ:
+        Endpoint_SelectEndpoint (I2C_STREAM_EPADDR);
+        while (stream_pos < stream_len && twi_get (&data)) {
+            if (stream_keep)
+                Endpoint_Write_8 (data);
+            stream_pos++;
+        }
+        if (stream_pos == stream_len) {
+            stream_done ();
+        } else if (twi_failed ()) {
+            stream_fail (twi_state == TWI_ADDR_NAK ? STATUS_ADDRESS_NAK
+                                                   : STATUS_READ_FAILED);
+        }
+        break;
+    case STREAM_END:
+        Endpoint_SelectEndpoint (I2C_STREAM_EPADDR);
+        if (!Endpoint_IsINReady ())
+            break;
+        stream_header (stream_status);
+        Endpoint_ClearIN ();
+        stream_inbytes = 0;
+        stream_state   = STREAM_OFF;
+        break;
+    }
+}
+
+#endif
@@ -0,0 +1,420 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* swi.c - bit-banged I2C master on port pins				     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* A second bus for adapters with address conflicts or more traffic than
+ * one bus carries. The Timer3 compare interrupt runs a master on two
+ * port pins, one half SCL period per step, so it works next to the TWI
+ * without blocking the main loop. It has the same buffer and states as
+ * the TWI engine: the main loop fills and drains the ring buffer and a
+ * message that finds it empty (write) or full (read) stops the timer
+ * with SCL low, which stretches the clock until the main loop catches
+ * up.
+ *
+ * Lines are open drain: low drives the pin, high leaves it to the
+ * pull-up. A step that releases SCL looks at it one step later, so
+ * slaves can stretch the clock, up to the timeout. A slave that holds
+ * SDA at a START gets up to nine clocks to let go. Each step costs
+ * about 50 CPU cycles, which is why the clock is limited to
+ * I2C_SWI_MAXFREQ. There is one master, no arbitration. */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "Config/AppConfig.h"
+#include "clock.h"
+#include "swi.h"
+
+volatile uint8_t swi_state = TWI_IDLE;
+
+/* Steps, each runs in one timer interrupt */
+enum {
+    SWI_OFF,            /* timer off, SCL low if a message is held */
+    SWI_START,          /* release SDA */
+    SWI_START_SCL,      /* release SCL */
+    SWI_START_SDA,      /* SCL high: SDA low, the START */
+    SWI_START_LOW,      /* SCL low, first bit of the address */
+    SWI_HIGH,           /* bit on SDA: release SCL */
+    SWI_SAMPLE,         /* SCL high: sample SDA, SCL low, next bit */
+    SWI_NEXT,           /* byte done: start the next one or wait */
+    SWI_STOP,           /* SCL low: SDA low */
+    SWI_STOP_SCL,       /* release SCL */
+    SWI_STOP_SDA        /* SCL high: release SDA, the STOP */
+};
+
+static uint8_t           swi_buf[TWI_BUFSIZE];
+static volatile uint8_t  swi_head;      /* written by the producer */
+static volatile uint8_t  swi_tail;      /* written by the consumer */
+static volatile uint8_t  swi_sla;       /* address and direction */
+static volatile uint16_t swi_left;      /* bytes not yet started on the bus */
+static volatile uint8_t  swi_stalled;   /* timer off, waiting for the buffer */
+static volatile uint8_t  swi_block;     /* block read, count byte pending */
+static uint8_t           swi_blockmax;  /* largest count accepted */
+static uint8_t           swi_extra;     /* bytes read after the block */
+static volatile uint8_t  swi_phase = SWI_OFF;
+static volatile uint8_t  swi_restart;   /* START queued behind a STOP */
+static uint8_t           swi_shift;     /* byte on the bus */
+static uint8_t           swi_bit;       /* bits of it done, 8 is the ACK */
+static uint8_t           swi_rx;        /* byte is read */
+static uint8_t           swi_ack;       /* read byte gets an ACK */
+static uint8_t           swi_address;   /* byte is the address */
+static uint8_t           swi_clocks;    /* recovery clocks at this START */
+static uint16_t          swi_half = F_CPU / (2 * 10000UL);  /* ticks */
+static uint16_t          swi_timeout = I2C_TIMEOUT_US;
+static uint16_t          swi_waits;     /* steps SCL was stretched */
+static uint16_t          swi_limit;     /* steps it may be stretched */
+
+#define SWI_SCL         _BV(I2C_SWI_SCL)
+#define SWI_SDA         _BV(I2C_SWI_SDA)
+
+static inline void swi_low (const uint8_t pin) {
+    I2C_SWI_PORT &= ~pin;
+    I2C_SWI_DDR  |= pin;
+}
+
+static inline void swi_release (const uint8_t pin) {
+    I2C_SWI_DDR  &= ~pin;
+    I2C_SWI_PORT |= pin;
+}
+
+#define swi_high(pin)   (I2C_SWI_PIN & (pin))
+
+static inline void swi_on (void) {
+    TCNT3   = 0;
+    TIFR3   = _BV(OCF3A);
+    TIMSK3 |= _BV(OCIE3A);
+}
+
+static inline void swi_off (void) {
+    TIMSK3 &= ~_BV(OCIE3A);
+}
+
+/* Finishes the message, keeping the bus with SCL low */
+static inline void swi_hold (const uint8_t state) {
+    swi_off ();
+    swi_phase = SWI_OFF;
+    swi_state = state;
+}
+
+/* Gives up the bus, releasing both lines */
+static void swi_end (const uint8_t state) {
+    swi_off ();
+    swi_release (SWI_SCL);
+    swi_release (SWI_SDA);
+    swi_phase   = SWI_OFF;
+    swi_stalled = 0;
+    swi_state   = state;
+}
+
+/* Waits one more step for a slave stretching SCL */
+static inline uint8_t swi_stretched (void) {
+    if (swi_high (SWI_SCL)) {
+        swi_waits = 0;
+        return 0;
+    }
+    if (++swi_waits > swi_limit)
+        swi_end (TWI_TIMEOUT);
+    return 1;
+}
+
+/* Puts the next bit of a written byte on SDA, or releases it */
+static inline void swi_data (void) {
+    if (swi_rx || (swi_shift & 0x80))
+        swi_release (SWI_SDA);
+    else
+        swi_low (SWI_SDA);
+}
+
+/* Starts the next byte, after the address or a data byte */
+static void swi_next (void) {
+    if (!swi_left) {
+        swi_hold (TWI_HOLD);
+        return;
+    }
+    swi_bit = 0;
+    if (swi_sla & 1) {
+        /* Reads run ahead of the consumer until the buffer is full */
+        if ((uint8_t)(swi_head - swi_tail) == TWI_BUFSIZE) {
+            swi_off ();
+            swi_stalled = 1;
+            return;
+        }
+        /* Acknowledge everything but the last byte */
+        swi_ack = --swi_left || swi_block;
+        swi_rx  = 1;
+    } else {
+        if (swi_head == swi_tail) {
+            swi_off ();
+            swi_stalled = 1;
+            return;
+        }
+        swi_shift = swi_buf[swi_tail++ & (TWI_BUFSIZE - 1)];
+        swi_left--;
+        swi_rx = 0;
+    }
+    swi_data ();
+    swi_phase = SWI_HIGH;
+}
+
+/* Handles the ACK bit that ended a byte */
+static void swi_byte (const uint8_t nak) {
+    uint8_t data = swi_shift;
+
+    if (swi_address) {
+        swi_address = 0;
+        if (nak) {
+            swi_hold (TWI_ADDR_NAK);
+            return;
+        }
+        swi_state = TWI_DATA;
+    } else if (swi_rx) {
+        swi_buf[swi_head++ & (TWI_BUFSIZE - 1)] = data;
+        if (swi_block) {
+            /* The count sizes the rest of the message, see twi.c */
+            swi_block = 0;
+            swi_left  = (data && data <= swi_blockmax) ? data + swi_extra : 1;
+        }
+    } else if (nak) {
+        swi_hold (TWI_DATA_NAK);
+        return;
+    }
+    swi_next ();
+}
+
+ISR (TIMER3_COMPA_vect) {
+    uint8_t sda;
+
+    switch (swi_phase) {
+    case SWI_START:
+        /* SCL is low after a held message, or high on a free bus */
+        swi_release (SWI_SDA);
+        swi_phase = SWI_START_SCL;
+        break;
+    case SWI_START_SCL:
+        swi_release (SWI_SCL);
+        swi_phase = SWI_START_SDA;
+        break;
+    case SWI_START_SDA:
+        if (swi_stretched ())
+            break;
+        if (!swi_high (SWI_SDA)) {
+            /* A slave was cut off in the middle of a byte: clock it
+             * out, then try the START again */
+            if (swi_clocks++ == 9) {
+                swi_end (TWI_ERROR);
+                break;
+            }
+            swi_low (SWI_SCL);
+            swi_phase = SWI_START_SCL;
+            break;
+        }
+        swi_low (SWI_SDA);
+        swi_phase = SWI_START_LOW;
+        break;
+    case SWI_START_LOW:
+        swi_low (SWI_SCL);
+        swi_shift   = swi_sla;
+        swi_bit     = 0;
+        swi_rx      = 0;
+        swi_address = 1;
+        swi_data ();
+        swi_phase = SWI_HIGH;
+        break;
+    case SWI_HIGH:
+        swi_release (SWI_SCL);
+        swi_phase = SWI_SAMPLE;
+        break;
+    case SWI_SAMPLE:
+        if (swi_stretched ())
+            break;
+        sda = swi_high (SWI_SDA) ? 1 : 0;
+        swi_low (SWI_SCL);
+        if (swi_bit == 8) {
+            swi_byte (sda);
+            break;
+        }
+        swi_shift = (swi_shift << 1) | (swi_rx ? sda : 0);
+        if (++swi_bit < 8) {
+            swi_data ();
+        } else if (swi_rx && swi_ack) {
+            swi_low (SWI_SDA);
+        } else {
+            /* The slave's ACK, or our NAK of the last byte read */
+            swi_release (SWI_SDA);
+        }
+        swi_phase = SWI_HIGH;
+        break;
+    case SWI_NEXT:
+        swi_next ();
+        break;
+    case SWI_STOP:
+        swi_low (SWI_SDA);
+        swi_phase = SWI_STOP_SCL;
+        break;
+    case SWI_STOP_SCL:
+        swi_release (SWI_SCL);
+        swi_phase = SWI_STOP_SDA;
+        break;
+    case SWI_STOP_SDA:
+        if (swi_stretched ())
+            break;
+        swi_release (SWI_SDA);
+        if (swi_restart) {
+            /* The bus free time is the next step */
+            swi_restart = 0;
+            swi_phase   = SWI_START;
+        } else {
+            swi_off ();
+            swi_phase = SWI_OFF;
+        }
+        break;
+    default:
+        swi_off ();
+        break;
+    }
+}
+
+static void swi_limits (void) {
+    swi_limit = ((uint32_t)swi_timeout * CLOCK_TICKS_PER_US + swi_half - 1) / swi_half;
+}
+
+/* Sets the bus clock in Hz, at most I2C_SWI_MAXFREQ, and releases the
+ * bus. Returns the actual clock, 0 if it is out of range. */
+uint32_t swi_init (const uint32_t freq) {
+    uint32_t half;
+
+    if (!freq)
+        return 0;
+    half = (F_CPU / 2 + freq - 1) / freq;
+    if (half < F_CPU / (2 * I2C_SWI_MAXFREQ))
+        half = F_CPU / (2 * I2C_SWI_MAXFREQ);
+    if (half > 0xffff)
+        return 0;
+    swi_end (TWI_IDLE);
+    swi_restart = 0;
+    swi_half    = half;
+    swi_limits ();
+    TCCR3A = 0;
+    TCCR3B = _BV(WGM32) | _BV(CS30);    /* CTC on OCR3A, no prescaler */
+    OCR3A  = half - 1;
+    return F_CPU / (2 * half);
+}
+
+/* Sets how long a slave may stretch SCL, in µs. Returns the previous
+ * setting. */
+uint16_t swi_set_timeout (const uint16_t us) {
+    uint16_t old = swi_timeout;
+
+    swi_timeout = us;
+    swi_limits ();
+    return old;
+}
+
+static void swi_go (const uint8_t sla, const uint16_t len) {
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        swi_head    = 0;
+        swi_tail    = 0;
+        swi_sla     = sla;
+        swi_left    = len;
+        swi_stalled = 0;
+        swi_clocks  = 0;
+        swi_waits   = 0;
+        swi_state   = TWI_ADDRESS;
+        if (swi_phase == SWI_OFF) {
+            swi_phase = SWI_START;
+            swi_on ();
+        } else {
+            /* A STOP is on its way */
+            swi_restart = 1;
+        }
+    }
+}
+
+/* Sends a START, or a repeated START if the bus is still owned, and
+ * addresses the slave, like twi_start () */
+void swi_start (const uint8_t sla, const uint16_t len) {
+    swi_block = 0;
+    swi_go (sla, len);
+}
+
+/* Starts an SMBus block read, like twi_start_block () */
+void swi_start_block (const uint8_t sla, const uint8_t max,
+                      const uint8_t extra) {
+    swi_block    = 1;
+    swi_blockmax = max;
+    swi_extra    = extra;
+    swi_go (sla | 1, 1);
+}
+
+/* Ends the transaction with a STOP. Only valid while no byte is moving
+ * on the bus, i.e. when the message is finished or stalled. */
+void swi_stop (void) {
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        if (swi_state != TWI_IDLE && swi_state < TWI_ERROR) {
+            swi_phase = SWI_STOP;
+            swi_on ();
+        }
+        swi_stalled = 0;
+        swi_state   = TWI_IDLE;
+    }
+}
+
+/* Gives up on a message that makes no progress. A slave left in the
+ * middle of a byte is clocked free at the next START. */
+void swi_abort (void) {
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        swi_restart = 0;
+        swi_end (TWI_IDLE);
+    }
+}
+
+/* Lets the interrupt continue after the main loop touched the buffer */
+static inline void swi_resume (void) {
+    if (swi_stalled) {
+        swi_stalled = 0;
+        swi_phase   = SWI_NEXT;
+        swi_on ();
+    }
+}
+
+uint8_t swi_room (void) {
+    return TWI_BUFSIZE - (uint8_t)(swi_head - swi_tail);
+}
+
+uint8_t swi_put (const uint8_t data) {
+    if ((uint8_t)(swi_head - swi_tail) == TWI_BUFSIZE)
+        return 0;
+    swi_buf[swi_head & (TWI_BUFSIZE - 1)] = data;
+    swi_head++;
+    swi_resume ();
+    return 1;
+}
+
+uint8_t swi_get (uint8_t *data) {
+    if (swi_head == swi_tail)
+        return 0;
+    *data = swi_buf[swi_tail & (TWI_BUFSIZE - 1)];
+    swi_tail++;
+    swi_resume ();
+    return 1;
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* swi.h - bit-banged I2C master on port pins				     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __swi_h_included__
+#define __swi_h_included__
+
+#include <stdint.h>
+
+#include "twi.h"
+
+/* The software master has the interface and the states of the TWI
+ * engine in twi.h, so the i2c-tiny-usb code runs on either bus */
+extern volatile uint8_t swi_state;
+
+#define swi_busy()      (swi_state == TWI_ADDRESS || swi_state == TWI_DATA)
+#define swi_failed()    (swi_state >= TWI_ADDR_NAK)
+
+uint32_t swi_init (const uint32_t freq);
+uint16_t swi_set_timeout (const uint16_t us);
+void     swi_start (const uint8_t sla, const uint16_t len);
+void     swi_start_block (const uint8_t sla, const uint8_t max,
+                          const uint8_t extra);
+void     swi_stop (void);
+void     swi_abort (void);
+uint8_t  swi_room (void);
+uint8_t  swi_put (const uint8_t data);
+uint8_t  swi_get (uint8_t *data);
+
+#endif
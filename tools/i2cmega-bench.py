@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+#
+# i2cmega-bench.py - CPU cycles per transaction on the i2c-mega-usb
+#
+# Copyright (C) 2019 Christian Schmidt
+#
+# Runs echo, 1 byte write, register read and 256 byte read transactions
+# the way the i2c-tiny-usb kernel driver sends them, at several bus clock
+# settings, and prints the CPU cycles the firmware spent on them per code
+# path. Needs pyusb and a firmware built with "make PROFILE=1"; the
+# device must not be in use by the kernel driver meanwhile.
+
+import argparse
+import struct
+import sys
+
+VENDOR_ID = 0x0403
+PRODUCT_ID = 0xc631
+
+CMD_ECHO = 0
+CMD_SET_DELAY = 2
+CMD_GET_STATUS = 3
+CMD_I2C_IO = 4
+CMD_I2C_IO_BEGIN = 1
+CMD_I2C_IO_END = 2
+CMD_GET_PROFILE = 17
+I2C_M_RD = 1
+STATUS_ADDRESS_NAK = 2
+
+# Same order as in profile.h
+SLOTS = ("control", "execute", "read", "write", "twi")
+
+# Vendor requests to the device, so pyusb needs no interface
+REQ_IN = 0xc0
+REQ_OUT = 0x40
+
+
+class Device:
+    def __init__(self):
+        import usb.core
+        self.dev = usb.core.find(idVendor=VENDOR_ID, idProduct=PRODUCT_ID)
+        if self.dev is None:
+            sys.exit("no i2c-mega-usb device found")
+
+    def profile(self):
+        data = bytes(self.dev.ctrl_transfer(REQ_IN, CMD_GET_PROFILE, 0, 0,
+                                            12 * len(SLOTS)))
+        if len(data) < 12 * len(SLOTS):
+            sys.exit("no cycle counters, flash a build with make PROFILE=1")
+        return [struct.unpack_from("<III", data, 12 * i) for i in range(len(SLOTS))]
+
+    def io(self, cmd, addr, flags, data):
+        """One message plus GET_STATUS, like the kernel driver"""
+        if flags & I2C_M_RD:
+            self.dev.ctrl_transfer(REQ_IN, cmd, flags, addr, data)
+        else:
+            self.dev.ctrl_transfer(REQ_OUT, cmd, flags, addr, data)
+        status = self.dev.ctrl_transfer(REQ_IN, CMD_GET_STATUS, 0, 0, 1)[0]
+        if status == STATUS_ADDRESS_NAK:
+            sys.exit("no ACK from address 0x%02x" % addr)
+
+
+def transactions(dev, addr, reg):
+    first = CMD_I2C_IO | CMD_I2C_IO_BEGIN
+    last = CMD_I2C_IO | CMD_I2C_IO_END
+    both = first | last
+    return (
+        ("echo",
+         lambda: dev.dev.ctrl_transfer(REQ_IN, CMD_ECHO, 0x1234, 0, 2)),
+        ("write 1",
+         lambda: dev.io(both, addr, 0, bytes([reg]))),
+        ("register read",
+         lambda: (dev.io(first, addr, 0, bytes([reg])),
+                  dev.io(last, addr, I2C_M_RD, 1))),
+        ("read 256",
+         lambda: (dev.io(first, addr, 0, bytes([reg])),
+                  dev.io(last, addr, I2C_M_RD, 256))),
+    )
+
+
+def delta(after, before, overhead=None):
+    d = [tuple((a - b) & 0xffffffff for a, b in zip(sa, sb))
+         for sa, sb in zip(after, before)]
+    if overhead:
+        d = [tuple(x - y for x, y in zip(sd, so)) for sd, so in zip(d, overhead)]
+    return d
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Measure firmware CPU cycles per transaction")
+    parser.add_argument("-a", "--address", type=lambda x: int(x, 0), default=0x50,
+                        help="7 bit address of a slave on the bus (0x50)")
+    parser.add_argument("-r", "--register", type=lambda x: int(x, 0), default=0,
+                        help="register to read (0)")
+    parser.add_argument("-n", "--count", type=int, default=100,
+                        help="runs per transaction (100)")
+    parser.add_argument("-d", "--delays", default="10,5,2,1",
+                        help="SET_DELAY values in us, one table each (10,5,2,1)")
+    args = parser.parse_args()
+
+    dev = Device()
+    # The GET_PROFILE that starts a measurement is counted in it
+    before = dev.profile()
+    overhead = delta(dev.profile(), before)
+
+    print("%-14s %5s %9s %9s %9s %9s %9s %9s %8s" %
+          (("transaction", "delay") + SLOTS + ("total", "cyc/byte")))
+    for delay in [int(d) for d in args.delays.split(",")]:
+        dev.dev.ctrl_transfer(REQ_OUT, CMD_SET_DELAY, delay, 0, None)
+        for name, run in transactions(dev, args.address, args.register):
+            before = dev.profile()
+            for _ in range(args.count):
+                run()
+            d = delta(dev.profile(), before, overhead)
+            cycles = [s[1] / args.count for s in d]
+            total = sum(cycles)
+            data = sum(s[1] for s in d[2:4])
+            moved = sum(s[2] for s in d[2:4])
+            print("%-14s %5d %s %9.0f %8s" %
+                  (name, delay, " ".join("%9.0f" % c for c in cycles), total,
+                   "%.1f" % (data / moved) if moved else "-"))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+#
+# i2cmega-stats.py - read the i2c-mega-usb transaction statistics
+#
+# Copyright (C) 2019 Christian Schmidt
+#
+# Reads the counters and latency histograms with CMD_GET_STATS (needs
+# pyusb) and prints them, optionally clearing them on the device.
+
+import argparse
+import struct
+import sys
+
+VENDOR_ID = 0x0403
+PRODUCT_ID = 0xc631
+CMD_GET_STATS = 22
+
+# Same lists as in stats.h
+COUNTERS = ["transactions", "read bytes", "write bytes", "address NAKs",
+            "data NAKs", "bus errors", "timeouts", "stalls"]
+HISTOGRAMS = ["bus time per transaction", "SETUP to completion per request"]
+BINS = 16
+LENGTH = 4 * (len(COUNTERS) + len(HISTOGRAMS) * BINS)
+
+
+def read_device(reset):
+    import usb.core
+    dev = usb.core.find(idVendor=VENDOR_ID, idProduct=PRODUCT_ID)
+    if dev is None:
+        sys.exit("no i2c-mega-usb device found")
+    # Sent to the device, so the kernel driver can keep the interface
+    return bytes(dev.ctrl_transfer(0xc0, CMD_GET_STATS, 1 if reset else 0, 0, LENGTH))
+
+
+def bin_label(n):
+    if n == 0:
+        return "< 2 us"
+    if n == BINS - 1:
+        return ">= %d us" % (1 << n)
+    return "%d-%d us" % (1 << n, (2 << n) - 1)
+
+
+def show(data):
+    if len(data) < LENGTH:
+        sys.exit("short GET_STATS reply, %d bytes (firmware built with STATS=0?)" % len(data))
+    values = struct.unpack_from("<%dI" % (LENGTH // 4), data)
+    for i, name in enumerate(COUNTERS):
+        print("%-14s %10d" % (name, values[i]))
+    for h, name in enumerate(HISTOGRAMS):
+        bins = values[len(COUNTERS) + h * BINS:len(COUNTERS) + (h + 1) * BINS]
+        total = sum(bins)
+        print("\n%s, %d samples" % (name, total))
+        for n, count in enumerate(bins):
+            if count:
+                print("  %-16s %10d %5.1f%%" % (bin_label(n), count, 100.0 * count / total))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Read the i2c-mega-usb transaction statistics")
+    parser.add_argument("-c", "--clear", action="store_true",
+                        help="clear the statistics after reading them")
+    args = parser.parse_args()
+    show(read_device(args.clear))
+
+
+if __name__ == "__main__":
+    main()
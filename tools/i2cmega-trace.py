@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+#
+# i2cmega-trace.py - read and decode the i2c-mega-usb binary event trace
+#
+# Copyright (C) 2019 Christian Schmidt
+#
+# Reads the trace buffer with CMD_GET_TRACE (needs pyusb) or decodes a raw
+# dump of GET_TRACE replies, and prints one line per event.
+
+import argparse
+import struct
+import sys
+
+VENDOR_ID = 0x0403
+PRODUCT_ID = 0xc631
+CMD_GET_TRACE = 16
+F_CPU = 16000000
+
+# Same table as in trace.h: name and format of the three argument bytes
+EVENTS = {
+    1:  ("BOOT",          "version {0}.{1}.{2}"),
+    2:  ("REQUEST",       "bRequest {0} wIndex 0x{1:02x} wLength {2}"),
+    3:  ("UNKNOWN",       "bmRequestType 0x{0:02x} bRequest {1} wValue 0x{2:02x}"),
+    4:  ("QUEUE_FULL",    "bRequest {0}"),
+    5:  ("IO",            "SLA 0x{0:02x} bRequest {1} wLength {2}"),
+    6:  ("START",         "SLA 0x{0:02x}"),
+    7:  ("ACK",           "SLA 0x{0:02x}"),
+    8:  ("NAK",           "SLA 0x{0:02x} engine state {1}"),
+    9:  ("TIMEOUT",       "SLA 0x{0:02x}"),
+    10: ("STOP",          "bus {0}"),
+    11: ("RX_FAILED",     "{0} bytes left"),
+    12: ("TX_FAILED",     "{0} bytes left"),
+    13: ("DONE",          "status {0} internal {1}"),
+    14: ("TWI_INIT",      "prescaler bits {0} TWBR {1}"),
+    15: ("SET_INTERFACE", "alternate setting {0}"),
+    16: ("BATCH",         "{0} messages, {1} bytes"),
+    17: ("TWI_ERROR",     "TWSR 0x{0:02x}"),
+    18: ("POLL",          "{0} entries"),
+    19: ("PEC_FAILED",    "expected 0x{0:02x}, got 0x{1:02x}"),
+    20: ("STREAM",        "addr 0x{0:02x} len {1} status {2}"),
+    21: ("RECOVER",       "engine state {0}, {1} clocks, lines 0x{2:x}"),
+    22: ("SCAN",          "0x{0:02x} to 0x{1:02x}, {2} found"),
+    23: ("SCRIPT",        "status {0} at {1}, {2} bytes read"),
+    24: ("PROGRAM",       "addr 0x{0:02x} status {1}, {2} polls"),
+    25: ("ALERT",         "addr 0x{0:02x} status {1}, {2} bytes"),
+    26: ("SLAVE",         "addr 0x{0:02x} {1} registers, update {2}"),
+    27: ("MONITOR",       "on {0}"),
+    28: ("CONFIG",        "{0} (0 deleted, 1 saved, 2 applied) flags 0x{1:02x}"),
+    29: ("FANOUT",        "{0} addresses, {1} acknowledged, {2} bytes"),
+}
+
+
+def decode(data, last=None):
+    """Decodes one GET_TRACE reply, returns the timestamp of the last event"""
+    if len(data) < 2:
+        return last
+    count, lost = data[0], data[1]
+    if lost:
+        print("--- %d events lost ---" % lost)
+    for i in range(count):
+        ticks, eid, a0, a1, a2 = struct.unpack_from("<IBBBB", data, 2 + 8 * i)
+        name, fmt = EVENTS.get(eid, ("EVENT_%d" % eid, "{0} {1} {2}"))
+        if name == "BATCH":
+            a1 |= a2 << 8
+        delta = "" if last is None else "+%.1f" % (((ticks - last) & 0xffffffff) * 1e6 / F_CPU)
+        print("%12.1f %10s  %-13s %s" % (ticks * 1e6 / F_CPU, delta, name,
+                                         fmt.format(a0, a1, a2)))
+        last = ticks
+    return last
+
+
+def read_device(length):
+    import usb.core
+    dev = usb.core.find(idVendor=VENDOR_ID, idProduct=PRODUCT_ID)
+    if dev is None:
+        sys.exit("no i2c-mega-usb device found")
+    # Sent to the device, so the kernel driver can keep the interface
+    return bytes(dev.ctrl_transfer(0xc0, CMD_GET_TRACE, 0, 0, length))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Read and decode the i2c-mega-usb event trace")
+    parser.add_argument("-f", "--file", help="decode a raw dump instead of reading the device")
+    parser.add_argument("-r", "--raw", help="also write the raw replies to this file")
+    parser.add_argument("-n", "--length", type=int, default=1024,
+                        help="wLength of each GET_TRACE request")
+    args = parser.parse_args()
+
+    last = None
+    if args.file:
+        data = open(args.file, "rb").read()
+        while len(data) >= 2:
+            size = 2 + 8 * data[0]
+            last = decode(data[:size], last)
+            data = data[size:]
+        return
+
+    raw = open(args.raw, "ab") if args.raw else None
+    while True:
+        data = read_device(args.length)
+        if raw:
+            raw.write(data)
+        last = decode(data, last)
+        if len(data) < 2 or data[0] < (args.length - 2) // 8:
+            break
+
+
+if __name__ == "__main__":
+    main()
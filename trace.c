@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* trace.c - binary event trace						     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* Events go into a RAM ring buffer as fixed size binary records, which
+ * costs a few dozen cycles instead of a formatted serial line. When the
+ * buffer is full, the oldest events are overwritten and counted as
+ * lost. CMD_GET_TRACE reads the buffer out and tools/i2cmega-trace.py
+ * turns it back into text. */
+
+#include <util/atomic.h>
+
+#include "Config/AppConfig.h"
+#include "Descriptors.h"
+
+#include "clock.h"
+#include "stats.h"
+#include "trace.h"
+
+#if I2C_TRACE_EVENTS
+
+#if (I2C_TRACE_EVENTS & (I2C_TRACE_EVENTS - 1)) || I2C_TRACE_EVENTS > 128
+#error I2C_TRACE_EVENTS must be a power of two up to 128
+#endif
+
+typedef struct {
+    uint32_t ticks;
+    uint8_t  id;
+    uint8_t  arg[3];
+} trace_event_t;
+
+static trace_event_t    trace_buf[I2C_TRACE_EVENTS];
+static volatile uint8_t trace_head;
+static volatile uint8_t trace_tail;
+static volatile uint8_t trace_lost;
+
+void trace (const uint8_t id, const uint8_t a0, const uint8_t a1,
+            const uint8_t a2) {
+    trace_event_t *event;
+
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        event = &trace_buf[trace_head++ & (I2C_TRACE_EVENTS - 1)];
+        if ((uint8_t)(trace_head - trace_tail) > I2C_TRACE_EVENTS) {
+            trace_tail++;
+            if (trace_lost != 0xff)
+                trace_lost++;
+        }
+        event->ticks  = clock_ticks ();
+        event->id     = id;
+        event->arg[0] = a0;
+        event->arg[1] = a1;
+        event->arg[2] = a2;
+    }
+}
+
+/* Writes a byte to the control endpoint, sending full packets */
+static void trace_write (const uint8_t data) {
+    if (Endpoint_BytesInEndpoint () == FIXED_CONTROL_ENDPOINT_SIZE) {
+        Endpoint_ClearIN ();
+        while (!Endpoint_IsINReady ())
+            if (USB_DeviceState == DEVICE_STATE_Unattached)
+                return;
+    }
+    Endpoint_Write_8 (data);
+}
+
+/* Sends the oldest events in the data stage of CMD_GET_TRACE and drops
+ * them from the buffer. Events are copied one at a time, so tracing goes
+ * on while the host reads. */
+void trace_send (const uint16_t length) {
+    trace_event_t event;
+    uint8_t count, lost, i;
+    uint16_t sent;
+
+    /* Too short for the header, which must not lose its count of lost
+     * events */
+    if (length < 2) {
+        Endpoint_StallTransaction ();
+        STATS_ADD (STATS_STALLS, 1);
+        return;
+    }
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        count = trace_head - trace_tail;
+        lost  = trace_lost;
+        trace_lost = 0;
+    }
+    if (count > (length - 2) / sizeof (event))
+        count = (length - 2) / sizeof (event);
+
+    trace_write (count);
+    trace_write (lost);
+    for (i = 0; i < count; i++) {
+        ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+            event = trace_buf[trace_tail++ & (I2C_TRACE_EVENTS - 1)];
+        }
+        trace_write (event.ticks);
+        trace_write (event.ticks >> 8);
+        trace_write (event.ticks >> 16);
+        trace_write (event.ticks >> 24);
+        trace_write (event.id);
+        trace_write (event.arg[0]);
+        trace_write (event.arg[1]);
+        trace_write (event.arg[2]);
+    }
+    Endpoint_ClearIN ();
+
+    /* A transfer shorter than requested that ends on a packet boundary
+     * needs a zero length packet */
+    sent = 2 + count * sizeof (event);
+    if (sent < length && !(sent % FIXED_CONTROL_ENDPOINT_SIZE)) {
+        while (!Endpoint_IsINReady ())
+            if (USB_DeviceState == DEVICE_STATE_Unattached)
+                return;
+        Endpoint_ClearIN ();
+    }
+}
+
+#endif
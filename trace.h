@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* trace.h - binary event trace						     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __trace_h_included__
+#define __trace_h_included__
+
+#include <stdint.h>
+
+#include "Config/AppConfig.h"
+
+/* Event IDs. The comments list the three argument bytes; the host side
+ * decoder in tools/i2cmega-trace.py has the same table. */
+enum {
+    TRACE_BOOT = 1,         /* version major, minor, revision */
+    TRACE_REQUEST,          /* bRequest, wIndex, wLength (low bytes) */
+    TRACE_UNKNOWN,          /* bmRequestType, bRequest, wValue */
+    TRACE_QUEUE_FULL,       /* bRequest */
+    TRACE_IO,               /* address, bRequest, wLength */
+    TRACE_START,            /* SLA */
+    TRACE_ACK,              /* SLA */
+    TRACE_NAK,              /* SLA, engine state */
+    TRACE_TIMEOUT,          /* SLA */
+    TRACE_STOP,             /* bus */
+    TRACE_RX_FAILED,        /* bytes left */
+    TRACE_TX_FAILED,        /* bytes left */
+    TRACE_DONE,             /* status, internal status */
+    TRACE_TWI_INIT,         /* TWSR prescaler bits, TWBR */
+    TRACE_SET_INTERFACE,    /* alternate setting */
+    TRACE_BATCH,            /* messages, length */
+    TRACE_TWI_ERROR,        /* TWSR */
+    TRACE_POLL,             /* poll list entries */
+    TRACE_PEC_FAILED,       /* expected PEC, received PEC */
+    TRACE_STREAM,           /* address, length, status */
+    TRACE_RECOVER,          /* engine state, SCL clocks, SCL and SDA after */
+    TRACE_SCAN,             /* first address, last address, addresses found */
+    TRACE_SCRIPT,           /* status, offset, bytes read */
+    TRACE_PROGRAM,          /* address, status, polls of the last page */
+    TRACE_ALERT,            /* address of the alerting slave, status, length */
+    TRACE_SLAVE,            /* slave address, registers, update */
+    TRACE_MONITOR,          /* on */
+    TRACE_CONFIG,           /* 0 deleted, 1 saved, 2 applied; flags */
+    TRACE_FANOUT,           /* addresses written, acknowledged, length */
+};
+
+#if I2C_TRACE_EVENTS
+void trace (const uint8_t id, const uint8_t a0, const uint8_t a1,
+            const uint8_t a2);
+void trace_send (const uint16_t length);
+
+#define TRACE(id, a0, a1, a2)   trace (id, a0, a1, a2)
+#else
+#define TRACE(id, a0, a1, a2)   do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,521 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* twi.c - interrupt driven TWI master engine				     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+/* The TWI interrupt walks a message through START, address and data
+ * phases on its own. Data goes through a small ring buffer: the main
+ * loop fills it for writes and drains it for reads. Reads start right
+ * after the address phase, so the bus fetches the next packet while
+ * USB still sends the current one. If the buffer runs
+ * empty (write) or full (read), the interrupt switches itself off and
+ * leaves TWINT set, which keeps SCL low until the main loop catches up
+ * and switches it back on.
+ *
+ * While the interrupt waits for the hardware, a Timer1 compare match
+ * watches the bus phase. A phase that takes longer than its nominal
+ * time plus the timeout, e.g. a slave stretching the clock forever or
+ * holding SDA low, ends the message with TWI_TIMEOUT and switches the
+ * TWI off. The bus recovery, up to nine SCL clocks until SDA is
+ * released and then a STOP, both by hand on the port pins, takes 100 µs
+ * and more, so it is left to twi_task () in the main loop, or to the
+ * next START if that comes first. A STOP runs without the interrupt, so
+ * the next START waits for it, no longer than a phase may take, and
+ * recovers the bus the same way if a slave keeps SCL low.
+ *
+ * In slave mode (twi_slave ()) the TWI listens to its own address and
+ * the interrupt hands every byte to slave.c right away. Master messages
+ * fail with TWI_ERROR then, without touching the bus, and so they do
+ * while the TWI is off for the bus monitor (twi_release ()). */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+#include <util/twi.h>
+
+#include "Config/AppConfig.h"
+#include "clock.h"
+#include "profile.h"
+#include "slave.h"
+#include "stats.h"
+#include "trace.h"
+#include "twi.h"
+
+#if (TWI_BUFSIZE & (TWI_BUFSIZE - 1)) || TWI_BUFSIZE > 128
+#error TWI_BUFSIZE must be a power of two up to 128
+#endif
+
+volatile uint8_t twi_state = TWI_IDLE;
+
+static uint8_t           twi_buf[TWI_BUFSIZE];
+static volatile uint8_t  twi_head;      /* written by the producer */
+static volatile uint8_t  twi_tail;      /* written by the consumer */
+static volatile uint8_t  twi_sla;       /* address and direction */
+static volatile uint16_t twi_left;      /* bytes not yet started on the bus */
+static volatile uint8_t  twi_stalled;   /* interrupt off, waiting for the buffer */
+static volatile uint8_t  twi_block;     /* block read, count byte pending */
+static uint8_t           twi_blockmax;  /* largest count accepted */
+static uint8_t           twi_extra;     /* bytes read after the block */
+static uint32_t          twi_period = 16 + 2 * 72;  /* SCL period in ticks */
+static uint32_t          twi_timeout = I2C_TIMEOUT_US * CLOCK_TICKS_PER_US;
+static uint32_t          twi_limit = 10 * (16 + 2 * 72) +
+                                     I2C_TIMEOUT_US * CLOCK_TICKS_PER_US;
+                                        /* ticks a bus phase may take */
+static uint32_t          twi_probe;     /* twi_limit of probes, 0 none */
+static volatile uint32_t twi_deadline;  /* end of the running phase */
+static volatile uint8_t  twi_stuck;     /* state a phase timed out in,
+                                           recovery pending */
+static uint8_t           twi_target;    /* slave mode */
+static uint8_t           twi_passive;   /* off, pins left to the monitor */
+static uint8_t           twi_pullups = _BV(PD0) | _BV(PD1);
+                                        /* internal pull-ups in use */
+#if I2C_STATS
+static volatile uint16_t twi_len;       /* bytes of the message */
+static uint8_t           twi_open;      /* transaction counted, no STOP yet */
+static uint32_t          twi_begin;     /* clock_ticks () at its first START */
+#endif
+
+#define TWI_GO          (_BV(TWINT) | _BV(TWEN) | _BV(TWIE))
+/* Listening to the own address, off for the monitor, or idle master */
+#define TWI_LISTEN      (_BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA))
+#define TWI_RESTING     (twi_target ? TWI_LISTEN & ~_BV(TWINT) : \
+                         twi_passive ? 0 : _BV(TWEN))
+
+/* Bus pins, for the recovery */
+#define TWI_SCL         _BV(PD0)
+#define TWI_SDA         _BV(PD1)
+
+/* Finishes the message, keeping the bus */
+static inline void twi_hold (const uint8_t state) {
+    TWCR = _BV(TWEN);
+    twi_state = state;
+}
+
+/* Waits for the buffer with TWINT still set */
+static inline void twi_stall (void) {
+    TWCR = _BV(TWEN);
+    twi_stalled = 1;
+}
+
+/* Slave mode, the master waits with SCL low until TWINT is cleared */
+static inline void twi_target_interrupt (const uint8_t status) {
+    switch (status) {
+    case TW_SR_SLA_ACK:
+        slave_begin (0);
+        TWCR = TWI_LISTEN;
+        break;
+    case TW_SR_DATA_ACK:
+        /* Without TWEA the next byte is NAKed */
+        TWCR = slave_receive (TWDR) ? TWI_LISTEN : TWI_LISTEN & ~_BV(TWEA);
+        break;
+    case TW_ST_SLA_ACK:
+        slave_begin (1);
+        /* fall through */
+    case TW_ST_DATA_ACK:
+        TWDR = slave_transmit ();
+        TWCR = TWI_LISTEN;
+        break;
+    case TW_BUS_ERROR:
+        TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
+        STATS_ADD (STATS_BUS_ERRORS, 1);
+        break;
+    default:
+        /* STOP, repeated START, the end of a read or a NAKed byte:
+         * back to listening */
+        TWCR = TWI_LISTEN;
+        break;
+    }
+}
+
+static inline void twi_interrupt (void) {
+    uint8_t status = TW_STATUS;
+    uint8_t data;
+
+    if (twi_target) {
+        twi_target_interrupt (status);
+        return;
+    }
+    if (twi_stalled) {
+        /* Re-entered from twi_resume, the status was handled already */
+        twi_stalled = 0;
+    } else {
+        switch (status) {
+        case TW_START:
+        case TW_REP_START:
+            TWDR = twi_sla;
+            TWCR = TWI_GO;
+            return;
+        case TW_MT_SLA_ACK:
+        case TW_MR_SLA_ACK:
+            twi_state = TWI_DATA;
+            break;
+        case TW_MT_DATA_ACK:
+            break;
+        case TW_MR_DATA_ACK:
+        case TW_MR_DATA_NACK:
+            data = TWDR;
+            twi_buf[twi_head++ & (TWI_BUFSIZE - 1)] = data;
+            if (twi_block) {
+                /* The count sizes the rest of the message. One that
+                 * is out of range ends it after one more byte. */
+                twi_block = 0;
+                twi_left  = (data && data <= twi_blockmax) ? data + twi_extra : 1;
+#if I2C_STATS
+                twi_len  += twi_left;
+#endif
+            }
+            break;
+        case TW_MT_SLA_NACK:
+        case TW_MR_SLA_NACK:
+            twi_hold (TWI_ADDR_NAK);
+            STATS_ADD (STATS_ADDR_NAKS, 1);
+            return;
+        case TW_MT_DATA_NACK:
+            twi_hold (TWI_DATA_NAK);
+            STATS_ADD (STATS_DATA_NAKS, 1);
+            return;
+        case TW_BUS_ERROR:
+            /* Release SDA and SCL */
+            TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+            twi_state = TWI_ERROR;
+            TRACE (TRACE_TWI_ERROR, status, 0, 0);
+            STATS_ADD (STATS_BUS_ERRORS, 1);
+            return;
+        default:
+            /* Arbitration lost, the TWI already let go of the bus */
+            TWCR = _BV(TWINT) | _BV(TWEN);
+            twi_state = TWI_ERROR;
+            TRACE (TRACE_TWI_ERROR, status, 0, 0);
+            STATS_ADD (STATS_BUS_ERRORS, 1);
+            return;
+        }
+    }
+
+    if (!twi_left) {
+        twi_hold (TWI_HOLD);
+        return;
+    }
+    if (twi_sla & TW_READ) {
+        /* Reads run ahead of the consumer until the buffer is full */
+        if ((uint8_t)(twi_head - twi_tail) == TWI_BUFSIZE) {
+            twi_stall ();
+            return;
+        }
+        /* Acknowledge everything but the last byte */
+        if (--twi_left || twi_block)
+            TWCR = TWI_GO | _BV(TWEA);
+        else
+            TWCR = TWI_GO;
+    } else {
+        if (twi_head == twi_tail) {
+            twi_stall ();
+            return;
+        }
+        TWDR = twi_buf[twi_tail++ & (TWI_BUFSIZE - 1)];
+        twi_left--;
+        TWCR = TWI_GO;
+    }
+}
+
+/* Ticks the running bus phase may take */
+#define twi_phase_limit()       (twi_probe ? twi_probe : twi_limit)
+
+/* Starts watching the bus phase the hardware runs from now on */
+static void twi_arm (void) {
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        twi_deadline = clock_ticks () + twi_phase_limit ();
+        OCR1A   = (uint16_t)twi_deadline;
+        TIFR1   = _BV(OCF1A);
+        TIMSK1 |= _BV(OCIE1A);
+    }
+}
+
+static void twi_disarm (void) {
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        TIMSK1 &= ~_BV(OCIE1A);
+    }
+}
+
+ISR (TWI_vect) {
+    PROFILE_START ();
+
+    twi_interrupt ();
+    /* Every interrupt is progress. Without TWIE the bus waits for us. */
+    if (twi_target)
+        twi_disarm ();
+    else if (TWCR & _BV(TWIE))
+        twi_arm ();
+    else
+        twi_disarm ();
+    PROFILE_END (PROFILE_TWI, 0);
+}
+
+/* Drives a bus line low or leaves it to the pull-up, the internal one
+ * only if it is in use */
+static inline void twi_line (const uint8_t pin, const uint8_t high) {
+    if (high) {
+        DDRD  &= ~pin;
+        PORTD  = (PORTD & ~pin) | (twi_pullups & pin);
+    } else {
+        PORTD &= ~pin;
+        DDRD  |= pin;
+    }
+    _delay_us (5);
+}
+
+/* Frees the bus from a slave in the middle of a byte: clocks until it
+ * lets go of SDA, at most the nine clocks of a byte and its ACK, and
+ * ends with a STOP. The TWI gives the pins to the port meanwhile. Runs
+ * from the main loop, as it takes at least 110 µs. */
+static void twi_recover (const uint8_t state) {
+    uint8_t clocks;
+
+    TWCR = 0;
+    twi_stuck = 0;
+    for (clocks = 0; clocks < 9 && !(PIND & TWI_SDA); clocks++) {
+        twi_line (TWI_SCL, 0);
+        twi_line (TWI_SCL, 1);
+    }
+    twi_line (TWI_SCL, 0);
+    twi_line (TWI_SDA, 0);
+    twi_line (TWI_SCL, 1);
+    twi_line (TWI_SDA, 1);
+    TWCR = TWI_RESTING;
+    TRACE (TRACE_RECOVER, state, clocks, PIND & (TWI_SCL | TWI_SDA));
+}
+
+/* The compare match comes every 65536 ticks until the deadline passes.
+ * The message ends here, the bus is recovered by twi_task (). */
+ISR (TIMER1_COMPA_vect) {
+    if ((int32_t)(clock_ticks () - twi_deadline) < 0)
+        return;
+    TIMSK1 &= ~_BV(OCIE1A);
+    TWCR = 0;
+    twi_stuck   = twi_state;
+    twi_stalled = 0;
+    twi_state   = TWI_TIMEOUT;
+    STATS_ADD (STATS_TIMEOUTS, 1);
+}
+
+/* Called from the main loop, recovers the bus after a timeout */
+void twi_task (void) {
+    if (twi_stuck)
+        twi_recover (twi_stuck);
+}
+
+/* Lets the interrupt continue after the main loop touched the buffer.
+ * TWINT is still set, so enabling the interrupt enters it right away. */
+static inline void twi_resume (void) {
+    if (twi_stalled)
+        TWCR = _BV(TWEN) | _BV(TWIE);
+}
+
+void twi_init (const uint8_t prescale, const uint8_t bitlength) {
+    twi_disarm ();
+    TWCR = 0;
+    TWSR = prescale;
+    TWBR = bitlength;
+    TWCR = TWI_RESTING;
+    twi_state   = TWI_IDLE;
+    twi_stalled = 0;
+    twi_period  = 16 + 2 * (uint32_t)bitlength * (1 << (2 * prescale));
+    /* START or repeated START and the address byte are the longest phase */
+    twi_limit   = 10 * twi_period + twi_timeout;
+}
+
+/* Sets how much longer than nominal a bus phase may take, in µs.
+ * Returns the previous setting. */
+uint16_t twi_set_timeout (const uint16_t us) {
+    uint16_t old = twi_timeout / CLOCK_TICKS_PER_US;
+
+    twi_timeout = (uint32_t)us * CLOCK_TICKS_PER_US;
+    twi_limit   = 10 * twi_period + twi_timeout;
+    return old;
+}
+
+/* Gives the messages from now on a timeout of us µs instead, for probes
+ * that should fail fast, without touching the setting of the host. 0
+ * goes back to that setting. */
+void twi_set_probe_timeout (const uint16_t us) {
+    twi_probe = us ? 10 * twi_period + (uint32_t)us * CLOCK_TICKS_PER_US : 0;
+}
+
+#if I2C_STATS
+/* Counts the bytes that went over the bus in the message that ends and,
+ * at a STOP, the time the transaction held the bus */
+static void twi_account (const uint8_t stop) {
+    if (!twi_open)
+        return;
+    STATS_ADD ((twi_sla & TW_READ) ? STATS_READ_BYTES : STATS_WRITE_BYTES,
+               twi_len - twi_left);
+    twi_len = 0;
+    if (stop) {
+        STATS_TIME (STATS_BUS, clock_ticks () - twi_begin);
+        twi_open = 0;
+    }
+}
+#else
+#define twi_account(stop)       ((void)0)
+#endif
+
+/* Answers the bus master at addr (7 bit) from now on, 0 goes back to
+ * master mode. Only called while no master message is open. */
+void twi_slave (const uint8_t addr) {
+    twi_task ();
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+        TWAR = addr << 1;
+        twi_target = addr != 0;
+        TWCR = TWI_RESTING;
+    }
+    twi_state = TWI_IDLE;
+}
+
+/* Switches the TWI off and leaves the pins to the bus monitor, or takes
+ * them back. Only called while no master message is open. */
+void twi_release (const uint8_t off) {
+    twi_task ();
+    twi_passive = off;
+    TWCR = TWI_RESTING;
+    twi_state = TWI_IDLE;
+}
+
+/* Switches the internal pull-ups of the bus pins on or off, for buses
+ * with pull-up resistors of their own. The bus recovery keeps to it. */
+void twi_set_pullups (const uint8_t on) {
+    twi_pullups = on ? TWI_SCL | TWI_SDA : 0;
+    PORTD = (PORTD & ~(TWI_SCL | TWI_SDA)) | twi_pullups;
+}
+
+/* Neither slave mode nor the monitor has the TWI */
+uint8_t twi_master (void) {
+    return !twi_target && !twi_passive;
+}
+
+/* Waits for a previous STOP that may still be on its way, returns 0 if
+ * it took too long and the bus was recovered */
+static uint8_t twi_stopped (void) {
+    uint32_t begin = clock_ticks ();
+
+    while (TWCR & _BV(TWSTO)) {
+        if (clock_ticks () - begin > twi_phase_limit ()) {
+            twi_recover (TWI_IDLE);
+            STATS_ADD (STATS_TIMEOUTS, 1);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void twi_go (const uint8_t sla, const uint16_t len) {
+    if (!twi_master ()) {
+        twi_state = TWI_ERROR;
+        return;
+    }
+    twi_task ();
+    if (!twi_stopped ()) {
+        twi_state = TWI_TIMEOUT;
+        return;
+    }
+#if I2C_STATS
+    if (twi_open) {
+        twi_account (0);
+    } else {
+        twi_open  = 1;
+        twi_begin = clock_ticks ();
+        STATS_ADD (STATS_TRANSACTIONS, 1);
+    }
+    twi_len     = len;
+#endif
+    twi_head    = 0;
+    twi_tail    = 0;
+    twi_sla     = sla;
+    twi_left    = len;
+    twi_stalled = 0;
+    twi_state   = TWI_ADDRESS;
+    twi_arm ();
+    TWCR = TWI_GO | _BV(TWSTA);
+}
+
+/* Sends a START, or a repeated START if the bus is still owned, and
+ * addresses the slave. len data bytes follow in the direction given by
+ * the lowest address bit. */
+void twi_start (const uint8_t sla, const uint16_t len) {
+    twi_block = 0;
+    twi_go (sla, len);
+}
+
+/* Starts an SMBus block read: the first byte read is the count of the
+ * data bytes that follow, at most max, then extra bytes (the PEC). */
+void twi_start_block (const uint8_t sla, const uint8_t max,
+                      const uint8_t extra) {
+    twi_block    = 1;
+    twi_blockmax = max;
+    twi_extra    = extra;
+    twi_go (sla | TW_READ, 1);
+}
+
+/* Ends the transaction with a STOP. Only valid while no byte is moving
+ * on the bus, i.e. when the message is finished or stalled. */
+void twi_stop (void) {
+    twi_account (1);
+    twi_disarm ();
+    if (twi_state != TWI_IDLE && twi_state < TWI_ERROR)
+        TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+    twi_stalled = 0;
+    twi_state   = TWI_IDLE;
+}
+
+/* Gives up on a message that makes no progress, e.g. a slave stretching
+ * the clock forever. Resetting the TWI releases both bus lines. */
+void twi_abort (void) {
+    twi_account (1);
+    twi_disarm ();
+    TWCR = 0;
+    TWCR = TWI_RESTING;
+    twi_stalled = 0;
+    twi_state   = TWI_IDLE;
+}
+
+/* Free space for write data */
+uint8_t twi_room (void) {
+    return TWI_BUFSIZE - (uint8_t)(twi_head - twi_tail);
+}
+
+/* Queues a byte to be written, returns 0 if the buffer is full */
+uint8_t twi_put (const uint8_t data) {
+    if ((uint8_t)(twi_head - twi_tail) == TWI_BUFSIZE)
+        return 0;
+    twi_buf[twi_head & (TWI_BUFSIZE - 1)] = data;
+    twi_head++;
+    twi_resume ();
+    return 1;
+}
+
+/* Takes a byte that was read, returns 0 if none is available */
+uint8_t twi_get (uint8_t *data) {
+    if (twi_head == twi_tail)
+        return 0;
+    *data = twi_buf[twi_tail & (TWI_BUFSIZE - 1)];
+    twi_tail++;
+    twi_resume ();
+    return 1;
+}
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ------------------------------------------------------------------------- */
+/*									     */
+/* twi.h - interrupt driven TWI master engine				     */
+/*									     */
+/* ------------------------------------------------------------------------- */
+/*   Copyright (C) 2019 Christian Schmidt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA 02110-1301 USA.							     */
+/* ------------------------------------------------------------------------- */
+
+#ifndef __twi_h_included__
+#define __twi_h_included__
+
+#include <stdint.h>
+
+/* Engine states. Everything from TWI_HOLD on means the current message
+ * is finished; in TWI_HOLD, TWI_ADDR_NAK and TWI_DATA_NAK the bus is
+ * still owned and waits for a repeated START or a STOP. */
+enum {
+    TWI_IDLE,           /* bus released */
+    TWI_ADDRESS,        /* START and address phase in progress */
+    TWI_DATA,           /* data phase in progress or waiting for the buffer */
+    TWI_HOLD,           /* message complete */
+    TWI_ADDR_NAK,       /* address not acknowledged */
+    TWI_DATA_NAK,       /* written byte not acknowledged */
+    TWI_ERROR,          /* bus error or arbitration lost, bus released */
+    TWI_TIMEOUT         /* phase timed out, bus recovered and released */
+};
+
+extern volatile uint8_t twi_state;
+
+/* Message in progress on the bus */
+#define twi_busy()      (twi_state == TWI_ADDRESS || twi_state == TWI_DATA)
+/* Message failed on the bus */
+#define twi_failed()    (twi_state >= TWI_ADDR_NAK)
+
+void    twi_init (const uint8_t prescale, const uint8_t bitlength);
+void    twi_task (void);
+void    twi_start (const uint8_t sla, const uint16_t len);
+void    twi_start_block (const uint8_t sla, const uint8_t max,
+                         const uint8_t extra);
+uint16_t twi_set_timeout (const uint16_t us);
+void    twi_set_probe_timeout (const uint16_t us);
+void    twi_slave (const uint8_t addr);
+void    twi_release (const uint8_t off);
+uint8_t twi_master (void);
+void    twi_set_pullups (const uint8_t on);
+void    twi_stop (void);
+void    twi_abort (void);
+uint8_t twi_room (void);
+uint8_t twi_put (const uint8_t data);
+uint8_t twi_get (uint8_t *data);
+
+#endif